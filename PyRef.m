@@ -0,0 +1,38 @@
+% A handle to a Python object that stays in Python.
+%
+% Created by h = py('ref', expr). A PyRef can be passed wherever a value is
+% accepted by py('set', ...), py('call', ...) and py('batch', ...), and is
+% turned back into the Python object it refers to without crossing into
+% MATLAB.
+%
+% The Python object is released when the last copy of the handle is cleared,
+% or earlier with py('release', h). py('deref', h) or h.deref() converts it
+% into a MATLAB value.
+%
+% Examples:
+%	h = py('ref', 'numpy.random.rand(10000, 10000)')
+%	py('set', 'x', h)
+%	m = py('call', 'numpy.mean', h)
+%	v = h.deref()
+
+classdef PyRef < handle
+	properties (SetAccess = private)
+		Id
+	end
+
+	methods
+		function obj = PyRef(id)
+			obj.Id = id;
+		end
+
+		function value = deref(obj)
+			value = py('deref', obj);
+		end
+
+		function delete(obj)
+			if ~isempty(obj.Id)
+				py('release', obj.Id);
+			end
+		end
+	end
+end
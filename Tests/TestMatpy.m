@@ -243,6 +243,98 @@ function TestLogicalExportImport
 
 end
 
+%% Test N-D matrix Export and Import keeps its shape
+function TestMatrixExportImport
+
+    expected = reshape(1:24, [2 3 4]);
+    tmp = expected;
+
+    py_export tmp;
+    tmp = '';
+    py_import tmp;
+
+    actual = tmp;
+
+    assertEqual(expected, actual, 'matrix export and/or import not successful');
+
+end
+
+%% Test exported matrix with the copy option does not share MATLAB data
+function TestMatrixExportCopy
+
+    expected = magic(4);
+
+    py('set', 'tmp', expected, 'copy', true);
+    py('eval', 'tmp[0, 0] = -1');
+
+    actual = py('get', 'tmp[1:, :]');
+
+    assertEqual(expected(2:end, :), actual, 'matrix export with copy not successful');
+    assertEqual(-1, py('get', 'float(tmp[0, 0])'), 'exported copy is not writable');
+
+end
+
+%% Test ndarray Import of every supported dtype
+function TestNdarrayImportDtypes
+
+    dtypes = {'bool', 'int8', 'uint8', 'int16', 'uint16', 'int32', 'uint32', 'int64', 'uint64', 'float32', 'float64'};
+    classes = {'logical', 'int8', 'uint8', 'int16', 'uint16', 'int32', 'uint32', 'int64', 'uint64', 'single', 'double'};
+
+    py('eval', 'import numpy');
+    for i = 1:numel(dtypes)
+        py('eval', ['tmp = numpy.arange(6).reshape(2, 3).astype("', dtypes{i}, '")']);
+        actual = py('get', 'tmp');
+        expected = cast([0 1 2; 3 4 5], classes{i});
+
+        assertEqual(expected, actual, [dtypes{i}, ' ndarray import not successful']);
+    end
+
+end
+
+%% Test Import of C ordered, transposed and strided ndarrays
+function TestNdarrayImportLayouts
+
+    expected = reshape(0:59, [3 4 5]);
+
+    py('eval', 'import numpy');
+    py('eval', 'tmp = numpy.arange(60.0).reshape(5, 4, 3).transpose()');
+    assertEqual(expected, py('get', 'tmp'), 'transposed ndarray import not successful');
+    assertEqual(expected, py('get', 'numpy.ascontiguousarray(tmp)'), 'C ordered ndarray import not successful');
+    assertEqual(expected(1:2:end, :, end:-1:1), py('get', 'tmp[::2, :, ::-1]'), 'strided ndarray import not successful');
+
+end
+
+%% Test complex Export and Import
+function TestComplexExportImport
+
+    expected = complex(magic(4), -magic(4));
+    py('set', 'tmp', expected);
+    assertEqual(expected, py('get', 'tmp'), 'complex double export and/or import not successful');
+    assertEqual('complex128', py('get', 'tmp.dtype.name'), 'complex double exported with wrong dtype');
+
+    expected = single(expected);
+    py('set', 'tmp', expected);
+    assertEqual(expected, py('get', 'tmp'), 'complex single export and/or import not successful');
+
+    py('set', 'tmp', complex(int16([1 2 3]), int16([4 5 6])));
+    assertEqual(single(complex([1 2 3], [4 5 6])), py('get', 'tmp'), 'complex int16 export not successful');
+
+end
+
+%% Test complex 64-bit integers are only exported when loss is allowed
+function TestComplexInt64Export
+
+    function TestFunc
+        py('set', 'tmp', complex(int64(1), int64(2)));
+    end
+
+    assertExceptionThrown(@() TestFunc, 'matpy:LossyConversion');
+
+    py('set', 'tmp', complex(int64(1), int64(2)), 'lossy', true);
+    assertEqual(complex(1, 2), py('get', 'complex(tmp[0, 0])'), 'lossy complex int64 export not successful');
+
+end
+
 %% Test cell Export and import
 function TestCellExportImport
 
@@ -293,6 +385,451 @@ function TestStructExportImport2
     assertEqual(expected, actual, [dataType, ' export and/or import not successful']);
 end
 
+%% Test columnar struct Export and Import keeps the struct's dimensions
+function TestStructColumnsExportImport
+
+    expected = struct('a', {1, 2, 3; 4, 5, 6}, 'b', {'x', 'y', 'z'; 'u', 'v', 'w'});
+
+    py('set', 'tmp', expected, 'struct', 'columns');
+    assertEqual([1 2 3; 4 5 6], py('get', 'tmp["a"]'), 'numeric field not exported as one column');
+    assertEqual(expected, py('get', 'tmp'), 'columnar struct export and/or import not successful');
+
+    py('set', 'tmp', expected, 'struct', 'records');
+    assertEqual([1 2 3; 4 5 6], py('get', 'tmp.a'), 'numeric field not exported as a record field');
+    assertEqual(expected, py('get', 'tmp'), 'record array struct export and/or import not successful');
+
+end
+
+%% Test Import of a dictionary of 1-D ndarrays as a struct array
+function TestStructImportFromArrays
+
+    py('eval', 'import numpy');
+    py('eval', 'tmp = {"x": numpy.arange(3.0), "y": numpy.array([True, False, True])}');
+    expected = struct('x', {0, 1, 2}, 'y', {true, false, true});
+
+    assertEqual(expected, py('get', 'tmp'), 'struct import from ndarrays not successful');
+
+end
+
+%% Test packed cell export and import, numeric cells and cellstrs
+function TestCellPackedExportImport
+
+    py('set', 'tmp', {1, 2; 3, 4}, 'cell', 'packed');
+    assertEqual([1 2; 3 4], py('get', 'tmp'), 'numeric cell not exported as one array');
+
+    expected = {'a', 'bcd'; 'ef', ''};
+    py('set', 'tmp', expected, 'cell', 'packed');
+    assertEqual('<U3', py('get', 'tmp.dtype.str'), 'cellstr not exported as a unicode array');
+    assertEqual(expected, py('get', 'tmp'), 'cellstr export and/or import not successful');
+
+    py('set', 'tmp', {1, 'a'}, 'cell', 'packed');
+    assertEqual(true, py('get', 'isinstance(tmp, list)'), 'mixed cell not exported as a list');
+
+    py('eval', 'import numpy');
+    assertEqual({'x', 'yz'}, py('get', 'numpy.array(["x", "yz"])'), 'bytes array import not successful');
+
+end
+
+%% Test packed list import
+function TestListPackedImport
+
+    assertEqual([1 2.5 3], py('get', '[1.0, 2.5, 3.0]', 'cell', 'packed'), 'float list not packed');
+    assertEqual(int32([1 2 3]), py('get', '(1, 2, 3)', 'cell', 'packed'), 'int tuple not packed');
+    assertEqual([true false], py('get', '[True, False]', 'cell', 'packed'), 'bool list not packed');
+    assertEqual({1, int32(2)}, py('get', '[1.0, 2]', 'cell', 'packed'), 'mixed list packed');
+    assertEqual({1, 2}, py('get', '[1.0, 2.0]'), 'list packed without the option');
+
+end
+
+%% Test sparse export and import through scipy.sparse
+function TestSparseExportImport
+
+    expected = sparse([1 3 5], [1 2 5], [1.5 -2 3], 1e6, 1e6);
+    py('set', 'tmp', expected);
+    assertEqual('csc_matrix', py('get', 'type(tmp).__name__'), 'sparse not exported as csc_matrix');
+    assertEqual(int32(3), py('get', 'tmp.nnz'), 'sparse export densified or lost entries');
+    assertEqual(expected, py('get', 'tmp'), 'sparse export and/or import not successful');
+
+    expected = sparse(logical([1 0; 0 1]));
+    py('set', 'tmp', expected);
+    assertEqual(expected, py('get', 'tmp'), 'logical sparse export and/or import not successful');
+
+    expected = sparse([1 2], [1 1], [1+2i 3], 2, 2);
+    py('set', 'tmp', expected);
+    assertEqual(expected, py('get', 'tmp'), 'complex sparse export and/or import not successful');
+
+    py('eval', 'import scipy.sparse');
+    actual = py('get', 'scipy.sparse.coo_matrix(([1.0, 2.0, 3.0, -1.0], ([2, 0, 2, 1], [1, 0, 1, 1])), shape=(3, 2))');
+    assertEqual(sparse([3 1 2], [2 1 2], [4 2 -1], 3, 2), actual, 'coo import with duplicates not successful');
+
+end
+
+%% Test table Export as a DataFrame and Import
+function TestTableExportImport
+
+    expected = table([1; 2; 3], {'a'; 'b'; 'c'}, categorical({'x'; 'y'; 'x'}), [true; false; true], ...
+        'VariableNames', {'num', 'name', 'kind', 'flag'});
+    py('set', 'tmp', expected);
+    assertEqual('DataFrame', py('get', 'type(tmp).__name__'), 'table not exported as DataFrame');
+    assertEqual({'num', 'name', 'kind', 'flag'}, py('get', 'list(tmp.columns)'));
+    assertEqual('category', py('get', 'str(tmp["kind"].dtype)'), 'categorical not exported as Categorical');
+    assertEqual(expected, py('get', 'tmp'), 'table export and/or import not successful');
+
+    expected.Properties.RowNames = {'r1', 'r2', 'r3'};
+    py('set', 'tmp', expected);
+    assertEqual(expected, py('get', 'tmp'), 'table row names not exported and/or imported');
+
+    py('eval', 'import pandas');
+    actual = py('get', 'pandas.DataFrame({"v": [1.5, 2.5]})');
+    assertEqual(table([1.5; 2.5], 'VariableNames', {'v'}), actual, 'DataFrame import not successful');
+
+end
+
+%% Test async jobs, results are collected by wait
+function TestAsync
+
+    f = py('get_async', 'sum(range(10))');
+    assertEqual(int32(45), py('wait', f), 'async expression result not collected');
+    assertExceptionThrown(@() py('poll', f), 'matpy:InvalidFuture');
+
+    py('eval', 'import time');
+    f1 = py('eval_async', 'time.sleep(0.5)');
+    f2 = py('eval_async', 'tmp = 1');
+    assertTrue(any(strcmp(py('poll', f2), {'queued', 'running'})), 'queued job not reported as pending');
+    assertExceptionThrown(@() py('wait', f1, 0.01), 'matpy:Timeout');
+    py('wait', f1);
+    py('wait', f2);
+    assertEqual(int32(1), py('get', 'tmp'), 'async statement not run');
+
+    f = py('get_async', '1 / 0');
+    assertExceptionThrown(@() py('wait', f), 'matpy:PythonError');
+
+end
+
+%% Test cancelling queued and running async jobs
+function TestAsyncCancel
+
+    f1 = py('eval_async', 'while True: pass');
+    f2 = py('eval_async', 'tmp = 2');
+    py('cancel', f2);
+    assertExceptionThrown(@() py('poll', f2), 'matpy:InvalidFuture');
+    pause(0.2);
+    py('cancel', f1);
+    assertExceptionThrown(@() py('wait', f1), 'matpy:InvalidFuture');
+    py('eval', 'tmp = 0');
+    py('wait', py('eval_async', 'pass'));
+    assertEqual(int32(0), py('get', 'tmp'), 'cancelled job run');
+
+    py('eval', 'import weakref; tmp = set()');
+    f = py('get_async', 'tmp');
+    while ~strcmp(py('poll', f), 'done')
+        pause(0.01);
+    end
+    py('eval', 'ref = weakref.ref(tmp); del tmp');
+    py('cancel', f);
+    assertExceptionThrown(@() py('poll', f), 'matpy:InvalidFuture');
+    assertTrue(py('get', 'ref() is None'), 'result of a polled job not released');
+
+end
+
+%% Test the out-of-process worker pool
+function TestPool
+
+    py('pool', 'start', 2);
+    assertEqual(2, py('pool', 'size'), 'pool not started with 2 workers');
+
+    assertEqual({1, 2; 3, 4}, py('pool', 'map', 'math.sqrt', {1, 4; 9, 16}), 'pool map not successful');
+    assertExceptionThrown(@() py('pool', 'map', 'len', cell(1, 3)), 'matpy:NullFieldValue');
+    big = {ones(1000), 2 * ones(1000)};
+    assertEqual({1e6, 2e6}, py('pool', 'map', 'numpy.sum', big), 'shared memory arrays not passed to workers');
+    assertEqual(big, py('pool', 'map', 'numpy.asarray', big), 'shared memory arrays not returned from workers');
+
+    py('pool', 'set', 1, 'x', 1);
+    py('pool', 'set', 2, 'x', 2);
+    assertEqual(1, py('pool', 'get', 1, 'x'), 'request not routed to worker 1');
+    assertEqual(2, py('pool', 'get', 2, 'x'), 'request not routed to worker 2');
+
+    shmFiles = 'len(__import__("glob").glob(__import__("matpy_pool").SHM_DIR + "/matpy-*"))';
+    before = py('get', shmFiles);
+    assertExceptionThrown(@() py('pool', 'get', 1, '[__import__("numpy").ones(10000), lambda: 0]'), 'matpy:PoolError');
+    assertEqual(before, py('get', shmFiles), 'shared memory of an unsent reply not unlinked');
+
+    assertExceptionThrown(@() py('pool', 'eval', 1, 'import os; os._exit(3)'), 'matpy:PoolError');
+    crash = 'import os, numpy, matpy_pool; matpy_pool._dumps(numpy.ones(10000), []); os._exit(3)';
+    assertExceptionThrown(@() py('pool', 'eval', 1, crash), 'matpy:PoolError');
+    assertEqual(before, py('get', shmFiles), 'shared memory of a crashed worker not unlinked');
+    assertEqual(2, py('pool', 'size'), 'crashed worker not restarted');
+    assertEqual(2, py('pool', 'get', 2, 'x'), 'crash affected another worker');
+
+    py('pool', 'stop');
+    assertEqual(0, py('pool', 'size'), 'pool not stopped');
+
+end
+
+%% Test per command counters and the trace timeline
+function TestStats
+
+    py('stats', 'reset');
+    py('set', 'tmp', zeros(100));
+    py('set', 'tmp', zeros(100));
+    assertEqual(zeros(100), py('get', 'tmp'));
+
+    stats = py('stats');
+    assertEqual(2, stats.set.calls, 'set calls not counted');
+    assertEqual(1, stats.get.calls, 'get calls not counted');
+    assertEqual(2 * 80000, stats.set.bytesIn, 'bytes converted in not counted');
+    assertEqual(80000, stats.get.bytesOut, 'bytes converted out not counted');
+    assertEqual(2, stats.set.objectsIn, 'objects converted in not counted');
+    assertEqual(1, stats.get.objectsOut, 'objects converted out not counted');
+    assertTrue(stats.get.time >= stats.get.executeTime + stats.get.convertOutTime, 'phases longer than the command');
+    assertTrue(~isfield(stats, 'stats'), 'stats command counted');
+
+    py('stats', 'reset');
+    assertTrue(isempty(fieldnames(py('stats'))), 'counters not reset');
+
+    file = [tempname '.json'];
+    py('stats', 'trace', file);
+    py('eval', 'x = 1');
+    py('eval', 'x = 2');
+    py('stats', 'trace', '');
+    trace = fileread(file);
+    delete(file);
+    assertTrue(~isempty(strfind(trace, '"traceEvents"')), 'trace not written');
+    assertTrue(~isempty(strfind(trace, '"name": "eval"')), 'command not traced');
+    assertTrue(~isempty(strfind(trace, ['},' char(10) '{'])), 'events not separated');
+    assertTrue(~isempty(regexp(trace, '\]\s*,\s*"displayTimeUnit"', 'once')), 'trace not completed');
+
+end
+
+%% Test unicode and char matrix Export and Import
+function TestStringExportImport
+
+    text = ['caf' char(233) ' ' char([55357 56832])];
+    py('set', 'tmp', text);
+    assertEqual(true, py('get', 'isinstance(tmp, unicode)'));
+    % len() counts UTF-16 units on narrow builds, UTF-32 counts code points on both
+    assertEqual(6, py('get', 'len(tmp.encode("utf-32-le")) // 4'));
+    assertEqual(text, py('get', 'tmp'));
+
+    py('set', 'tmp', 'plain');
+    assertEqual(true, py('get', 'isinstance(tmp, unicode)'), 'ASCII text not exported as unicode');
+    assertEqual('plain', py('get', 'tmp'));
+    assertEqual(['caf' char(233)], py('get', '''caf\xc3\xa9'''), 'UTF-8 str not decoded');
+    assertEqual(['caf' char(233)], py('get', '''caf\xe9'''), 'Latin-1 str not widened');
+
+    rows = ['abc'; 'def'];
+    py('set', 'tmp', rows);
+    assertEqual('U', py('get', 'tmp.dtype.kind'));
+    assertEqual({'abc', 'def'}, py('get', 'list(tmp)'));
+    assertEqual(rows, char(py('get', 'tmp')));
+
+    py('set', 'tmp', [char(945) 'b'; 'cd']);
+    assertEqual('U', py('get', 'tmp.dtype.kind'));
+    assertEqual({[char(945) 'b'], 'cd'}, py('get', 'tmp'));
+
+end
+
+%% Test Import of NumPy scalars, float16, datetime64 and Decimal
+function TestTypeConversions
+
+    py('eval', 'import numpy, decimal');
+    assertEqual(single(1.5), py('get', 'numpy.float16(1.5)'), 'float16 scalar import not successful');
+    assertEqual(true, py('get', 'numpy.bool_(True)'), 'numpy bool import not successful');
+    assertEqual(int64(2^40), py('get', 'numpy.int64(2 ** 40)'), 'numpy int64 scalar truncated');
+    assertEqual(single([1.5 2]), reshape(py('get', 'numpy.array([1.5, 2], dtype=numpy.float16)'), 1, []), 'float16 import not successful');
+
+    actual = py('get', 'numpy.array(["2020-01-02T12:00", "NaT"], dtype="datetime64[m]")');
+    assertEqual(datenum(2020, 1, 2, 12, 0, 0), actual(1), 'datetime64 import not successful');
+    assertTrue(isnan(actual(2)), 'NaT not imported as NaN');
+    assertEqual(1.5, py('get', 'numpy.timedelta64(36, "h")'), 'timedelta64 import not successful');
+    actual = py('get', 'numpy.array(["2020-01-02T12:00:00.000000001"], dtype="datetime64[ns]")');
+    assertEqual(datenum(2020, 1, 2, 12, 0, 0), actual, 'datetime64[ns] import not successful');
+    assertEqual(1.5, py('get', 'numpy.array([36 * 3600 * 10 ** 9], dtype="timedelta64[ns]")'), 'timedelta64[ns] import not successful');
+
+    assertEqual(0.25, py('get', 'decimal.Decimal("0.25")'), 'Decimal import not successful');
+
+end
+
+%% Test converters registered from Python
+function TestRegisteredConverter
+
+    py('eval', 'import matpy, fractions');
+    py('eval', sprintf('class Point(object):\n    def __init__(self, x, y): self.x, self.y = x, y'));
+    assertExceptionThrown(@() py('get', 'Point(1, 2)'), 'matpy:UnsupportedVariableType');
+
+    py('eval', 'matpy.register_converter(Point, lambda p: complex(p.x, p.y))');
+    py('eval', 'matpy.register_converter(fractions.Fraction, float)');
+    assertEqual(1 + 2i, py('get', 'Point(1, 2)'), 'registered converter not used');
+    assertEqual({0.5, 0.25}, py('get', '[fractions.Fraction(1, 2), fractions.Fraction(1, 4)]'), 'converter not used for items');
+
+    py('eval', 'matpy.unregister_converter(Point)');
+    py('eval', 'matpy.unregister_converter(fractions.Fraction)');
+    assertExceptionThrown(@() py('get', 'Point(1, 2)'), 'matpy:UnsupportedVariableType');
+
+end
+
+%% Test init once Python is running, paths and modules still apply
+function TestInit
+
+    folder = tempname;
+    mkdir(folder);
+    fid = fopen(fullfile(folder, 'matpy_init_test.py'), 'w');
+    fprintf(fid, 'value = 42\n');
+    fclose(fid);
+
+    times = py('init', struct('path', {{folder}}, 'modules', {{'matpy_init_test', 'os.path', 'sys'}}));
+    assertEqual(int32(42), py('get', 'matpy_init_test.value'), 'module not imported');
+    assertEqual(folder, py('get', 'sys.path[0]'), 'path not added');
+    assertTrue(times.total >= times.path + times.modules, 'phases longer than the total');
+    assertEqual(0, times.numpy, 'Python started twice');
+
+    assertExceptionThrown(@() py('init', struct('home', folder)), 'matpy:AlreadyInitialized');
+    assertExceptionThrown(@() py('init', struct('paths', folder)), 'matpy:UnrecognizedOption');
+    py('eval', 'sys.path.remove(sys.path[0])');
+    rmdir(folder, 's');
+
+end
+
+%% Test capturing printed output
+function TestCapture
+
+    [~, txt] = py('eval', 'import sys; print "out"; sys.stderr.write(u"err\u00e9\n")', 'capture', true);
+    assertEqual(sprintf('out\nerr\x00e9\n'), txt);
+
+    [value, txt] = py('get', '[sys.stdout.write("x"), 2][1]', 'capture', true);
+    assertEqual(2, value);
+    assertEqual('x', txt);
+
+    txt = py('eval', 'pass', 'capture', true);
+    assertTrue(ischar(txt) && isempty(txt), 'nothing printed but text captured');
+
+    [v, txt] = py('call', 'str', 'ns', 'options', struct('capture', true));
+    assertEqual('ns', v, 'positional argument taken as an option');
+    assertTrue(isempty(txt), 'nothing printed but text captured');
+    assertEqual('capture', py('call', 'str', 'capture'), 'positional argument taken as an option');
+    assertEqual('x', py('call', 'max', 'ns', 'x'), 'positional arguments taken as an ns option');
+    assertExceptionThrown(@() py('call', 'str', 1, 'options', struct('bogus', true)), 'matpy:UnrecognizedOption');
+
+    try
+        py('eval', 'raise ValueError("bad value")', 'capture', true);
+        assertTrue(false, 'no error raised');
+    catch e
+        assertEqual('matpy:PythonError', e.identifier);
+        assertTrue(~isempty(strfind(e.message, 'ValueError: bad value')), 'traceback not in the error');
+    end
+
+end
+
+%% Test namespaces keep their variables apart, and clear and memory
+function TestNamespaces
+
+    py('set', 'ns_x', 1.5);
+    py('set', 'ns_x', 2.5, 'ns', 'matpy_test');
+    py('eval', 'ns_y = ns_x * 2', 'ns', 'matpy_test');
+    assertEqual(1.5, py('get', 'ns_x'), 'namespaces share variables');
+    assertEqual(5, py('get', 'ns_y', 'ns', 'matpy_test'));
+    [v, txt] = py('get', 'ns_x', 'ns', 'matpy_test', 'capture', true);
+    assertEqual(2.5, v);
+    assertTrue(isempty(txt), 'nothing printed but text captured');
+
+    py('eval', 'import numpy; big = numpy.zeros(1 << 18); view = big[::2]', 'ns', 'matpy_test');
+    report = py('memory', 1e6);
+    assertEqual('__main__', report(1).namespace);
+    test = report(strcmp({report.namespace}, 'matpy_test'));
+    assertEqual(1, numel(test), 'namespace not reported');
+    assertEqual({'big'}, {test.variables.name}, 'views counted again');
+    assertEqual(8 * 2^18, test.variables(1).bytes);
+
+    py('clear', 'matpy_test', {'ns_y', 'missing'});
+    assertExceptionThrown(@() py('get', 'ns_y', 'ns', 'matpy_test'), 'matpy:PythonError');
+    assertEqual(2.5, py('get', 'ns_x', 'ns', 'matpy_test'), 'other variables cleared');
+    py('clear', 'matpy_test');
+    assertExceptionThrown(@() py('clear', 'matpy_test'), 'matpy:UnknownNamespace');
+    py('clear', '__main__', 'ns_x');
+    assertExceptionThrown(@() py('get', 'ns_x'), 'matpy:PythonError');
+
+    py('set', 'ns_x', 3, 'ns', 'matpy_test', 'copy', true);
+    assertEqual(3, py('get', 'ns_x', 'ns', 'matpy_test'), 'ns before set options not taken');
+    py('set', 'ns_x', 4, 'copy', true, 'ns', 'matpy_test');
+    assertEqual(4, py('get', 'ns_x', 'ns', 'matpy_test'), 'ns after set options not taken');
+    py('clear', 'matpy_test');
+
+    py('eval', 'import numpy');
+    py('set', 'ns_x', 1);
+    py('clear', '__main__');
+    assertExceptionThrown(@() py('get', 'ns_x'), 'matpy:PythonError');
+    assertEqual(3, py('get', 'numpy.ones(3).sum()'), 'imported module cleared');
+
+end
+
+%% Test calling MATLAB functions and workspace variables from Python
+function TestMatlabCallback
+
+    py('eval', 'import matlab');
+    assertEqual(6, py('get', 'matlab.call("sum", [1.0, 2.0, 3.0])'));
+    assertEqual([2 3], py('get', 'matlab.call("size", matlab.call("zeros", 2, 3))'));
+    py('eval', 'q, r = matlab.call("deal", 1.5, nout=2)');
+    assertEqual(1.5, py('get', 'r'));
+    assertEqual('float64', py('get', 'str(matlab.call("ones", 2, 2).dtype)'));
+
+    assignin('base', 'matpy_callback_x', int16([1 2 3]));
+    py('eval', 'matlab.put("matpy_callback_y", matlab.get("matpy_callback_x") * 2)');
+    assertEqual(int16([2 4 6]), evalin('base', 'matpy_callback_y'));
+    evalin('base', 'clear matpy_callback_x matpy_callback_y');
+
+    assertExceptionThrown(@() py('eval', 'matlab.call("error", "matpy:test", "bad")'), 'matpy:PythonError');
+    py('eval', sprintf('try:\n    matlab.call("error", "matpy:test", "bad %%d", 1.0)\nexcept matlab.MatlabError as e:\n    message = str(e)'));
+    assertEqual('matpy:test: bad 1', py('get', 'message'));
+    assertExceptionThrown(@() py('eval', 'matlab.call("py", "eval", "pass", nout=0)'), 'matpy:PythonError');
+
+    % A PyRef cleared by a MATLAB function Python called still releases
+    py('eval', sprintf('import weakref\nclass Held(object): pass\nheld = Held()\nheld_ref = weakref.ref(held)'));
+    assignin('base', 'matpy_callback_ref', py('ref', 'held'));
+    py('eval', 'del held');
+    py('eval', 'matlab.call("evalin", "base", "clear matpy_callback_ref", nout=0)');
+    assertTrue(py('get', 'held_ref() is None'), 'PyRef not released');
+
+end
+
+%% Test exporting scalars and vectors natively
+function TestNativeExport
+
+    py('set', 'k', 4, 'native', true);
+    assertEqual('float', py('get', 'type(k).__name__'));
+    py('set', 'k', int32(4), 'native', true);
+    assertEqual('int', py('get', 'type(k).__name__'));
+    py('set', 'k', true, 'native', true);
+    assertEqual('bool', py('get', 'type(k).__name__'));
+    py('set', 'k', uint64(2)^63, 'native', true);
+    assertEqual('long', py('get', 'type(k).__name__'));
+
+    py('set', 'v', [1 2 3], 'native', true);
+    assertEqual(1, py('get', 'v.ndim'));
+    assertEqual([1; 2; 3], py('get', 'v'));
+    py('set', 'v', single([1; 2]), 'native', true);
+    assertEqual('float32', py('get', 'str(v.dtype)'));
+
+    % Matrices, complex, char and default exports are unchanged
+    py('set', 'm', magic(3), 'native', true);
+    assertEqual(2, py('get', 'm.ndim'));
+    py('set', 'c', 1 + 2i, 'native', true);
+    assertEqual(2, py('get', 'c.ndim'));
+    py('set', 'k', 4);
+    assertEqual(2, py('get', 'k.ndim'));
+
+    assertEqual(3, py('call', 'len', [1 2 3], 'options', struct('native', true)));
+    py('set', 's', struct('a', {1, 2}), 'native', true);
+    assertEqual('float', py('get', 'type(s["a"][0]).__name__'));
+
+    py('init', struct('native', true));
+    py('set', 'k', 4);
+    assertEqual('float', py('get', 'type(k).__name__'));
+    py('set', 'k', 4, 'native', false);
+    assertEqual(2, py('get', 'k.ndim'));
+    py('init', struct('native', false));
+
+end
+
 %% Test struct Export with a field with a null value, should return an error
 function TestStructExport
 
@@ -332,6 +869,111 @@ function TestStructImport2
     assertExceptionThrown(@() TestFunc, 'matpy:IncorrectStructForm');
 end
 
+%% Test repeated expressions are served from the code cache
+function TestCodeCache
+
+    py('cache', 'clear');
+    py('eval', 'tmp = 1');
+    for i = 1:3
+        py('eval', 'tmp = tmp + 1');
+    end
+    assertEqual(4, py('get', 'tmp'), 'cached statement not evaluated every time');
+
+    stats = py('cache', 'stats');
+    assertEqual(2, stats.hits, 'unexpected number of code cache hits');
+    assertEqual(3, stats.misses, 'unexpected number of code cache misses');
+
+    py('cache', 'size', 1);
+    stats = py('cache', 'stats');
+    assertEqual(1, stats.size, 'code cache not trimmed to its new size');
+    assertEqual(2, stats.evictions, 'unexpected number of code cache evictions');
+
+    py('cache', 'size', 256);
+    py('cache', 'clear');
+
+end
+
+%% Test batch of set, eval and get operations
+function TestBatch
+
+    ops = {{'set', 'tmp', magic(3)}, {'eval', 'tmp2 = tmp * 2'}, {'get', 'tmp2'}, {'get', 'tmp'}};
+    actual = py('batch', ops);
+    assertEqual({2 * magic(3), magic(3)}, actual, 'batch with a cell array not successful');
+
+    ops = struct('op', {'set', 'eval', 'get'}, 'arg', {'tmp', 'tmp += 1', 'tmp'}, 'value', {1, [], []});
+    actual = py('batch', ops);
+    assertEqual({2}, actual, 'batch with a struct array not successful');
+
+end
+
+%% Test batch errors name the failing operation
+function TestBatchError
+
+    try
+        py('batch', {{'eval', 'tmp = 1'}, {'get', 'Does_not_exist'}});
+        error('matpy:Test', 'no error raised');
+    catch e
+        assertEqual('matpy:PythonError', e.identifier);
+        assertFalse(isempty(strfind(e.message, 'Batch operation 2')), 'batch error does not name the failing operation');
+    end
+
+end
+
+%% Test calling Python functions with positional and keyword arguments
+function TestCall
+
+    assertEqual(int32(3), py('call', 'len', 'abc'), 'call of a builtin not successful');
+    assertEqual(5, py('call', 'math.hypot', 3, 4), 'call of a module function not successful');
+
+    py('eval', 'def tmpfunc(a, b, scale=1): return a * scale, b * scale');
+    [a, b] = py('call', 'tmpfunc', 1, 2, 'kw', struct('scale', 10));
+    assertEqual({10, 20}, {a, b}, 'call with keyword arguments and several outputs not successful');
+
+    actual = py('call', 'numpy.linalg.norm', [3 4]);
+    assertEqual(5, actual, 'call of a submodule function not successful');
+
+end
+
+%% Test handles keep Python objects in Python between calls
+function TestRef
+
+    py('eval', 'import numpy');
+    h = py('ref', 'numpy.arange(12.0).reshape(3, 4)');
+    assertTrue(isa(h, 'PyRef'), 'ref did not return a PyRef');
+
+    assertEqual(66, py('call', 'numpy.sum', h), 'handle not accepted by call');
+    py('set', 'tmp', h);
+    assertEqual(true, py('get', 'tmp is tmp'), 'handle not accepted by set');
+    assertEqual(reshape(0:11, [4 3])', h.deref(), 'deref not successful');
+
+    py('release', h);
+    assertExceptionThrown(@() py('deref', h), 'matpy:InvalidHandle');
+
+end
+
+%% Test copying and writing parts of a Python array
+function TestSlices
+
+    py('eval', 'import numpy');
+    py('eval', 'tmp = numpy.arange(20.0).reshape(4, 5)');
+    expected = reshape(0:19, [5 4])';
+
+    assertEqual(expected(2:3, [1 5]), py('getslice', 'tmp', 2:3, [1 5]), 'getslice with index vectors not successful');
+    assertEqual(expected(3:4, :), py('getslice', 'tmp', 3:4, ':'), 'getslice of whole rows not successful');
+
+    py('setslice', 'tmp', 1, 2:3, [-1 -2]);
+    py('setslice', 'tmp', 4, ':', 7);
+    expected(1, 2:3) = [-1 -2];
+    expected(4, :) = 7;
+    assertEqual(expected, py('get', 'tmp'), 'setslice not successful');
+
+    assertExceptionThrown(@() py('setslice', 'tmp', 1, 1, int32(1)), 'matpy:TypeMismatch');
+    assertExceptionThrown(@() py('getslice', 'tmp', 5, 1), 'matpy:IndexOutOfRange');
+    assertExceptionThrown(@() py('getslice', 'tmp', 0, 1), 'matpy:IndexOutOfRange');
+    assertExceptionThrown(@() py('getslice', 'tmp', -1:0, ':'), 'matpy:IndexOutOfRange');
+
+end
+
 %% Test Error Messages %%
 
 %% Test for no input
@@ -0,0 +1,261 @@
+/*
+ * Throughput and latency benchmarks of py.cpp's conversions, run against the
+ * mock mx API in bench/mock instead of MATLAB. Built and run by `make bench`.
+ *
+ * Every benchmark calls mexFunction the way MATLAB would, with fixed sizes
+ * and deterministic data, and records the median and fastest time of one
+ * call. Progress goes to stderr, Python's output to stdout and the results
+ * as JSON to a file:
+ *
+ *     bench results.json [filter] [min_seconds]
+ *
+ * runs the benchmarks whose names contain filter, each for at least
+ * min_seconds (default 0.25).
+ */
+#include "../py.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <vector>
+
+struct BenchResult
+{
+	std::string name;
+	double bytes;
+	size_t reps;
+	double median;
+	double min;
+	std::string error;
+};
+
+static std::vector<BenchResult> results;
+static const char *filter = "";
+static double minSeconds = 0.25;
+
+// Calls py(args{:}) with nlhs outputs and frees the arguments and outputs.
+static void callPy(int nlhs, std::vector<mxArray*> args)
+{
+	mxArray *outputs[4] = {NULL, NULL, NULL, NULL};
+	mexFunction(nlhs, outputs, (int) args.size(), (const mxArray**) &args[0]);
+	for (size_t i = 0; i < args.size(); i++) {
+		mxDestroyArray(args[i]);
+	}
+	for (int i = 0; i < nlhs; i++) {
+		mxDestroyArray(outputs[i]);
+	}
+}
+
+// Times op, which handles bytes of data per call, after running setup once.
+static void bench(const std::string &name, double bytes, std::function<void()> setup, std::function<void()> op)
+{
+	if (name.find(filter) == std::string::npos) {
+		return;
+	}
+	BenchResult result = {name, bytes, 0, 0, 0, ""};
+	try {
+		setup();
+		for (int i = 0; i < 3; i++) {
+			op();
+		}
+
+		std::vector<double> times;
+		double total = 0;
+		while ((total < minSeconds || times.size() < 5) && times.size() < 100000) {
+			StatsClock::time_point start = StatsClock::now();
+			op();
+			double time = seconds(start, StatsClock::now());
+			times.push_back(time);
+			total += time;
+		}
+		std::sort(times.begin(), times.end());
+		result.reps = times.size();
+		result.median = times[times.size() / 2];
+		result.min = times[0];
+	} catch (const MexError &e) {
+		result.error = e.id + ": " + e.what();
+	}
+	results.push_back(result);
+	fprintf(stderr, "%-40s %12.3f us %s\n", name.c_str(), 1e6 * result.median, result.error.c_str());
+}
+
+static mxArray *numeric(mxClassID cls, size_t n, mxComplexity complexity)
+{
+	mwSize dims[] = {1, n};
+	mxArray *a = mxCreateUninitNumericArray(2, dims, cls, complexity);
+	size_t elsize = mxGetElementSize(a);
+	for (size_t i = 0; i < n; i++) {
+		// Small integers, valid for every class
+		double x = (double) (i % 97);
+		switch (cls) {
+		case mxDOUBLE_CLASS: ((double*) mxGetData(a))[i] = x; break;
+		case mxSINGLE_CLASS: ((float*) mxGetData(a))[i] = (float) x; break;
+		case mxLOGICAL_CLASS: ((mxLogical*) mxGetData(a))[i] = i % 2 == 0; break;
+		case mxINT8_CLASS: ((int8_t*) mxGetData(a))[i] = (int8_t) x; break;
+		case mxUINT8_CLASS: ((uint8_t*) mxGetData(a))[i] = (uint8_t) x; break;
+		case mxINT16_CLASS: ((int16_t*) mxGetData(a))[i] = (int16_t) x; break;
+		case mxINT32_CLASS: ((int32_t*) mxGetData(a))[i] = (int32_t) x; break;
+		case mxINT64_CLASS: ((int64_t*) mxGetData(a))[i] = (int64_t) x; break;
+		default: memset((char*) mxGetData(a) + i * elsize, 0, elsize); break;
+		}
+		if (complexity == mxCOMPLEX) {
+			((double*) mxGetImagData(a))[i] = -x;
+		}
+	}
+	return a;
+}
+
+// A rows x width char array of ASCII letters, or of Greek ones.
+static mxArray *charArray(size_t rows, size_t width, bool ascii)
+{
+	mwSize dims[] = {rows, width};
+	mxArray *a = mxCreateCharArray(2, dims);
+	mxChar *chars = mxGetChars(a);
+	for (size_t i = 0; i < rows * width; i++) {
+		chars[i] = (mxChar) ((ascii ? 'a' : 0x3B1) + i % 24);
+	}
+	return a;
+}
+
+static mxArray *structArray(size_t n)
+{
+	const char *fields[] = {"x", "name"};
+	mxArray *a = mxCreateStructMatrix(1, n, 2, fields);
+	for (size_t i = 0; i < n; i++) {
+		mxSetFieldByNumber(a, i, 0, mxCreateDoubleScalar((double) i));
+		mxSetFieldByNumber(a, i, 1, mxCreateString(i % 2 ? "odd" : "even"));
+	}
+	return a;
+}
+
+static mxArray *cellArray(size_t n, bool strings)
+{
+	mxArray *a = mxCreateCellMatrix(1, n);
+	for (size_t i = 0; i < n; i++) {
+		mxSetCell(a, i, strings ? mxCreateString(i % 2 ? "odd" : "even") : mxCreateDoubleScalar((double) i));
+	}
+	return a;
+}
+
+// Returns the value of a 'set' option, "true" and "false" being logicals.
+static mxArray *optionValue(const char *value)
+{
+	if (!strcmp(value, "true") || !strcmp(value, "false")) {
+		return mxCreateLogicalScalar(!strcmp(value, "true"));
+	}
+	return mxCreateString(value);
+}
+
+// Benchmarks py('set', 'x', value, options...) and then py('get', 'x').
+static void benchSetGet(const std::string &name, std::function<mxArray*()> make, std::vector<const char*> options = {})
+{
+	mxArray *value = make();
+	double bytes = mxTreeBytes(value);
+	mxDestroyArray(value);
+
+	bench("set/" + name, bytes, [] {}, [&] {
+		std::vector<mxArray*> args = {mxCreateString("set"), mxCreateString("x"), make()};
+		for (size_t i = 0; i < options.size(); i++) {
+			args.push_back(i % 2 ? optionValue(options[i]) : mxCreateString(options[i]));
+		}
+		callPy(0, args);
+	});
+	bench("get/" + name, bytes, [&] {
+		std::vector<mxArray*> args = {mxCreateString("set"), mxCreateString("x"), make()};
+		for (size_t i = 0; i < options.size(); i++) {
+			args.push_back(i % 2 ? optionValue(options[i]) : mxCreateString(options[i]));
+		}
+		callPy(0, args);
+	}, [] {
+		callPy(1, {mxCreateString("get"), mxCreateString("x")});
+	});
+}
+
+static void writeJson(FILE *f)
+{
+	fprintf(f, "{\n  \"format\": 1,\n  \"python\": \"%.*s\",\n  \"benchmarks\": [\n", (int) strcspn(Py_GetVersion(), " "), Py_GetVersion());
+	for (size_t i = 0; i < results.size(); i++) {
+		const BenchResult &r = results[i];
+		fprintf(f, "    {\"name\": \"%s\", \"bytes\": %.0f, \"reps\": %zu, \"median_seconds\": %.9g, \"min_seconds\": %.9g, "
+			"\"mb_per_second\": %.6g, \"error\": \"%s\"}%s\n",
+			r.name.c_str(), r.bytes, r.reps, r.median, r.min, r.median > 0 ? r.bytes / r.median / 1e6 : 0.0,
+			r.error.c_str(), i + 1 < results.size() ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2) {
+		fprintf(stderr, "Usage: %s results.json [filter] [min_seconds]\n", argv[0]);
+		return 2;
+	}
+	if (argc > 2) {
+		filter = argv[2];
+	}
+	if (argc > 3) {
+		minSeconds = atof(argv[3]);
+	}
+
+	// Initializes the interpreter outside of any timing
+	callPy(0, {mxCreateString("eval"), mxCreateString("pass")});
+
+	bench("dispatch/eval", 0, [] {}, [] {
+		callPy(0, {mxCreateString("eval"), mxCreateString("pass")});
+	});
+	bench("dispatch/get_scalar", 8, [] {
+		callPy(0, {mxCreateString("eval"), mxCreateString("s = 1.0")});
+	}, [] {
+		callPy(1, {mxCreateString("get"), mxCreateString("s")});
+	});
+
+	struct { const char *name; mxClassID cls; } classes[] = {
+		{"double", mxDOUBLE_CLASS}, {"single", mxSINGLE_CLASS}, {"int8", mxINT8_CLASS}, {"uint8", mxUINT8_CLASS},
+		{"int16", mxINT16_CLASS}, {"int32", mxINT32_CLASS}, {"int64", mxINT64_CLASS}, {"logical", mxLOGICAL_CLASS}};
+	size_t sizes[] = {1, 1000, 1000000};
+	for (size_t c = 0; c < sizeof(classes) / sizeof(classes[0]); c++) {
+		for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+			mxClassID cls = classes[c].cls;
+			size_t n = sizes[s];
+			benchSetGet(std::string(classes[c].name) + "/" + std::to_string(n), [=] { return numeric(cls, n, mxREAL); });
+		}
+	}
+	benchSetGet("double/1000000/copy", [] { return numeric(mxDOUBLE_CLASS, 1000000, mxREAL); }, {"copy", "true"});
+	// Per call latency of the scalars and short vectors of control loops,
+	// as 2-d ndarrays and with the native option
+	for (size_t n : {1, 8}) {
+		std::string size = std::to_string(n);
+		benchSetGet("double/" + size + "/native", [=] { return numeric(mxDOUBLE_CLASS, n, mxREAL); }, {"native", "true"});
+		benchSetGet("int32/" + size + "/native", [=] { return numeric(mxINT32_CLASS, n, mxREAL); }, {"native", "true"});
+	}
+	benchSetGet("logical/1/native", [] { return numeric(mxLOGICAL_CLASS, 1, mxREAL); }, {"native", "true"});
+	benchSetGet("double/8", [] { return numeric(mxDOUBLE_CLASS, 8, mxREAL); });
+	benchSetGet("complex_double/1000", [] { return numeric(mxDOUBLE_CLASS, 1000, mxCOMPLEX); });
+	benchSetGet("complex_double/1000000", [] { return numeric(mxDOUBLE_CLASS, 1000000, mxCOMPLEX); });
+	benchSetGet("char/1000", [] { return charArray(1, 1000, true); });
+	benchSetGet("char/1000000", [] { return charArray(1, 1000000, true); });
+	benchSetGet("char_unicode/1000000", [] { return charArray(1, 1000000, false); });
+	benchSetGet("char_matrix/1000x1000", [] { return charArray(1000, 1000, true); });
+	benchSetGet("struct/1000/lists", [] { return structArray(1000); });
+	benchSetGet("struct/1000/columns", [] { return structArray(1000); }, {"struct", "columns"});
+	benchSetGet("cell_double/1000/lists", [] { return cellArray(1000, false); });
+	benchSetGet("cell_double/1000/packed", [] { return cellArray(1000, false); }, {"cell", "packed"});
+	benchSetGet("cellstr/1000/lists", [] { return cellArray(1000, true); });
+	benchSetGet("cellstr/1000/packed", [] { return cellArray(1000, true); }, {"cell", "packed"});
+
+	FILE *f = fopen(argv[1], "w");
+	if (f == NULL) {
+		perror(argv[1]);
+		return 2;
+	}
+	writeJson(f);
+	fclose(f);
+	for (size_t i = 0; i < results.size(); i++) {
+		if (!results[i].error.empty()) {
+			return 1;
+		}
+	}
+	return 0;
+}
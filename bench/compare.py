@@ -0,0 +1,51 @@
+"""Compares benchmark results with a baseline.
+
+    python bench/compare.py baseline.json results.json [tolerance]
+
+Prints the median time of every benchmark in both files and the ratio
+between them, and exits with status 1 if a benchmark failed or is slower
+than the baseline by more than tolerance (default 0.15, i.e. 15%).
+"""
+
+from __future__ import print_function
+
+import json
+import sys
+
+
+def load(path):
+    with open(path) as f:
+        return dict((b['name'], b) for b in json.load(f)['benchmarks'])
+
+
+def main(argv):
+    if len(argv) not in (3, 4):
+        print(__doc__.strip(), file=sys.stderr)
+        return 2
+    baseline = load(argv[1])
+    results = load(argv[2])
+    tolerance = float(argv[3]) if len(argv) == 4 else 0.15
+
+    failed = False
+    print('%-40s %12s %12s %8s' % ('benchmark', 'baseline us', 'current us', 'ratio'))
+    for name in sorted(results):
+        current = results[name]
+        if current['error']:
+            print('%-40s %s' % (name, current['error']))
+            failed = True
+            continue
+        if name not in baseline or not baseline[name]['median_seconds']:
+            print('%-40s %12s %12.3f' % (name, '-', 1e6 * current['median_seconds']))
+            continue
+
+        ratio = current['median_seconds'] / baseline[name]['median_seconds']
+        slower = ratio > 1 + tolerance
+        failed = failed or slower
+        print('%-40s %12.3f %12.3f %8.2f%s' % (
+            name, 1e6 * baseline[name]['median_seconds'], 1e6 * current['median_seconds'],
+            ratio, '  SLOWER' if slower else ''))
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,137 @@
+/*
+ * Stand-in for MATLAB's matrix.h, declaring the subset of the mx API used by
+ * py.cpp. It is implemented by mx.cpp so that the conversion and dispatch
+ * code can be built and benchmarked without a MATLAB installation. Only the
+ * separate complex API is provided.
+ */
+#ifndef MATPY_MOCK_MATRIX_H
+#define MATPY_MOCK_MATRIX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef size_t mwSize;
+typedef size_t mwIndex;
+typedef ptrdiff_t mwSignedIndex;
+typedef struct mxArray_tag mxArray;
+typedef uint16_t mxChar;
+typedef bool mxLogical;
+typedef uint16_t uint16_T;
+typedef uint64_t uint64_T;
+
+typedef enum
+{
+	mxUNKNOWN_CLASS = 0,
+	mxCELL_CLASS,
+	mxSTRUCT_CLASS,
+	mxLOGICAL_CLASS,
+	mxCHAR_CLASS,
+	mxVOID_CLASS,
+	mxDOUBLE_CLASS,
+	mxSINGLE_CLASS,
+	mxINT8_CLASS,
+	mxUINT8_CLASS,
+	mxINT16_CLASS,
+	mxUINT16_CLASS,
+	mxINT32_CLASS,
+	mxUINT32_CLASS,
+	mxINT64_CLASS,
+	mxUINT64_CLASS,
+	mxFUNCTION_CLASS,
+	mxOPAQUE_CLASS,
+	mxOBJECT_CLASS
+} mxClassID;
+
+typedef enum { mxREAL, mxCOMPLEX } mxComplexity;
+
+#define MX_HAS_INTERLEAVED_COMPLEX 0
+
+extern "C" {
+
+void *mxMalloc(size_t n);
+void *mxCalloc(size_t n, size_t size);
+void *mxRealloc(void *ptr, size_t n);
+void mxFree(void *ptr);
+
+mxArray *mxCreateNumericArray(mwSize ndim, const mwSize *dims, mxClassID cls, mxComplexity complexity);
+mxArray *mxCreateUninitNumericArray(mwSize ndim, const mwSize *dims, mxClassID cls, mxComplexity complexity);
+mxArray *mxCreateNumericMatrix(mwSize m, mwSize n, mxClassID cls, mxComplexity complexity);
+mxArray *mxCreateDoubleMatrix(mwSize m, mwSize n, mxComplexity complexity);
+mxArray *mxCreateDoubleScalar(double value);
+mxArray *mxCreateLogicalArray(mwSize ndim, const mwSize *dims);
+mxArray *mxCreateLogicalMatrix(mwSize m, mwSize n);
+mxArray *mxCreateLogicalScalar(bool value);
+mxArray *mxCreateCharArray(mwSize ndim, const mwSize *dims);
+mxArray *mxCreateCharMatrixFromStrings(mwSize m, const char **strings);
+mxArray *mxCreateString(const char *str);
+mxArray *mxCreateCellArray(mwSize ndim, const mwSize *dims);
+mxArray *mxCreateCellMatrix(mwSize m, mwSize n);
+mxArray *mxCreateStructArray(mwSize ndim, const mwSize *dims, int nfields, const char **names);
+mxArray *mxCreateStructMatrix(mwSize m, mwSize n, int nfields, const char **names);
+mxArray *mxCreateSparse(mwSize m, mwSize n, mwSize nzmax, mxComplexity complexity);
+mxArray *mxCreateSparseLogicalMatrix(mwSize m, mwSize n, mwSize nzmax);
+mxArray *mxDuplicateArray(const mxArray *a);
+void mxDestroyArray(mxArray *a);
+
+mxClassID mxGetClassID(const mxArray *a);
+const char *mxGetClassName(const mxArray *a);
+bool mxIsClass(const mxArray *a, const char *name);
+bool mxIsNumeric(const mxArray *a);
+bool mxIsDouble(const mxArray *a);
+bool mxIsSingle(const mxArray *a);
+bool mxIsInt64(const mxArray *a);
+bool mxIsUint64(const mxArray *a);
+bool mxIsLogical(const mxArray *a);
+bool mxIsChar(const mxArray *a);
+bool mxIsCell(const mxArray *a);
+bool mxIsStruct(const mxArray *a);
+bool mxIsComplex(const mxArray *a);
+bool mxIsSparse(const mxArray *a);
+bool mxIsEmpty(const mxArray *a);
+bool mxIsInf(double value);
+bool mxIsNaN(double value);
+bool mxIsLogicalScalarTrue(const mxArray *a);
+
+mwSize mxGetNumberOfDimensions(const mxArray *a);
+const mwSize *mxGetDimensions(const mxArray *a);
+int mxSetDimensions(mxArray *a, const mwSize *dims, mwSize ndim);
+size_t mxGetNumberOfElements(const mxArray *a);
+size_t mxGetElementSize(const mxArray *a);
+size_t mxGetM(const mxArray *a);
+size_t mxGetN(const mxArray *a);
+void mxSetM(mxArray *a, mwSize m);
+void mxSetN(mxArray *a, mwSize n);
+
+void *mxGetData(const mxArray *a);
+void *mxGetImagData(const mxArray *a);
+void mxSetData(mxArray *a, void *data);
+void mxSetImagData(mxArray *a, void *data);
+double *mxGetPr(const mxArray *a);
+double *mxGetPi(const mxArray *a);
+mxLogical *mxGetLogicals(const mxArray *a);
+mxChar *mxGetChars(const mxArray *a);
+double mxGetScalar(const mxArray *a);
+char *mxArrayToString(const mxArray *a);
+int mxGetString(const mxArray *a, char *buf, mwSize buflen);
+
+mwIndex *mxGetIr(const mxArray *a);
+mwIndex *mxGetJc(const mxArray *a);
+mwSize mxGetNzmax(const mxArray *a);
+void mxSetIr(mxArray *a, mwIndex *ir);
+void mxSetJc(mxArray *a, mwIndex *jc);
+
+mxArray *mxGetCell(const mxArray *a, mwIndex i);
+void mxSetCell(mxArray *a, mwIndex i, mxArray *value);
+int mxGetNumberOfFields(const mxArray *a);
+const char *mxGetFieldNameByNumber(const mxArray *a, int field);
+int mxGetFieldNumber(const mxArray *a, const char *name);
+int mxAddField(mxArray *a, const char *name);
+mxArray *mxGetFieldByNumber(const mxArray *a, mwIndex i, int field);
+void mxSetFieldByNumber(mxArray *a, mwIndex i, int field, mxArray *value);
+mxArray *mxGetField(const mxArray *a, mwIndex i, const char *name);
+void mxSetField(mxArray *a, mwIndex i, const char *name, mxArray *value);
+mxArray *mxGetProperty(const mxArray *a, mwIndex i, const char *name);
+
+}
+
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Stand-in for MATLAB's mex.h, see matrix.h. Errors raised through
+ * mexErrMsgIdAndTxt are thrown as MexError, and calls back into MATLAB are
+ * not supported.
+ */
+#ifndef MATPY_MOCK_MEX_H
+#define MATPY_MOCK_MEX_H
+
+#include "matrix.h"
+
+#include <stdexcept>
+#include <string>
+
+// Thrown by mexErrMsgIdAndTxt in place of returning to the MATLAB prompt.
+struct MexError : std::runtime_error
+{
+	std::string id;
+	MexError(const std::string &id_, const std::string &message) : std::runtime_error(message), id(id_) {}
+};
+
+extern "C" {
+
+int mexPrintf(const char *format, ...);
+[[noreturn]] void mexErrMsgIdAndTxt(const char *id, const char *format, ...);
+void mexWarnMsgIdAndTxt(const char *id, const char *format, ...);
+void mexMakeArrayPersistent(mxArray *a);
+void mexLock(void);
+void mexUnlock(void);
+bool mexIsLocked(void);
+int mexAtExit(void (*fn)(void));
+const char *mexFunctionName(void);
+int mexCallMATLAB(int nlhs, mxArray **plhs, int nrhs, mxArray **prhs, const char *name);
+mxArray *mexCallMATLABWithTrap(int nlhs, mxArray **plhs, int nrhs, mxArray **prhs, const char *name);
+mxArray *mexGetVariable(const char *workspace, const char *name);
+int mexPutVariable(const char *workspace, const char *name, const mxArray *a);
+
+void mexFunction(int nlhs, mxArray *plhs[], int nrhs, const mxArray *prhs[]);
+
+}
+
+#endif
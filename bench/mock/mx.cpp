@@ -0,0 +1,606 @@
+/*
+ * Implementation of the stand-in mx and mex API declared in matrix.h and
+ * mex.h. Arrays follow MATLAB's layout: column major data, at least two
+ * dimensions with trailing singletons dropped, separate real and imaginary
+ * planes and compressed sparse columns.
+ */
+#include "mex.h"
+
+#include <algorithm>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+struct mxArray_tag
+{
+	mxClassID cls;
+	std::vector<mwSize> dims;
+	bool complex;
+	bool sparse;
+	void *data;
+	void *imag;
+	mwIndex *ir;
+	mwIndex *jc;
+	mwSize nzmax;
+	// Elements of cells, and fields of structs in element major order
+	std::vector<mxArray*> items;
+	std::vector<std::string> fields;
+};
+
+static size_t classSize(mxClassID cls)
+{
+	switch (cls) {
+	case mxLOGICAL_CLASS: return sizeof(mxLogical);
+	case mxCHAR_CLASS: return sizeof(mxChar);
+	case mxDOUBLE_CLASS: return 8;
+	case mxSINGLE_CLASS: return 4;
+	case mxINT8_CLASS: case mxUINT8_CLASS: return 1;
+	case mxINT16_CLASS: case mxUINT16_CLASS: return 2;
+	case mxINT32_CLASS: case mxUINT32_CLASS: return 4;
+	case mxINT64_CLASS: case mxUINT64_CLASS: return 8;
+	case mxCELL_CLASS: case mxSTRUCT_CLASS: return sizeof(mxArray*);
+	default: return 0;
+	}
+}
+
+static mxArray *newArray(mxClassID cls, mwSize ndim, const mwSize *dims)
+{
+	mxArray *a = new mxArray_tag();
+	a->cls = cls;
+	mxSetDimensions(a, dims, ndim);
+	return a;
+}
+
+static mxArray *newNumeric(mwSize ndim, const mwSize *dims, mxClassID cls, mxComplexity complexity, bool zero)
+{
+	mxArray *a = newArray(cls, ndim, dims);
+	size_t bytes = mxGetNumberOfElements(a) * classSize(cls);
+	a->complex = complexity == mxCOMPLEX;
+	a->data = zero ? mxCalloc(bytes, 1) : mxMalloc(bytes);
+	if (a->complex) {
+		a->imag = zero ? mxCalloc(bytes, 1) : mxMalloc(bytes);
+	}
+	return a;
+}
+
+static mxArray *newSparse(mxClassID cls, mwSize m, mwSize n, mwSize nzmax, mxComplexity complexity)
+{
+	mwSize dims[] = {m, n};
+	mxArray *a = newArray(cls, 2, dims);
+	a->sparse = true;
+	a->complex = complexity == mxCOMPLEX;
+	a->nzmax = nzmax < 1 ? 1 : nzmax;
+	a->data = mxCalloc(a->nzmax, classSize(cls));
+	if (a->complex) {
+		a->imag = mxCalloc(a->nzmax, classSize(cls));
+	}
+	a->ir = (mwIndex*) mxCalloc(a->nzmax, sizeof(mwIndex));
+	a->jc = (mwIndex*) mxCalloc(n + 1, sizeof(mwIndex));
+	return a;
+}
+
+static void *copyBytes(const void *src, size_t bytes)
+{
+	if (src == NULL) {
+		return NULL;
+	}
+	void *dst = mxMalloc(bytes);
+	memcpy(dst, src, bytes);
+	return dst;
+}
+
+extern "C" {
+
+void *mxMalloc(size_t n)
+{
+	return malloc(n == 0 ? 1 : n);
+}
+
+void *mxCalloc(size_t n, size_t size)
+{
+	return calloc(n == 0 ? 1 : n, size == 0 ? 1 : size);
+}
+
+void *mxRealloc(void *ptr, size_t n)
+{
+	return realloc(ptr, n == 0 ? 1 : n);
+}
+
+void mxFree(void *ptr)
+{
+	free(ptr);
+}
+
+mxArray *mxCreateNumericArray(mwSize ndim, const mwSize *dims, mxClassID cls, mxComplexity complexity)
+{
+	return newNumeric(ndim, dims, cls, complexity, true);
+}
+
+mxArray *mxCreateUninitNumericArray(mwSize ndim, const mwSize *dims, mxClassID cls, mxComplexity complexity)
+{
+	return newNumeric(ndim, dims, cls, complexity, false);
+}
+
+mxArray *mxCreateNumericMatrix(mwSize m, mwSize n, mxClassID cls, mxComplexity complexity)
+{
+	mwSize dims[] = {m, n};
+	return mxCreateNumericArray(2, dims, cls, complexity);
+}
+
+mxArray *mxCreateDoubleMatrix(mwSize m, mwSize n, mxComplexity complexity)
+{
+	return mxCreateNumericMatrix(m, n, mxDOUBLE_CLASS, complexity);
+}
+
+mxArray *mxCreateDoubleScalar(double value)
+{
+	mxArray *a = mxCreateDoubleMatrix(1, 1, mxREAL);
+	*(double*) a->data = value;
+	return a;
+}
+
+mxArray *mxCreateLogicalArray(mwSize ndim, const mwSize *dims)
+{
+	return mxCreateNumericArray(ndim, dims, mxLOGICAL_CLASS, mxREAL);
+}
+
+mxArray *mxCreateLogicalMatrix(mwSize m, mwSize n)
+{
+	return mxCreateNumericMatrix(m, n, mxLOGICAL_CLASS, mxREAL);
+}
+
+mxArray *mxCreateLogicalScalar(bool value)
+{
+	mxArray *a = mxCreateLogicalMatrix(1, 1);
+	*(mxLogical*) a->data = value;
+	return a;
+}
+
+mxArray *mxCreateCharArray(mwSize ndim, const mwSize *dims)
+{
+	return mxCreateNumericArray(ndim, dims, mxCHAR_CLASS, mxREAL);
+}
+
+mxArray *mxCreateCharMatrixFromStrings(mwSize m, const char **strings)
+{
+	size_t n = 0;
+	for (mwSize i = 0; i < m; i++) {
+		n = std::max(n, strlen(strings[i]));
+	}
+	mwSize dims[] = {m, n};
+	mxArray *a = mxCreateCharArray(2, dims);
+	mxChar *chars = mxGetChars(a);
+	for (mwSize i = 0; i < m; i++) {
+		for (size_t j = 0; j < n; j++) {
+			chars[i + j * m] = j < strlen(strings[i]) ? (unsigned char) strings[i][j] : ' ';
+		}
+	}
+	return a;
+}
+
+mxArray *mxCreateString(const char *str)
+{
+	// Decodes UTF-8 into UTF-16
+	std::vector<mxChar> units;
+	const unsigned char *s = (const unsigned char*) str;
+	while (*s) {
+		uint32_t c = *s++;
+		int extra = c >= 0xF0 ? 3 : c >= 0xE0 ? 2 : c >= 0xC0 ? 1 : 0;
+		c &= extra ? 0x3F >> extra : 0x7F;
+		for (int i = 0; i < extra && (*s & 0xC0) == 0x80; i++) {
+			c = (c << 6) | (*s++ & 0x3F);
+		}
+		if (c >= 0x10000) {
+			units.push_back((mxChar) (0xD800 + ((c - 0x10000) >> 10)));
+			units.push_back((mxChar) (0xDC00 + ((c - 0x10000) & 0x3FF)));
+		} else {
+			units.push_back((mxChar) c);
+		}
+	}
+	mwSize dims[] = {units.empty() ? 0u : 1u, units.size()};
+	mxArray *a = mxCreateCharArray(2, dims);
+	if (!units.empty()) {
+		memcpy(a->data, &units[0], units.size() * sizeof(mxChar));
+	}
+	return a;
+}
+
+mxArray *mxCreateCellArray(mwSize ndim, const mwSize *dims)
+{
+	mxArray *a = newArray(mxCELL_CLASS, ndim, dims);
+	a->items.assign(mxGetNumberOfElements(a), NULL);
+	return a;
+}
+
+mxArray *mxCreateCellMatrix(mwSize m, mwSize n)
+{
+	mwSize dims[] = {m, n};
+	return mxCreateCellArray(2, dims);
+}
+
+mxArray *mxCreateStructArray(mwSize ndim, const mwSize *dims, int nfields, const char **names)
+{
+	mxArray *a = newArray(mxSTRUCT_CLASS, ndim, dims);
+	for (int f = 0; f < nfields; f++) {
+		a->fields.push_back(names[f]);
+	}
+	a->items.assign(mxGetNumberOfElements(a) * nfields, NULL);
+	return a;
+}
+
+mxArray *mxCreateStructMatrix(mwSize m, mwSize n, int nfields, const char **names)
+{
+	mwSize dims[] = {m, n};
+	return mxCreateStructArray(2, dims, nfields, names);
+}
+
+mxArray *mxCreateSparse(mwSize m, mwSize n, mwSize nzmax, mxComplexity complexity)
+{
+	return newSparse(mxDOUBLE_CLASS, m, n, nzmax, complexity);
+}
+
+mxArray *mxCreateSparseLogicalMatrix(mwSize m, mwSize n, mwSize nzmax)
+{
+	return newSparse(mxLOGICAL_CLASS, m, n, nzmax, mxREAL);
+}
+
+mxArray *mxDuplicateArray(const mxArray *a)
+{
+	mxArray *dup = new mxArray_tag(*a);
+	size_t count = a->sparse ? a->nzmax : mxGetNumberOfElements(a);
+	if (a->cls != mxCELL_CLASS && a->cls != mxSTRUCT_CLASS) {
+		dup->data = copyBytes(a->data, count * classSize(a->cls));
+		dup->imag = copyBytes(a->imag, count * classSize(a->cls));
+	}
+	if (a->sparse) {
+		dup->ir = (mwIndex*) copyBytes(a->ir, a->nzmax * sizeof(mwIndex));
+		dup->jc = (mwIndex*) copyBytes(a->jc, (mxGetN(a) + 1) * sizeof(mwIndex));
+	}
+	for (size_t i = 0; i < dup->items.size(); i++) {
+		dup->items[i] = dup->items[i] == NULL ? NULL : mxDuplicateArray(dup->items[i]);
+	}
+	return dup;
+}
+
+void mxDestroyArray(mxArray *a)
+{
+	if (a == NULL) {
+		return;
+	}
+	for (size_t i = 0; i < a->items.size(); i++) {
+		mxDestroyArray(a->items[i]);
+	}
+	mxFree(a->data);
+	mxFree(a->imag);
+	mxFree(a->ir);
+	mxFree(a->jc);
+	delete a;
+}
+
+mxClassID mxGetClassID(const mxArray *a)
+{
+	return a->cls;
+}
+
+const char *mxGetClassName(const mxArray *a)
+{
+	static const char *const names[] = {"unknown", "cell", "struct", "logical", "char", "void", "double", "single",
+		"int8", "uint8", "int16", "uint16", "int32", "uint32", "int64", "uint64", "function_handle", "opaque", "object"};
+	return names[a->cls];
+}
+
+bool mxIsClass(const mxArray *a, const char *name)
+{
+	return !strcmp(mxGetClassName(a), name);
+}
+
+bool mxIsNumeric(const mxArray *a)
+{
+	return a->cls >= mxDOUBLE_CLASS && a->cls <= mxUINT64_CLASS;
+}
+
+bool mxIsDouble(const mxArray *a) { return a->cls == mxDOUBLE_CLASS; }
+bool mxIsSingle(const mxArray *a) { return a->cls == mxSINGLE_CLASS; }
+bool mxIsInt64(const mxArray *a) { return a->cls == mxINT64_CLASS; }
+bool mxIsUint64(const mxArray *a) { return a->cls == mxUINT64_CLASS; }
+bool mxIsLogical(const mxArray *a) { return a->cls == mxLOGICAL_CLASS; }
+bool mxIsChar(const mxArray *a) { return a->cls == mxCHAR_CLASS; }
+bool mxIsCell(const mxArray *a) { return a->cls == mxCELL_CLASS; }
+bool mxIsStruct(const mxArray *a) { return a->cls == mxSTRUCT_CLASS; }
+bool mxIsComplex(const mxArray *a) { return a->complex; }
+bool mxIsSparse(const mxArray *a) { return a->sparse; }
+bool mxIsEmpty(const mxArray *a) { return mxGetNumberOfElements(a) == 0; }
+bool mxIsInf(double value) { return isinf(value); }
+bool mxIsNaN(double value) { return isnan(value); }
+bool mxIsLogicalScalarTrue(const mxArray *a) { return mxIsLogical(a) && mxGetNumberOfElements(a) == 1 && *(mxLogical*) a->data; }
+
+mwSize mxGetNumberOfDimensions(const mxArray *a)
+{
+	return a->dims.size();
+}
+
+const mwSize *mxGetDimensions(const mxArray *a)
+{
+	return &a->dims[0];
+}
+
+int mxSetDimensions(mxArray *a, const mwSize *dims, mwSize ndim)
+{
+	a->dims.assign(dims, dims + ndim);
+	while (a->dims.size() > 2 && a->dims.back() == 1) {
+		a->dims.pop_back();
+	}
+	while (a->dims.size() < 2) {
+		a->dims.push_back(a->dims.empty() ? 0 : 1);
+	}
+	return 0;
+}
+
+size_t mxGetNumberOfElements(const mxArray *a)
+{
+	size_t n = 1;
+	for (size_t i = 0; i < a->dims.size(); i++) {
+		n *= a->dims[i];
+	}
+	return n;
+}
+
+size_t mxGetElementSize(const mxArray *a)
+{
+	return classSize(a->cls);
+}
+
+size_t mxGetM(const mxArray *a)
+{
+	return a->dims[0];
+}
+
+size_t mxGetN(const mxArray *a)
+{
+	size_t n = 1;
+	for (size_t i = 1; i < a->dims.size(); i++) {
+		n *= a->dims[i];
+	}
+	return n;
+}
+
+void mxSetM(mxArray *a, mwSize m)
+{
+	a->dims[0] = m;
+}
+
+void mxSetN(mxArray *a, mwSize n)
+{
+	a->dims.resize(2);
+	a->dims[1] = n;
+}
+
+void *mxGetData(const mxArray *a) { return a->data; }
+void *mxGetImagData(const mxArray *a) { return a->imag; }
+void mxSetData(mxArray *a, void *data) { a->data = data; }
+void mxSetImagData(mxArray *a, void *data) { a->imag = data; }
+double *mxGetPr(const mxArray *a) { return (double*) a->data; }
+double *mxGetPi(const mxArray *a) { return (double*) a->imag; }
+mxLogical *mxGetLogicals(const mxArray *a) { return (mxLogical*) a->data; }
+mxChar *mxGetChars(const mxArray *a) { return (mxChar*) a->data; }
+
+double mxGetScalar(const mxArray *a)
+{
+	if (mxGetNumberOfElements(a) == 0 || a->data == NULL) {
+		return 0;
+	}
+	switch (a->cls) {
+	case mxLOGICAL_CLASS: return *(mxLogical*) a->data;
+	case mxCHAR_CLASS: return *(mxChar*) a->data;
+	case mxDOUBLE_CLASS: return *(double*) a->data;
+	case mxSINGLE_CLASS: return *(float*) a->data;
+	case mxINT8_CLASS: return *(int8_t*) a->data;
+	case mxUINT8_CLASS: return *(uint8_t*) a->data;
+	case mxINT16_CLASS: return *(int16_t*) a->data;
+	case mxUINT16_CLASS: return *(uint16_t*) a->data;
+	case mxINT32_CLASS: return *(int32_t*) a->data;
+	case mxUINT32_CLASS: return *(uint32_t*) a->data;
+	case mxINT64_CLASS: return (double) *(int64_t*) a->data;
+	case mxUINT64_CLASS: return (double) *(uint64_t*) a->data;
+	default: return 0;
+	}
+}
+
+char *mxArrayToString(const mxArray *a)
+{
+	if (a->cls != mxCHAR_CLASS) {
+		return NULL;
+	}
+	// Encodes UTF-16 as UTF-8, reading the characters row by row
+	std::string s;
+	size_t m = mxGetM(a), n = mxGetN(a);
+	const mxChar *chars = (const mxChar*) a->data;
+	for (size_t i = 0; i < m; i++) {
+		for (size_t j = 0; j < n; j++) {
+			uint32_t c = chars[i + j * m];
+			if (c >= 0xD800 && c < 0xDC00 && j + 1 < n) {
+				c = 0x10000 + ((c - 0xD800) << 10) + (chars[i + ++j * m] - 0xDC00);
+			}
+			if (c < 0x80) {
+				s += (char) c;
+			} else if (c < 0x800) {
+				s += (char) (0xC0 | (c >> 6));
+				s += (char) (0x80 | (c & 0x3F));
+			} else if (c < 0x10000) {
+				s += (char) (0xE0 | (c >> 12));
+				s += (char) (0x80 | ((c >> 6) & 0x3F));
+				s += (char) (0x80 | (c & 0x3F));
+			} else {
+				s += (char) (0xF0 | (c >> 18));
+				s += (char) (0x80 | ((c >> 12) & 0x3F));
+				s += (char) (0x80 | ((c >> 6) & 0x3F));
+				s += (char) (0x80 | (c & 0x3F));
+			}
+		}
+	}
+	return (char*) copyBytes(s.c_str(), s.size() + 1);
+}
+
+int mxGetString(const mxArray *a, char *buf, mwSize buflen)
+{
+	char *s = mxArrayToString(a);
+	if (s == NULL || buflen == 0) {
+		mxFree(s);
+		return 1;
+	}
+	size_t len = strlen(s);
+	strncpy(buf, s, buflen - 1);
+	buf[buflen - 1] = '\0';
+	mxFree(s);
+	return len < buflen ? 0 : 1;
+}
+
+mwIndex *mxGetIr(const mxArray *a) { return a->ir; }
+mwIndex *mxGetJc(const mxArray *a) { return a->jc; }
+mwSize mxGetNzmax(const mxArray *a) { return a->nzmax; }
+void mxSetIr(mxArray *a, mwIndex *ir) { a->ir = ir; }
+void mxSetJc(mxArray *a, mwIndex *jc) { a->jc = jc; }
+
+mxArray *mxGetCell(const mxArray *a, mwIndex i)
+{
+	return a->items[i];
+}
+
+void mxSetCell(mxArray *a, mwIndex i, mxArray *value)
+{
+	a->items[i] = value;
+}
+
+int mxGetNumberOfFields(const mxArray *a)
+{
+	return (int) a->fields.size();
+}
+
+const char *mxGetFieldNameByNumber(const mxArray *a, int field)
+{
+	return field >= 0 && field < (int) a->fields.size() ? a->fields[field].c_str() : NULL;
+}
+
+int mxGetFieldNumber(const mxArray *a, const char *name)
+{
+	for (size_t f = 0; f < a->fields.size(); f++) {
+		if (a->fields[f] == name) {
+			return (int) f;
+		}
+	}
+	return -1;
+}
+
+int mxAddField(mxArray *a, const char *name)
+{
+	int field = mxGetFieldNumber(a, name);
+	if (field >= 0) {
+		return field;
+	}
+	size_t nelem = mxGetNumberOfElements(a);
+	size_t nfields = a->fields.size();
+	std::vector<mxArray*> items(nelem * (nfields + 1), NULL);
+	for (size_t i = 0; i < nelem; i++) {
+		for (size_t f = 0; f < nfields; f++) {
+			items[i * (nfields + 1) + f] = a->items[i * nfields + f];
+		}
+	}
+	a->items.swap(items);
+	a->fields.push_back(name);
+	return (int) nfields;
+}
+
+mxArray *mxGetFieldByNumber(const mxArray *a, mwIndex i, int field)
+{
+	return a->items[i * a->fields.size() + field];
+}
+
+void mxSetFieldByNumber(mxArray *a, mwIndex i, int field, mxArray *value)
+{
+	a->items[i * a->fields.size() + field] = value;
+}
+
+mxArray *mxGetField(const mxArray *a, mwIndex i, const char *name)
+{
+	int field = mxGetFieldNumber(a, name);
+	return field < 0 ? NULL : mxGetFieldByNumber(a, i, field);
+}
+
+void mxSetField(mxArray *a, mwIndex i, const char *name, mxArray *value)
+{
+	int field = mxGetFieldNumber(a, name);
+	if (field >= 0) {
+		mxSetFieldByNumber(a, i, field, value);
+	}
+}
+
+mxArray *mxGetProperty(const mxArray *a, mwIndex i, const char *name)
+{
+	return NULL;
+}
+
+int mexPrintf(const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int n = vprintf(format, args);
+	va_end(args);
+	return n;
+}
+
+void mexErrMsgIdAndTxt(const char *id, const char *format, ...)
+{
+	char message[1024];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	throw MexError(id, message);
+}
+
+void mexWarnMsgIdAndTxt(const char *id, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	fprintf(stderr, "Warning: ");
+	vfprintf(stderr, format, args);
+	fprintf(stderr, "\n");
+	va_end(args);
+}
+
+void mexMakeArrayPersistent(mxArray *a) {}
+void mexLock(void) {}
+void mexUnlock(void) {}
+bool mexIsLocked(void) { return true; }
+int mexAtExit(void (*fn)(void)) { return 0; }
+const char *mexFunctionName(void) { return "py"; }
+
+int mexCallMATLAB(int nlhs, mxArray **plhs, int nrhs, mxArray **prhs, const char *name)
+{
+	mexErrMsgIdAndTxt("mock:NotSupported", "Calling MATLAB function %s is not supported by the mock mx API", name);
+}
+
+mxArray *mexCallMATLABWithTrap(int nlhs, mxArray **plhs, int nrhs, mxArray **prhs, const char *name)
+{
+	const char *fields[] = {"identifier", "message"};
+	mxArray *exception = mxCreateStructMatrix(1, 1, 2, fields);
+	mxSetFieldByNumber(exception, 0, 0, mxCreateString("mock:NotSupported"));
+	mxSetFieldByNumber(exception, 0, 1, mxCreateString(name));
+	return exception;
+}
+
+mxArray *mexGetVariable(const char *workspace, const char *name)
+{
+	return NULL;
+}
+
+int mexPutVariable(const char *workspace, const char *name, const mxArray *a)
+{
+	return 1;
+}
+
+}
@@ -0,0 +1,180 @@
+/*
+ * Soak test of py.cpp's conversions and command dispatch, run against the
+ * mock mx API in bench/mock like the benchmarks. Built and run by
+ * `make soak`.
+ *
+ * Runs a long mix of set, get, eval, call and getslice commands, a few of them
+ * failing on purpose, through mexFunction. The failures cover bad arguments,
+ * Python errors and conversions that fail half way through a slice, a
+ * structured array and, when pandas is installed, a DataFrame. After a warm-up it records the resident
+ * memory of the process and the number of live Python objects, or the total
+ * reference count on a debug build of Python, and checks that neither has
+ * grown by the end:
+ *
+ *     soak [iterations]
+ *
+ * runs iterations commands (default 2000000) and exits with 1 on a leak.
+ */
+#include "../py.cpp"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+// Growth tolerated between the end of the warm-up and the end of the run
+static const double MAX_RSS_GROWTH = 8 << 20;
+static const double MAX_OBJECT_GROWTH = 64;
+
+static const size_t MIX_SIZE = 17;
+
+// Set by main when pandas can be imported
+static bool havePandas = false;
+
+// Calls py(args{:}) with nlhs outputs and frees the arguments and outputs.
+// Returns false if the command raised an error.
+static bool callPy(int nlhs, std::vector<mxArray*> args)
+{
+	mxArray *outputs[4] = {NULL, NULL, NULL, NULL};
+	bool ok = true;
+	try {
+		mexFunction(nlhs, outputs, (int) args.size(), (const mxArray**) &args[0]);
+	} catch (const MexError &) {
+		ok = false;
+	}
+	for (size_t i = 0; i < args.size(); i++) {
+		mxDestroyArray(args[i]);
+	}
+	for (int i = 0; i < nlhs; i++) {
+		if (outputs[i] != NULL) {
+			mxDestroyArray(outputs[i]);
+		}
+	}
+	return ok;
+}
+
+static double residentBytes()
+{
+	long pages = 0, resident = 0;
+	FILE *f = fopen("/proc/self/statm", "r");
+	if (f == NULL || fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+		resident = 0;
+	}
+	if (f != NULL) {
+		fclose(f);
+	}
+	return (double) resident * sysconf(_SC_PAGESIZE);
+}
+
+// Returns sys.gettotalrefcount() on a debug build of Python, otherwise the
+// number of objects the cycle collector tracks, after a full collection.
+static double pythonObjects()
+{
+	PyGC_Collect();
+	PyObject *totalRefs = PySys_GetObject((char*) "gettotalrefcount");
+	PyObject *count;
+	if (totalRefs != NULL) {
+		count = PyObject_CallObject(totalRefs, NULL);
+	} else {
+		PyObject *gc = PyImport_ImportModule("gc");
+		PyObject *objects = gc == NULL ? NULL : PyObject_CallMethod(gc, (char*) "get_objects", NULL);
+		count = objects == NULL ? NULL : PyInt_FromSsize_t(PyList_GET_SIZE(objects) - 1);
+		Py_XDECREF(objects);
+		Py_XDECREF(gc);
+	}
+	double n = count == NULL ? -1 : PyFloat_AsDouble(count);
+	Py_XDECREF(count);
+	return n;
+}
+
+static mxArray *vector(size_t n)
+{
+	mxArray *a = mxCreateDoubleMatrix(1, n, mxREAL);
+	for (size_t i = 0; i < n; i++) {
+		mxGetPr(a)[i] = (double) i;
+	}
+	return a;
+}
+
+static mxArray *structArray(size_t n)
+{
+	const char *fields[] = {"x", "name"};
+	mxArray *a = mxCreateStructMatrix(1, n, 2, fields);
+	for (size_t i = 0; i < n; i++) {
+		mxSetFieldByNumber(a, i, 0, mxCreateDoubleScalar((double) i));
+		mxSetFieldByNumber(a, i, 1, mxCreateString(i % 2 ? "odd" : "even"));
+	}
+	return a;
+}
+
+static mxArray *cellstr(size_t n)
+{
+	mxArray *a = mxCreateCellMatrix(1, n);
+	for (size_t i = 0; i < n; i++) {
+		mxSetCell(a, i, mxCreateString(i % 2 ? "odd" : "even"));
+	}
+	return a;
+}
+
+// Runs command i of the mix. Returns false if a command that should have
+// failed succeeded or the other way around.
+static bool runMix(size_t i)
+{
+	switch (i % MIX_SIZE) {
+	case 0: return callPy(0, {mxCreateString("set"), mxCreateString("x"), vector(100)});
+	case 1: return callPy(1, {mxCreateString("get"), mxCreateString("x")});
+	case 2: return callPy(0, {mxCreateString("eval"), mxCreateString("y = [x, {'a': x.sum()}, (1, 'b')]")});
+	case 3: return callPy(1, {mxCreateString("get"), mxCreateString("y")});
+	case 4: return callPy(0, {mxCreateString("set"), mxCreateString("s"), structArray(20)});
+	case 5: return callPy(1, {mxCreateString("get"), mxCreateString("s")});
+	case 6: return callPy(0, {mxCreateString("set"), mxCreateString("c"), cellstr(20)});
+	case 7: return callPy(1, {mxCreateString("get"), mxCreateString("c"), mxCreateString("cell"), mxCreateString("packed")});
+	case 8: return callPy(1, {mxCreateString("call"), mxCreateString("numpy.sum"), vector(10)});
+	case 9: return callPy(1, {mxCreateString("get"), mxCreateString("u'\\u00e9t\\u00e9' * 10")});
+	case 10: return callPy(0, {mxCreateString("set"), mxCreateString("z"), vector(3), mxCreateString("ns"), mxCreateString("soak")});
+	case 11: return !callPy(1, {mxCreateString("get"), mxCreateString("undefined_name")});
+	case 12: return !callPy(0, {mxCreateString("eval"), mxCreateString("raise ValueError('soak')")});
+	case 13: return !callPy(0, {mxCreateString("set"), mxCreateString("x"), vector(3), mxCreateString("copy")});
+	case 14: return !callPy(1, {mxCreateString("getslice"), mxCreateString("grid"), mxCreateDoubleScalar(1), mxCreateDoubleScalar(100)});
+	case 15: return !callPy(1, {mxCreateString("get"), mxCreateString("records")});
+	default: return havePandas ? !callPy(1, {mxCreateString("get"), mxCreateString("frame")}) : true;
+	}
+}
+
+int main(int argc, char **argv)
+{
+	size_t iterations = argc > 1 ? (size_t) atof(argv[1]) : 2000000;
+	size_t warmup = iterations / 10;
+
+	// Tracebacks of the failing commands would flood the output
+	callPy(0, {mxCreateString("eval"), mxCreateString("import sys, os; sys.stderr = open(os.devnull, 'w')")});
+	// Values whose conversion fails after part of them has been converted
+	callPy(0, {mxCreateString("eval"), mxCreateString(
+		"import numpy; grid = numpy.zeros((3, 3)); "
+		"records = numpy.array([(1.0, object())], dtype=[('a', 'f8'), ('b', 'O')])")});
+	havePandas = callPy(0, {mxCreateString("eval"), mxCreateString(
+		"import pandas; frame = pandas.DataFrame({'a': [1.0, 2.0], 'b': [object(), object()]})")});
+
+	double rss = 0, objects = 0;
+	for (size_t i = 0; i < iterations; i++) {
+		if (i == warmup) {
+			rss = residentBytes();
+			objects = pythonObjects();
+		}
+		if (!runMix(i)) {
+			fprintf(stderr, "Command %zu of the mix did not do what was expected\n", i % MIX_SIZE);
+			return 1;
+		}
+	}
+	double rssGrowth = residentBytes() - rss;
+	double objectGrowth = pythonObjects() - objects;
+
+	printf("%zu commands, resident memory grew by %.0f bytes and Python objects by %.0f after the first %zu\n",
+		iterations, rssGrowth, objectGrowth, warmup);
+	if (rssGrowth > MAX_RSS_GROWTH || objectGrowth > MAX_OBJECT_GROWTH) {
+		fprintf(stderr, "Leak: growth above %.0f bytes or %.0f objects\n", MAX_RSS_GROWTH, MAX_OBJECT_GROWTH);
+		return 1;
+	}
+	return 0;
+}
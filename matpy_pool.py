@@ -0,0 +1,334 @@
+"""Out-of-process Python workers for matpy.
+
+py('pool', ...) drives a pool of worker processes through this module, which
+the MEX file imports into its embedded interpreter. Each worker runs this file
+as a script. Requests and replies are pickled over the worker's stdin and
+stdout, each prefixed with its length. ndarrays of at least SHM_THRESHOLD
+bytes do not go through the pipes: the sender copies them into a file in
+/dev/shm and pickles its name, and the receiver maps the file and unlinks it,
+so the array it gets is backed by the shared memory itself. The file names
+carry the sender's pid, so that the files of a worker that died before they
+were mapped can be found and unlinked.
+"""
+
+import glob
+import mmap
+import os
+import select
+import struct
+import subprocess
+import sys
+import tempfile
+import time
+import traceback
+
+try:
+    import cPickle as pickle
+except ImportError:
+    import pickle
+
+try:
+    from cStringIO import StringIO as BytesIO
+except ImportError:
+    from io import BytesIO
+
+import numpy
+
+SHM_THRESHOLD = 1 << 16
+SHM_DIR = '/dev/shm' if os.path.isdir('/dev/shm') else tempfile.gettempdir()
+# Seconds a worker gets to exit after its stdin is closed, and then after it
+# is terminated, before it is killed
+STOP_TIMEOUT = 5
+
+_HEADER = struct.Struct('<Q')
+
+
+def _persistent_id(obj, created):
+    if (type(obj) is not numpy.ndarray or obj.dtype.kind not in 'biufc'
+            or obj.nbytes < SHM_THRESHOLD):
+        return None
+
+    order = 'F' if obj.flags.f_contiguous and not obj.flags.c_contiguous else 'C'
+    fd, path = tempfile.mkstemp(prefix='matpy-%d-' % os.getpid(), dir=SHM_DIR)
+    created.append(path)
+    try:
+        os.ftruncate(fd, obj.nbytes)
+        buf = mmap.mmap(fd, obj.nbytes)
+    finally:
+        os.close(fd)
+    view = numpy.ndarray(obj.shape, obj.dtype, buf, order=order)
+    view[...] = obj
+    del view
+    buf.close()
+    return ('shm', path, obj.dtype.str, obj.shape, order)
+
+
+def _persistent_load(pid):
+    kind, path, dtype, shape, order = pid
+    if kind != 'shm':
+        raise pickle.UnpicklingError('Unknown persistent id %r' % (kind,))
+
+    dtype = numpy.dtype(dtype)
+    nbytes = dtype.itemsize * int(numpy.prod(shape))
+    fd = os.open(path, os.O_RDWR)
+    try:
+        buf = mmap.mmap(fd, nbytes)
+    finally:
+        os.close(fd)
+        os.unlink(path)
+    return numpy.ndarray(shape, dtype, buf, order=order)
+
+
+def _dumps(obj, created):
+    """Pickles obj, appending the shared memory files it creates to created."""
+    out = BytesIO()
+    pickler = pickle.Pickler(out, 2)
+    pickler.persistent_id = lambda obj: _persistent_id(obj, created)
+    pickler.dump(obj)
+    return out.getvalue()
+
+
+def _loads(data):
+    unpickler = pickle.Unpickler(BytesIO(data))
+    unpickler.persistent_load = _persistent_load
+    return unpickler.load()
+
+
+def _unlink(paths):
+    for path in paths:
+        try:
+            os.unlink(path)
+        except OSError:
+            pass
+
+
+def _send(fd, obj, created=None):
+    """Sends obj, appending the shared memory files it creates to created."""
+    if created is None:
+        created = []
+    # Nobody will map and unlink the files of a message that was not sent
+    try:
+        data = _dumps(obj, created)
+        data = _HEADER.pack(len(data)) + data
+        while data:
+            data = data[os.write(fd, data):]
+    except BaseException:
+        _unlink(created)
+        raise
+
+
+def _read(fd, n):
+    chunks = []
+    while n > 0:
+        chunk = os.read(fd, min(n, 1 << 20))
+        if not chunk:
+            raise EOFError('Channel closed')
+        chunks.append(chunk)
+        n -= len(chunk)
+    return b''.join(chunks)
+
+
+def _receive(fd):
+    n, = _HEADER.unpack(_read(fd, _HEADER.size))
+    return _loads(_read(fd, n))
+
+
+def _resolve(name, namespace):
+    """Returns the object named by a dotted name, importing its module."""
+    parts = name.split('.')
+    if parts[0] in namespace:
+        obj = namespace[parts[0]]
+    elif len(parts) == 1:
+        obj = eval(name, namespace)
+    else:
+        obj = __import__(parts[0])
+    for i, part in enumerate(parts[1:]):
+        if not hasattr(obj, part):
+            __import__('.'.join(parts[:i + 2]))
+        obj = getattr(obj, part)
+    return obj
+
+
+def _wait(process, timeout):
+    """Waits up to timeout seconds for process to exit and returns whether it
+    did."""
+    deadline = time.time() + timeout
+    while process.poll() is None:
+        if time.time() >= deadline:
+            return False
+        time.sleep(0.01)
+    return True
+
+
+class _Worker(object):
+    def __init__(self, executable):
+        self.process = subprocess.Popen(
+            [executable, os.path.abspath(__file__.replace('.pyc', '.py'))],
+            stdin=subprocess.PIPE, stdout=subprocess.PIPE, close_fds=True)
+        # Shared memory files of the request the worker has not replied to
+        self.pending = []
+
+    def send(self, request):
+        self.pending = []
+        _send(self.process.stdin.fileno(), request, self.pending)
+
+    def receive(self):
+        reply = _receive(self.process.stdout.fileno())
+        # The worker loaded the request, and unlinked its files, before replying
+        self.pending = []
+        return reply
+
+    def fileno(self):
+        return self.process.stdout.fileno()
+
+    def sweep(self):
+        """Unlinks the shared memory files the exited worker left behind: those
+        of a request it did not load and those of a reply it did not finish."""
+        _unlink(self.pending)
+        self.pending = []
+        _unlink(glob.glob(os.path.join(SHM_DIR, 'matpy-%d-*' % self.process.pid)))
+
+    def stop(self):
+        self.process.stdin.close()
+        if not _wait(self.process, STOP_TIMEOUT):
+            self.process.terminate()
+            if not _wait(self.process, STOP_TIMEOUT):
+                self.process.kill()
+                self.process.wait()
+        self.sweep()
+
+
+_workers = []
+_executable = sys.executable
+
+
+def start(executable, n):
+    """Starts n workers running executable, replacing a running pool."""
+    global _executable
+    stop()
+    _executable = executable
+    _workers.extend(_Worker(executable) for _ in range(n))
+
+
+def stop():
+    for worker in _workers:
+        worker.stop()
+    del _workers[:]
+
+
+def size():
+    return len(_workers)
+
+
+def _died(index):
+    worker = _workers[index]
+    code = worker.process.wait()
+    worker.sweep()
+    _workers[index] = _Worker(_executable)
+    return RuntimeError('Pool worker %d exited with code %s and was restarted'
+                        % (index + 1, code))
+
+
+def _request(index, request):
+    try:
+        _workers[index].send(request)
+    except (IOError, OSError):
+        raise _died(index)
+
+
+def _reply(index):
+    try:
+        status, value = _workers[index].receive()
+    except (EOFError, IOError, OSError):
+        raise _died(index)
+    if status == 'error':
+        raise RuntimeError('Pool worker %d: %s' % (index + 1, value))
+    return value
+
+
+def run(index, request):
+    """Sends a request to the worker with the 0-based index and returns its
+    reply."""
+    if not 0 <= index < len(_workers):
+        raise IndexError('There is no pool worker %d in a pool of %d'
+                         % (index + 1, len(_workers)))
+    _request(index, request)
+    return _reply(index)
+
+
+def map_call(func, inputs):
+    """Calls the function named func on every input, spread over the workers,
+    and returns the results in the order of the inputs. After an error the
+    calls already sent are still collected before it is raised."""
+    if not _workers:
+        raise RuntimeError('The pool is not started')
+
+    results = [None] * len(inputs)
+    idle = list(range(len(_workers)))
+    busy = {}
+    error = None
+    sent = 0
+    while (sent < len(inputs) and error is None) or busy:
+        while idle and sent < len(inputs) and error is None:
+            index = idle.pop()
+            try:
+                _request(index, ('call', func, (inputs[sent],)))
+            except RuntimeError as e:
+                error = e
+                idle.append(index)
+                break
+            busy[index] = sent
+            sent += 1
+        if not busy:
+            break
+
+        ready, _, _ = select.select([_workers[i] for i in busy], [], [])
+        for worker in ready:
+            index = _workers.index(worker)
+            i = busy.pop(index)
+            try:
+                results[i] = _reply(index)
+            except RuntimeError as e:
+                error = error or e
+            idle.append(index)
+
+    if error is not None:
+        raise error
+    return results
+
+
+def _serve():
+    channel_in = os.dup(0)
+    channel_out = os.dup(1)
+    # Anything the worker prints must not end up in the channel
+    os.dup2(2, 1)
+    sys.stdout = sys.stderr
+
+    namespace = {'__name__': '__main__'}
+    while True:
+        try:
+            request = _receive(channel_in)
+        except EOFError:
+            return
+        try:
+            op = request[0]
+            if op == 'eval':
+                exec(request[1], namespace)
+                reply = None
+            elif op == 'get':
+                reply = eval(request[1], namespace)
+            elif op == 'set':
+                namespace[request[1]] = request[2]
+                reply = None
+            elif op == 'call':
+                reply = _resolve(request[1], namespace)(*request[2])
+            else:
+                raise ValueError('Unknown request %r' % (op,))
+            _send(channel_out, ('ok', reply))
+        except Exception:
+            message = traceback.format_exception_only(*sys.exc_info()[:2])
+            _send(channel_out, ('error', ''.join(message).strip()))
+
+
+if __name__ == '__main__':
+    _serve()
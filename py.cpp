@@ -25,43 +25,522 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include <mex.h>
 #include <Python.h>
+#define NPY_NO_DEPRECATED_API NPY_1_7_API_VERSION
+#include <numpy/arrayobject.h>
+#include <stdarg.h>
 #include <string.h>
 #include <dlfcn.h>
+#include <algorithm>
+#include <chrono>
+#include <complex>
+#include <condition_variable>
+#include <functional>
+#include <limits>
+#include <list>
+#include <map>
+#include <mutex>
+#include <new>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
-static const char *pyObjectToString(PyObject *pyObject);
+static std::string pyObjectToString(PyObject *pyObject);
 static void addVariableToPython(const char* name, PyObject *value);
-static PyObject *matpy_write(PyObject *self, PyObject *args);
+static PyObject *matpy_write_stdout(PyObject *self, PyObject *text);
+static PyObject *matpy_write_stderr(PyObject *self, PyObject *text);
 static PyObject* matpy_flush(PyObject* self, PyObject* args);
 static void initMatpyPrint(void);
+static void initMatpyModule(void);
+static void initMatlabModule(void);
+static PyObject* mat2py(const mxArray *a);
+static mxArray* py2mat(PyObject *o);
 
+// The namespace the current command runs in, __main__'s dict unless the
+// command was given 'ns', name
 static PyObject *globals;
+static PyObject *mainGlobals;
 static PyObject *module;
+// Named namespaces, each a globals dict of its own
+static std::map<std::string, PyObject*> namespaces;
 static int nlhs, nrhs;
 static mxArray **plhs;
 static const mxArray **prhs;
-static PyObject *np_array_fun;
 static PyObject *ndarray_cls;
 static bool debug = false;
+// Callables resolved from modules by py('call', ...), keyed by dotted name
+static PyObject *callableCache;
+// Converters registered by matpy.register_converter, keyed by Python type
+static PyObject *converters;
+// Python objects pinned by PyRef handles, keyed by handle id
+static std::map<uint64_t, PyObject*> handles;
+static uint64_t nextHandleId = 1;
+// 1-based index of the operation being run by py('batch', ...), 0 otherwise.
+static int batchOp = 0;
+
+// Owns one reference to a Python object and releases it when it goes out of
+// scope, which includes a matpy error unwinding the stack.
+class PyOwned
+{
+public:
+	explicit PyOwned(PyObject *o = NULL) : o(o) {}
+	~PyOwned() { Py_XDECREF(o); }
+
+	PyObject *get() const { return o; }
+	operator PyObject*() const { return o; }
+
+	// Hands the reference over to the caller
+	PyObject *release()
+	{
+		PyObject *released = o;
+		o = NULL;
+		return released;
+	}
+
+	void reset(PyObject *p = NULL)
+	{
+		PyObject *old = o;
+		o = p;
+		Py_XDECREF(old);
+	}
+
+private:
+	PyOwned(const PyOwned &);
+	PyOwned &operator=(const PyOwned &);
+
+	PyObject *o;
+};
+
+// Options that control how MATLAB values are exported to Python. They are
+// reset at the start of every command.
+struct ExportOptions
+{
+	// Give every exported numeric array its own NumPy-owned buffer instead of
+	// wrapping a private duplicate of the MATLAB data.
+	bool copy;
+	// Allow conversions that lose precision, such as complex 64-bit integers
+	// to complex128.
+	bool lossy;
+	// How struct arrays are exported
+	enum StructMode { STRUCT_LISTS, STRUCT_COLUMNS, STRUCT_RECORDS } structMode;
+	// How cell arrays are exported: as lists, or packed into one ndarray
+	// when every cell holds the same kind of value
+	enum CellMode { CELL_LISTS, CELL_PACKED } cellMode;
+	// Export real 1x1 values as Python scalars and vectors as 1-d ndarrays,
+	// instead of 2-d ndarrays
+	bool native;
+};
+static ExportOptions exportOptions;
+// The native export option commands start with, set by py('init')
+static bool nativeDefault = false;
+
+// Options that control how Python values are imported into MATLAB, reset
+// at the start of every command.
+struct ImportOptions
+{
+	// Turn lists of scalars of one Python type into numeric arrays
+	// instead of cell arrays.
+	bool packLists;
+};
+static ImportOptions importOptions;
+
+// Once async jobs have been started the MATLAB thread only holds the GIL
+// while a command runs, so the worker can run Python in between. The saved
+// thread state is NULL while the MATLAB thread holds the GIL.
+static std::thread::id matlabThread;
+static bool asyncWorkerStarted = false;
+static PyThreadState *matlabThreadState = NULL;
+// Arrays the worker thread released, which only the MATLAB thread may
+// destroy. Guarded by the GIL.
+static std::vector<mxArray*> pendingDestroy;
+
+// Text written to sys.stdout and sys.stderr. Each stream collects what is
+// written and sends it to the MATLAB console once it holds a complete line,
+// grows past OUTPUT_FLUSH_BYTES or the command ends. Only the MATLAB thread
+// prints, so the output of async jobs waits for the next command. In capture
+// mode the MATLAB thread's output to both streams is kept, in the order it
+// was written, and returned by the command instead. Guarded by the GIL.
+enum { STDOUT, STDERR };
+static const size_t OUTPUT_FLUSH_BYTES = 1 << 16;
+static std::string outputBuffers[2];
+static std::string capturedOutput;
+static bool captureOutput = false;
+
+// Prints the buffered output of both streams, or only their complete lines.
+static void flushOutput(bool partialLines)
+{
+	if (std::this_thread::get_id() != matlabThread) {
+		return;
+	}
+	for (int stream = STDOUT; stream <= STDERR; stream++) {
+		std::string &buffer = outputBuffers[stream];
+		// Without a newline rfind returns npos, and end wraps around to 0
+		size_t end = partialLines ? buffer.size() : buffer.rfind('\n') + 1;
+		if (end > 0) {
+			mexPrintf("%s", buffer.substr(0, end).c_str());
+			buffer.erase(0, end);
+		}
+	}
+}
+
+static void writeOutput(int stream, const char *text, size_t size)
+{
+	if (captureOutput && std::this_thread::get_id() == matlabThread) {
+		capturedOutput.append(text, size);
+		return;
+	}
+	outputBuffers[stream].append(text, size);
+	if (outputBuffers[stream].size() >= OUTPUT_FLUSH_BYTES) {
+		flushOutput(true);
+	} else if (memchr(text, '\n', size) != NULL) {
+		flushOutput(false);
+	}
+}
+
+// PyRef handles cleared while py could not be entered, by a MATLAB function
+// Python called back into. Guarded by the GIL.
+static std::vector<uint64_t> pendingReleases;
+
+// Drops the reference a PyRef handle holds, if it still has one.
+static void releaseHandle(uint64_t id)
+{
+	std::map<uint64_t, PyObject*>::iterator found = handles.find(id);
+	if (found != handles.end())
+	{
+		PyObject *o = found->second;
+		handles.erase(found);
+		Py_DECREF(o);
+	}
+}
+
+static void releasePendingHandles()
+{
+	// Releasing can run Python code that clears more handles
+	while (!pendingReleases.empty())
+	{
+		uint64_t id = pendingReleases.back();
+		pendingReleases.pop_back();
+		releaseHandle(id);
+	}
+}
+
+// Does the work deferred by the worker thread and by callbacks. Needs the
+// GIL.
+static void runDeferredWork()
+{
+	for (size_t i = 0; i < pendingDestroy.size(); i++) {
+		mxDestroyArray(pendingDestroy[i]);
+	}
+	pendingDestroy.clear();
+	releasePendingHandles();
+	flushOutput(true);
+}
+
+// Takes the GIL back at the start of a command.
+static void acquireGil()
+{
+	if (matlabThreadState != NULL) {
+		PyEval_RestoreThread(matlabThreadState);
+		matlabThreadState = NULL;
+	}
+	runDeferredWork();
+}
+
+// Lets the worker thread run Python until the next command. Called at the end
+// of every command, including the ones ending in an error.
+static void releaseGil()
+{
+	if (asyncWorkerStarted && matlabThreadState == NULL) {
+		matlabThreadState = PyEval_SaveThread();
+	}
+}
+
+struct GilGuard
+{
+	GilGuard() { acquireGil(); }
+	~GilGuard()
+	{
+		flushOutput(true);
+		releaseGil();
+	}
+};
+
+// Per command performance counters reported by py('stats'). Each call is
+// split into phases: converting MATLAB values into Python, compiling,
+// executing and converting results back. Phases only count on the MATLAB
+// thread and a phase started while another one runs is part of that one.
+enum Phase { PHASE_IN, PHASE_COMPILE, PHASE_EXECUTE, PHASE_OUT, PHASE_COUNT };
+static const char *const phaseNames[PHASE_COUNT] = {"convertIn", "compile", "execute", "convertOut"};
+
+struct CommandStats
+{
+	double calls, time, maxTime;
+	double phaseTime[PHASE_COUNT], phaseMaxTime[PHASE_COUNT];
+	double bytesIn, bytesOut, objectsIn, objectsOut;
+};
+static std::map<std::string, CommandStats> commandStats;
+
+typedef std::chrono::steady_clock StatsClock;
+// Name of the command being timed, empty if none
+static std::string statsCommand;
+static StatsClock::time_point statsCommandStart;
+static CommandStats statsCall;
+static int activePhase = -1;
+
+// Chrome trace_event timeline, written to traceOut as the events happen so
+// that a long trace does not build up in memory. The async worker adds
+// events too, hence the mutex.
+static FILE *traceOut = NULL;
+static size_t traceCount = 0;
+static std::mutex traceMutex;
+static StatsClock::time_point traceOrigin;
+
+static double seconds(StatsClock::time_point start, StatsClock::time_point end)
+{
+	return std::chrono::duration<double>(end - start).count();
+}
+
+// Adds a complete ("X") event on thread tid to the trace, if tracing.
+static void traceEvent(const char *name, const char *category, StatsClock::time_point start, StatsClock::time_point end, int tid)
+{
+	std::lock_guard<std::mutex> lock(traceMutex);
+	if (traceOut == NULL) {
+		return;
+	}
+	fprintf(traceOut, "%s{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": %d}",
+		traceCount++ > 0 ? ",\n" : "", name, category, 1e6 * seconds(traceOrigin, start), 1e6 * seconds(start, end), tid);
+}
+
+// Ends the trace being written, if any, and closes its file.
+static void stopTrace()
+{
+	std::lock_guard<std::mutex> lock(traceMutex);
+	if (traceOut == NULL) {
+		return;
+	}
+	fprintf(traceOut, "\n], \"displayTimeUnit\": \"ms\"}\n");
+	fclose(traceOut);
+	traceOut = NULL;
+}
+
+static void startCommandStats(const char *cmd)
+{
+	statsCommand = strcmp(cmd, "stats") ? cmd : "";
+	statsCommandStart = StatsClock::now();
+	statsCall = CommandStats();
+	activePhase = -1;
+}
+
+// Folds the counters of the command that just ended into its totals. Called
+// when a command returns and when it fails.
+static void finishCommandStats()
+{
+	if (statsCommand.empty()) {
+		return;
+	}
+	StatsClock::time_point end = StatsClock::now();
+	double time = seconds(statsCommandStart, end);
+	CommandStats &stats = commandStats[statsCommand];
+	stats.calls++;
+	stats.time += time;
+	stats.maxTime = std::max(stats.maxTime, time);
+	for (int i = 0; i < PHASE_COUNT; i++) {
+		stats.phaseTime[i] += statsCall.phaseTime[i];
+		stats.phaseMaxTime[i] = std::max(stats.phaseMaxTime[i], statsCall.phaseTime[i]);
+	}
+	stats.bytesIn += statsCall.bytesIn;
+	stats.bytesOut += statsCall.bytesOut;
+	stats.objectsIn += statsCall.objectsIn;
+	stats.objectsOut += statsCall.objectsOut;
+	traceEvent(statsCommand.c_str(), "command", statsCommandStart, end, 1);
+	statsCommand.clear();
+}
+
+struct CommandStatsGuard
+{
+	~CommandStatsGuard() { finishCommandStats(); }
+};
+
+// Times one phase of the current command for as long as it is in scope.
+struct PhaseTimer
+{
+	int phase;
+	StatsClock::time_point start;
+
+	PhaseTimer(int phase_) : phase(-1)
+	{
+		if (activePhase < 0 && !statsCommand.empty() && std::this_thread::get_id() == matlabThread) {
+			phase = activePhase = phase_;
+			start = StatsClock::now();
+		}
+	}
+
+	~PhaseTimer()
+	{
+		if (phase >= 0) {
+			StatsClock::time_point end = StatsClock::now();
+			statsCall.phaseTime[phase] += seconds(start, end);
+			activePhase = -1;
+			traceEvent(phaseNames[phase], "phase", start, end, 1);
+		}
+	}
+};
+
+// Number of calls into MATLAB that are running, from Python through the
+// matlab module or from py itself. py cannot be entered again meanwhile, and
+// a matpy error raised by a matlab module call becomes a Python exception.
+static int callbackDepth = 0;
+
+// Keeps the options of the running command out of the conversions of a
+// callback, and counts it in callbackDepth.
+struct CallbackScope
+{
+	ExportOptions savedExport;
+	ImportOptions savedImport;
+
+	CallbackScope() : savedExport(exportOptions), savedImport(importOptions)
+	{
+		exportOptions = ExportOptions();
+		importOptions = ImportOptions();
+		callbackDepth++;
+	}
+
+	~CallbackScope()
+	{
+		callbackDepth--;
+		exportOptions = savedExport;
+		importOptions = savedImport;
+	}
+};
+
+// A matpy error on its way out. mexFunction raises it as a MATLAB error once
+// the stack has unwound, so the references, GIL and counters held along the
+// way have all been released by then.
+struct MatpyError
+{
+	std::string id;
+	std::string message;
+};
+
+// Raises a MATLAB error with the given identifier. Inside a batch the
+// message names the operation that failed.
+static void matpyError(const char *id, const char *format, ...)
+{
+	char message[1024];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+
+	MatpyError error = {id, message};
+	if (callbackDepth == 0)
+	{
+		if (batchOp > 0)
+		{
+			snprintf(message, sizeof(message), "Batch operation %d: ", batchOp);
+			error.message = message + error.message;
+		}
+		// Captured output, such as a traceback, is part of the error
+		if (captureOutput && !capturedOutput.empty())
+		{
+			error.message += "\n" + capturedOutput;
+		}
+	}
+	throw error;
+}
 
 static PyMethodDef matpyPrintMethods[] =
 {
-    {"write", matpy_write, METH_VARARGS, "write is used to output to the MATLAB console"},
-    {"flush", matpy_flush, METH_VARARGS, "flush is not needed and does nothing"},
+    {"write", matpy_write_stdout, METH_O, "write is used to output to the MATLAB console"},
+    {"flush", matpy_flush, METH_NOARGS, "flush prints the buffered output"},
+    {NULL, NULL, 0, NULL}
+};
+
+static PyMethodDef matpyPrintErrorMethods[] =
+{
+    {"write", matpy_write_stderr, METH_O, "write is used to output errors to the MATLAB console"},
+    {"flush", matpy_flush, METH_NOARGS, "flush prints the buffered output"},
     {NULL, NULL, 0, NULL}
 };
 
-static PyObject *matpy_write(PyObject *self, PyObject *args)
+// Buffers str and unicode objects, the latter encoded as UTF-8.
+static PyObject *matpyWrite(int stream, PyObject *text)
 {
-    const char *output;
-    if (!PyArg_ParseTuple(args, "s", &output))
+    if (PyUnicode_Check(text))
+    {
+        PyObject *utf8 = PyUnicode_AsUTF8String(text);
+        if (utf8 == NULL)
+            return NULL;
+        writeOutput(stream, PyString_AS_STRING(utf8), PyString_GET_SIZE(utf8));
+        Py_DECREF(utf8);
+    }
+    else if (PyString_Check(text))
+    {
+        writeOutput(stream, PyString_AS_STRING(text), PyString_GET_SIZE(text));
+    }
+    else
+    {
+        PyErr_Format(PyExc_TypeError, "expected a string or unicode, got %s", Py_TYPE(text)->tp_name);
         return NULL;
-    printf("%s", output);
-    return Py_BuildValue("");
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject *matpy_write_stdout(PyObject *self, PyObject *text)
+{
+    return matpyWrite(STDOUT, text);
+}
+
+static PyObject *matpy_write_stderr(PyObject *self, PyObject *text)
+{
+    return matpyWrite(STDERR, text);
 }
 
 static PyObject* matpy_flush(PyObject* self, PyObject* args)
 {
-    return Py_BuildValue("");
+    flushOutput(true);
+    Py_RETURN_NONE;
+}
+
+static PyObject *matpy_register_converter(PyObject *self, PyObject *args)
+{
+    PyObject *type, *converter;
+    if (!PyArg_ParseTuple(args, "O!O", &PyType_Type, &type, &converter))
+        return NULL;
+    if (!PyCallable_Check(converter))
+    {
+        PyErr_SetString(PyExc_TypeError, "converter must be callable");
+        return NULL;
+    }
+    if (PyDict_SetItem(converters, type, converter) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+static PyObject *matpy_unregister_converter(PyObject *self, PyObject *args)
+{
+    PyObject *type;
+    if (!PyArg_ParseTuple(args, "O!", &PyType_Type, &type))
+        return NULL;
+    if (PyDict_DelItem(converters, type) < 0)
+        PyErr_Clear();
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef matpyMethods[] =
+{
+    {"register_converter", matpy_register_converter, METH_VARARGS,
+     "register_converter(type, func) makes matpy convert instances of type, and of its subclasses, by converting func(value) instead"},
+    {"unregister_converter", matpy_unregister_converter, METH_VARARGS,
+     "unregister_converter(type) removes the converter registered for type"},
+    {NULL, NULL, 0, NULL}
+};
+
+static void initMatpyModule(void)
+{
+    converters = PyDict_New();
+    Py_InitModule3("matpy", matpyMethods, "Hooks into the conversion of Python values to MATLAB");
 }
 
 static void initMatpyPrint(void)
@@ -70,542 +549,4016 @@ static void initMatpyPrint(void)
     if (NULL != matpyPrintModule)
     {
         PySys_SetObject((char*)"stdout", matpyPrintModule);
-        PySys_SetObject((char*)"stderr", matpyPrintModule);
+    }
+    PyObject *matpyPrintErrorModule = Py_InitModule("print_error", matpyPrintErrorMethods);
+    if (NULL != matpyPrintErrorModule)
+    {
+        PySys_SetObject((char*)"stderr", matpyPrintErrorModule);
     }
 }
 
-static PyObject* mat2py(const mxArray *a) {
-	size_t ndims = mxGetNumberOfDimensions(a);
-	const mwSize *dims = mxGetDimensions(a);
-	mxClassID cls = mxGetClassID(a);
-	size_t nelem = mxGetNumberOfElements(a);
-	char *data = (char*) mxGetData(a);
-	char *imagData = (char*) mxGetImagData(a);
+// Edge of the square tiles used when the source and destination layouts
+// disagree, sized so that one tile of doubles stays in L1.
+static const npy_intp COPY_TILE = 32;
+// Copies smaller than this are not worth spreading over threads.
+static const size_t PARALLEL_COPY_BYTES = 4 << 20;
+static const unsigned MAX_COPY_THREADS = 8;
 
-	if (debug) mexPrintf("cls = %d, nelem = %d, ndims = %d, dims[0] = %d, dims[1] = %d\n", cls, nelem, ndims, dims[0], dims[1]);
+// Runs fn(first, last) over the range [0, n), split across a few threads
+// when bytes is large enough for that to pay off.
+template <typename F>
+static void parallelFor(npy_intp n, size_t bytes, F fn)
+{
+	unsigned nthreads = std::min(std::thread::hardware_concurrency(), MAX_COPY_THREADS);
+	if (bytes < PARALLEL_COPY_BYTES || nthreads < 2 || n < 2) {
+		fn(0, n);
+		return;
+	}
+	nthreads = (unsigned) std::min((npy_intp) nthreads, n);
 
-	if (cls == mxCHAR_CLASS) {
-		char *str = mxArrayToString(a);
-		PyObject *o = PyString_FromString(str);
-		mxFree(str);
-		return o;
-	} else if (mxIsStruct(a)) {
-		PyObject *o = PyDict_New();
-		PyObject *list;
-		PyObject *pyItem;
-		mxArray *item;
-		int i, j;
-		const char *fieldName;
+	std::vector<std::thread> threads;
+	npy_intp chunk = (n + nthreads - 1) / nthreads;
+	npy_intp first = chunk;
+	try {
+		for (; first < n; first += chunk) {
+			threads.push_back(std::thread(fn, first, std::min(first + chunk, n)));
+		}
+	} catch (const std::exception &) {
+		// Could not start another thread, do the rest here
+		fn(first, n);
+	}
+	fn(0, std::min(chunk, n));
+	for (size_t i = 0; i < threads.size(); i++) {
+		threads[i].join();
+	}
+}
 
-		int nfields = mxGetNumberOfFields(a);
-		if (debug) mexPrintf("nfields = %d, nelem = %d\n", nfields, nelem);
+// Copies an ni x nj tile whose source elements are s0 and sk bytes apart
+// into a column-major destination with columns dk elements apart.
+template <typename T>
+static void copyTile(const char *src, npy_intp s0, npy_intp sk, npy_intp ni, npy_intp nj, T *dst, T *, npy_intp dk)
+{
+	for (npy_intp j = 0; j < nj; j++) {
+		const char *s = src + j * sk;
+		T *d = dst + j * dk;
+		for (npy_intp i = 0; i < ni; i++) {
+			d[i] = *(const T*) (s + i * s0);
+		}
+	}
+}
+
+// Same as copyTile for interleaved complex sources, split into separate real
+// and imaginary destinations.
+template <typename T>
+static void splitTile(const char *src, npy_intp s0, npy_intp sk, npy_intp ni, npy_intp nj, T *re, T *im, npy_intp dk)
+{
+	for (npy_intp j = 0; j < nj; j++) {
+		const char *s = src + j * sk;
+		T *r = re + j * dk;
+		T *m = im + j * dk;
+		for (npy_intp i = 0; i < ni; i++) {
+			const T *c = (const T*) (s + i * s0);
+			r[i] = c[0];
+			m[i] = c[1];
+		}
+	}
+}
 
-		for(i = 0; i < nfields; i++) {
-			fieldName = mxGetFieldNameByNumber(a, i);
-			list = PyList_New(nelem);
-
-			for(j = 0; j < nelem; j++) {
-				item = mxGetFieldByNumber(a, j, i);
-                if(item == NULL)
-                {
-                	Py_DECREF(list);
-                	Py_DECREF(o);
-                	mexErrMsgIdAndTxt("matpy:NullFieldValue", "Null field in struct");
-                }
-				pyItem = mat2py(item);
-                if(pyItem == NULL)
-                {
-                	Py_DECREF(list);
-                	Py_DECREF(o);
-                    mexErrMsgIdAndTxt("matpy:UnsupportedVariableType", "Unsupported variable type in struct");
-                }
-    			
-                PyList_SetItem(list, j, pyItem);
-            }
-
-            PyDict_SetItemString(o, fieldName, list);
-		}
-
-		Py_DECREF(list);
+struct Complex128Bits { uint64_t re, im; };
 
-		return o;
+// Copies an arbitrarily strided N-D array into column-major order. Axis 0,
+// the contiguous axis of the destination, is tiled against the source axis
+// with the smallest stride, so C ordered and transposed arrays are read and
+// written a cache line at a time. The remaining axes are walked one slab at
+// a time and the (slab, tile column) units are shared between threads.
+struct LayoutConversion
+{
+	const char *src;
+	int nd;
+	npy_intp dims[NPY_MAXDIMS];
+	npy_intp strides[NPY_MAXDIMS];
+	npy_intp dstStrides[NPY_MAXDIMS]; // in elements
+	int k;
+	npy_intp tileCols;
+
+	LayoutConversion(PyArrayObject *ary)
+	{
+		src = PyArray_BYTES(ary);
+		nd = PyArray_NDIM(ary);
+		for (int i = 0; i < nd; i++) {
+			dims[i] = PyArray_DIMS(ary)[i];
+			strides[i] = PyArray_STRIDES(ary)[i];
+		}
+		for (; nd < 2; nd++) {
+			dims[nd] = 1;
+			strides[nd] = 0;
+		}
+
+		k = 1;
+		for (int i = 2; i < nd; i++) {
+			if (dims[i] > 1 && (dims[k] == 1 || llabs(strides[i]) < llabs(strides[k]))) {
+				k = i;
+			}
+		}
+
+		dstStrides[0] = 1;
+		for (int i = 1; i < nd; i++) {
+			dstStrides[i] = dstStrides[i - 1] * dims[i - 1];
+		}
+		tileCols = (dims[k] + COPY_TILE - 1) / COPY_TILE;
 	}
 
-	PyObject *list = PyList_New(nelem);
-	const char *dtype = NULL;
-	if (mxIsCell(a)) 
+	npy_intp units() const
 	{
-		dtype = "object";
+		npy_intp slabs = 1;
+		for (int i = 1; i < nd; i++) {
+			if (i != k) slabs *= dims[i];
+		}
+		return slabs * tileCols;
+	}
 
-		for (int i = 0; i < nelem; i++) 
-		{
-			PyObject *item = mat2py(mxGetCell(a, i));
+	template <typename T, void (*tile)(const char*, npy_intp, npy_intp, npy_intp, npy_intp, T*, T*, npy_intp)>
+	void run(npy_intp first, npy_intp last, T *dst, T *dstImag) const
+	{
+		for (npy_intp u = first; u < last; u++) {
+			npy_intp slab = u / tileCols;
+			npy_intp j0 = (u % tileCols) * COPY_TILE;
+			npy_intp nj = std::min(COPY_TILE, dims[k] - j0);
 
-			if(NULL != item)
-			{
-				PyList_SetItem(list, i, item);
+			const char *s = src + j0 * strides[k];
+			npy_intp d = j0 * dstStrides[k];
+			for (int i = 1; i < nd; i++) {
+				if (i == k) continue;
+				npy_intp idx = slab % dims[i];
+				slab /= dims[i];
+				s += idx * strides[i];
+				d += idx * dstStrides[i];
 			}
-			else // Failure
-			{
-				Py_DECREF(list);
-				mexErrMsgIdAndTxt("matpy:UnsupportedVariableType", "Unsupported variable type in a cell");
+
+			for (npy_intp i0 = 0; i0 < dims[0]; i0 += COPY_TILE) {
+				npy_intp ni = std::min(COPY_TILE, dims[0] - i0);
+				tile(s + i0 * strides[0], strides[0], strides[k], ni, nj,
+					dst + d + i0, dstImag == NULL ? NULL : dstImag + d + i0, dstStrides[k]);
 			}
 		}
-		return list;
+	}
+};
+
+template <typename T>
+static void convertLayout(const LayoutConversion &conv, size_t bytes, void *dst)
+{
+	parallelFor(conv.units(), bytes, [&](npy_intp first, npy_intp last) {
+		conv.run<T, copyTile<T> >(first, last, (T*) dst, NULL);
+	});
+}
+
+template <typename T>
+static void convertLayoutSplit(const LayoutConversion &conv, size_t bytes, void *re, void *im)
+{
+	parallelFor(conv.units(), bytes, [&](npy_intp first, npy_intp last) {
+		conv.run<T, splitTile<T> >(first, last, (T*) re, (T*) im);
+	});
+}
+
+// Copies the elements of ary into dst in column-major order. Complex arrays
+// are split into dst and dstImag. Runs without the GIL.
+static void copyToColumnMajor(PyArrayObject *ary, void *dst, void *dstImag)
+{
+	size_t bytes = PyArray_NBYTES(ary);
+	int elsize = PyArray_ITEMSIZE(ary);
+
+	Py_BEGIN_ALLOW_THREADS
+	if (dstImag == NULL && PyArray_IS_F_CONTIGUOUS(ary)) {
+		const char *src = PyArray_BYTES(ary);
+		npy_intp chunks = (bytes + PARALLEL_COPY_BYTES - 1) / PARALLEL_COPY_BYTES;
+		parallelFor(chunks, bytes, [&](npy_intp first, npy_intp last) {
+			size_t begin = first * PARALLEL_COPY_BYTES;
+			size_t end = std::min(last * PARALLEL_COPY_BYTES, bytes);
+			memcpy((char*) dst + begin, src + begin, end - begin);
+		});
 	} else {
-		if (imagData == NULL) {
-#define CASE(cls,c_type,d_type,py_ctor) case cls: for (int i = 0; i < nelem; i++) { \
-dtype=d_type; \
-PyObject *item = py_ctor(*((c_type*) data)); \
-if (debug) mexPrintf("Setting %d to %f (item = 0x%08X)\n", i, (double) *((c_type*) data), item); \
-data += sizeof(c_type); \
-if (PyList_SetItem(list, i, item) == -1) PyErr_Print(); } \
-break
-			switch(cls) {
-			CASE(mxLOGICAL_CLASS, bool, "bool", PyBool_FromLong);
-			CASE(mxDOUBLE_CLASS, double, "float64", PyFloat_FromDouble);
-			CASE(mxSINGLE_CLASS, float, "float32", PyFloat_FromDouble);
-			CASE(mxINT8_CLASS, char, "int8", PyInt_FromLong);
-			CASE(mxUINT8_CLASS, unsigned char, "uint8", PyInt_FromLong);
-			CASE(mxINT16_CLASS, short, "int16", PyInt_FromLong);
-			CASE(mxUINT16_CLASS, unsigned short, "uint16", PyInt_FromLong);
-			CASE(mxINT32_CLASS, int, "int32", PyInt_FromLong);
-			CASE(mxUINT32_CLASS, unsigned int, "uint32", PyLong_FromLongLong);
-			CASE(mxINT64_CLASS, long long, "int64", PyLong_FromLongLong);
-			CASE(mxUINT64_CLASS, unsigned long long, "uint64", PyLong_FromUnsignedLongLong);
-			default:
-				mexErrMsgIdAndTxt("matpy:UnsupportedVariableType", "Unsupported variable type");
-			}
+		LayoutConversion conv(ary);
+		if (dstImag != NULL) {
+			if (elsize == 8) convertLayoutSplit<float>(conv, bytes, dst, dstImag);
+			else convertLayoutSplit<double>(conv, bytes, dst, dstImag);
 		} else {
-#undef CASE
-#define CASE(cls,c_type,d_type) case cls: for (int i = 0; i < nelem; i++) { \
-dtype = d_type; \
-PyObject *item = PyComplex_FromDoubles(*((c_type*) data), *((c_type*) imagData)); \
-data += sizeof(c_type); \
-imagData += sizeof(c_type); \
-PyList_SetItem(list, i, item); } \
-break
-			switch(cls) {
-			CASE(mxDOUBLE_CLASS, double, "complex128");
-			CASE(mxSINGLE_CLASS, float, "complex64");
-			CASE(mxINT8_CLASS, char, "complex64");
-			CASE(mxUINT8_CLASS, unsigned char, "complex64");
-			CASE(mxINT16_CLASS, short, "complex64");
-			CASE(mxUINT16_CLASS, unsigned short, "complex64");
-			CASE(mxINT32_CLASS, int, "complex128");
-			CASE(mxUINT32_CLASS, unsigned int, "complex128");
-			CASE(mxINT64_CLASS, long long, "complex128");
-			CASE(mxUINT64_CLASS, unsigned long long, "complex128");
-			default:
-				mexErrMsgIdAndTxt("matpy:UnsupportedVariableType", "Unsupported variable type");
-			}
-		}
-	}
-
-	PyObject *ret = NULL;
-	if(NULL != dtype)
-	{
-		PyObject *shape = PyList_New(ndims);
-		for (size_t i = 0; i < ndims; i++)
-		{
-			PyList_SetItem(shape, i, PyInt_FromLong(dims[i]));
-		}
-
-		PyObject *args = PyTuple_New(1);
-		PyTuple_SetItem(args, 0, list);
-		PyObject *kwargs = PyDict_New();
-		PyObject *dtypePyStr = PyString_FromString(dtype);
-		PyDict_SetItemString(kwargs, "dtype", dtypePyStr);
-		Py_DECREF(dtypePyStr);
-
-		if (debug) mexPrintf("list = 0x%08X dtype = %s\n", list, dtype);
-		PyObject *ndary = PyObject_Call(np_array_fun, args, kwargs);
-		Py_DECREF(kwargs);
-		Py_DECREF(args);
-		if (ndary == NULL) 
-		{
-			PyErr_Print();
-			mexErrMsgIdAndTxt("matpy:PythonError", "Error converting Python value");
-		}
-
-		if (debug) mexPrintf("ndary = 0x%08X\n", ndary);
-		PyObject *reshape_meth = PyObject_GetAttrString(ndary, "reshape");
-		args = PyTuple_New(1);
-		PyTuple_SetItem(args, 0, shape);
-		kwargs = PyDict_New();
-		PyDict_SetItemString(kwargs, "order", PyString_FromString("F"));
-	
-		ret = PyObject_Call(reshape_meth, args, kwargs);
-		Py_DECREF(args);
-		Py_DECREF(kwargs);
-		Py_DECREF(reshape_meth);
-		Py_DECREF(ndary);
+			switch (elsize) {
+			case 1: convertLayout<uint8_t>(conv, bytes, dst); break;
+			case 2: convertLayout<uint16_t>(conv, bytes, dst); break;
+			case 4: convertLayout<uint32_t>(conv, bytes, dst); break;
+			case 8: convertLayout<uint64_t>(conv, bytes, dst); break;
+			case 16: convertLayout<Complex128Bits>(conv, bytes, dst); break;
+			}
+		}
 	}
-	else 
-	{
-		mexErrMsgIdAndTxt("matpy:UnsupportedVariableType", "Unsupported variable type");
+	Py_END_ALLOW_THREADS
+}
+
+// How MATLAB classes and NumPy types convert into each other. Lookups in
+// either direction go through tables indexed by mxClassID and NumPy type
+// number, filled by initTypeConversions.
+struct TypeConversion
+{
+	int typenum;
+	mxClassID cls;
+	bool isComplex;
+	// Imported into a wider class, so the data has to be cast
+	bool widened;
+};
+
+static const TypeConversion typeConversions[] =
+{
+	{NPY_BOOL, mxLOGICAL_CLASS, false, false},
+	{NPY_FLOAT64, mxDOUBLE_CLASS, false, false},
+	{NPY_FLOAT32, mxSINGLE_CLASS, false, false},
+	{NPY_INT8, mxINT8_CLASS, false, false},
+	{NPY_UINT8, mxUINT8_CLASS, false, false},
+	{NPY_INT16, mxINT16_CLASS, false, false},
+	{NPY_UINT16, mxUINT16_CLASS, false, false},
+	{NPY_INT32, mxINT32_CLASS, false, false},
+	{NPY_UINT32, mxUINT32_CLASS, false, false},
+	{NPY_INT64, mxINT64_CLASS, false, false},
+	{NPY_UINT64, mxUINT64_CLASS, false, false},
+	{NPY_COMPLEX128, mxDOUBLE_CLASS, true, false},
+	{NPY_COMPLEX64, mxSINGLE_CLASS, true, false},
+	{NPY_HALF, mxSINGLE_CLASS, false, true},
+};
+
+static int npyTypeByClass[mxOBJECT_CLASS + 1];
+static const TypeConversion *conversionByNpyType[NPY_NTYPES];
+
+static void initTypeConversions()
+{
+	std::fill(npyTypeByClass, npyTypeByClass + mxOBJECT_CLASS + 1, -1);
+	for (size_t i = 0; i < sizeof(typeConversions) / sizeof(typeConversions[0]); i++) {
+		const TypeConversion &conversion = typeConversions[i];
+		if (!conversion.isComplex && !conversion.widened) {
+			npyTypeByClass[conversion.cls] = conversion.typenum;
+		}
+		// Covers the aliases of each type, such as NPY_LONG and NPY_LONGLONG
+		for (int typenum = 0; typenum < NPY_NTYPES; typenum++) {
+			if (conversionByNpyType[typenum] == NULL && PyArray_EquivTypenums(typenum, conversion.typenum)) {
+				conversionByNpyType[typenum] = &conversion;
+			}
+		}
 	}
+}
 
-	return ret;
+static int npyTypeFromClass(mxClassID cls)
+{
+	return cls >= 0 && cls <= mxOBJECT_CLASS ? npyTypeByClass[cls] : -1;
 }
 
-static mxArray* py2mat(PyObject *o) {
-#undef CASE
-#define CASE(check, c_type, cls, conv) \
-	if (check(o)) { \
-		if (debug) mexPrintf("%s\n", #c_type); \
-		mwSize dims[] = {1,1}; \
-		mxArray *a = mxCreateNumericArray(2, dims, cls, mxREAL); \
-		c_type *data = (c_type*) mxGetData(a); \
-		*data = (c_type) conv(o); \
-		Py_DECREF(o); \
-		return a; \
+// Returns the class an array of type descr is imported as, whatever its
+// byte order. Unless allowWidened is set, only types whose elements MATLAB
+// stores in the same bytes qualify.
+static bool classFromDescr(const PyArray_Descr *descr, mxClassID *cls, bool *isComplex, bool allowWidened = false)
+{
+	const TypeConversion *conversion = descr->type_num >= 0 && descr->type_num < NPY_NTYPES ? conversionByNpyType[descr->type_num] : NULL;
+	if (conversion == NULL || (conversion->widened && !allowWidened)) {
+		return false;
 	}
-	CASE(PyBool_Check, bool, mxLOGICAL_CLASS, PyInt_AsLong) else
-	CASE(PyInt_Check, int, mxINT32_CLASS, PyInt_AsLong) else
-	CASE(PyLong_Check, long long, mxINT64_CLASS, PyLong_AsLongLong) else
-	CASE(PyFloat_Check, double, mxDOUBLE_CLASS, PyFloat_AsDouble) else
-	if (PyComplex_Check(o)) {
-		mwSize dims[] = {1,1};
-		mxArray *a = mxCreateNumericArray(2, dims, mxDOUBLE_CLASS, mxCOMPLEX);
-		double *data = mxGetPr(a);
-		double *imagData = mxGetPi(a);
-		*data = PyComplex_RealAsDouble(o);
-		*imagData = PyComplex_ImagAsDouble(o);
+	*cls = conversion->cls;
+	*isComplex = conversion->isComplex;
+	return true;
+}
+
+static int getNpyDims(const mxArray *a, npy_intp *npyDims)
+{
+	size_t ndims = mxGetNumberOfDimensions(a);
+	const mwSize *dims = mxGetDimensions(a);
+
+	if (ndims > NPY_MAXDIMS) {
+		matpyError("matpy:TooManyDimensions", "Array has more dimensions than NumPy supports");
+	}
+	for (size_t i = 0; i < ndims; i++) {
+		npyDims[i] = (npy_intp) dims[i];
+	}
+	return (int) ndims;
+}
+
+static const char *MXARRAY_CAPSULE = "matpy.mxArray";
+
+static void destroyMxArrayCapsule(PyObject *capsule)
+{
+	mxArray *a = (mxArray*) PyCapsule_GetPointer(capsule, MXARRAY_CAPSULE);
+	if (std::this_thread::get_id() != matlabThread) {
+		// Freed by the MATLAB thread at the start of the next command
+		pendingDestroy.push_back(a);
+	} else {
+		mxDestroyArray(a);
+	}
+}
+
+// Wraps the data of a numeric mxArray as a Fortran ordered ndarray without
+// copying it. a must be persistent; the ndarray takes ownership of it and it
+// is destroyed once Python no longer references the data.
+static PyObject *wrapMxArray(mxArray *a, int typenum)
+{
+	npy_intp npyDims[NPY_MAXDIMS];
+	int nd = getNpyDims(a, npyDims);
+
+	PyObject *capsule = PyCapsule_New(a, MXARRAY_CAPSULE, destroyMxArrayCapsule);
+	if (capsule == NULL) {
+		mxDestroyArray(a);
+		return NULL;
+	}
+
+	PyObject *ndary = PyArray_New(&PyArray_Type, nd, npyDims, typenum, NULL, mxGetData(a), 0, NPY_ARRAY_FARRAY, NULL);
+	if (ndary == NULL) {
+		Py_DECREF(capsule);
+		return NULL;
+	}
+
+	// Steals the capsule, even on failure
+	if (PyArray_SetBaseObject((PyArrayObject*) ndary, capsule) < 0) {
+		Py_DECREF(ndary);
+		return NULL;
+	}
+	return ndary;
+}
+
+// Copies the data of a numeric mxArray into a new NumPy-owned Fortran ordered
+// ndarray.
+static PyObject *copyMxArray(const mxArray *a, int typenum)
+{
+	npy_intp npyDims[NPY_MAXDIMS];
+	int nd = getNpyDims(a, npyDims);
+
+	PyObject *ndary = PyArray_New(&PyArray_Type, nd, npyDims, typenum, NULL, NULL, 0, NPY_ARRAY_F_CONTIGUOUS, NULL);
+	if (ndary == NULL) {
+		return NULL;
+	}
+	memcpy(PyArray_DATA((PyArrayObject*) ndary), mxGetData(a), PyArray_NBYTES((PyArrayObject*) ndary));
+	return ndary;
+}
+
+// Arrays up to this size are copied straight into NumPy-owned memory, which
+// is cheaper than duplicating the mxArray and wrapping it.
+static const size_t SMALL_ARRAY_BYTES = 4096;
+
+// Exports a real numeric or logical array without creating a Python object
+// per element. Arguments passed into the MEX function belong to MATLAB and
+// can be freed or modified once we return, so unless a copy was requested we
+// duplicate them once and hand the duplicate over to NumPy.
+static PyObject *numericToPy(const mxArray *a, int typenum)
+{
+	size_t bytes = mxGetNumberOfElements(a) * mxGetElementSize(a);
+	if (exportOptions.copy || bytes == 0 || bytes <= SMALL_ARRAY_BYTES) {
+		return copyMxArray(a, typenum);
+	}
+
+	mxArray *dup = mxDuplicateArray(a);
+	mexMakeArrayPersistent(dup);
+	return wrapMxArray(dup, typenum);
+}
+
+// Number of complex elements interleaved per unit of work in complexToPy.
+static const npy_intp INTERLEAVE_CHUNK = 1 << 18;
+
+// Copies the elements [first, last) of complex data into an interleaved
+// buffer of type D, widening them from S if needed. re holds the interleaved
+// pairs with MATLAB's interleaved complex API, otherwise the real plane with
+// the imaginary one in im.
+template <typename S, typename D>
+static void interleaveComplex(const S *re, const S *im, size_t first, size_t last, D *dst)
+{
+#if MX_HAS_INTERLEAVED_COMPLEX
+	for (size_t i = 2 * first; i < 2 * last; i++) {
+		dst[i] = (D) re[i];
+	}
+#else
+	for (size_t i = first; i < last; i++) {
+		dst[2 * i] = (D) re[i];
+		dst[2 * i + 1] = (D) im[i];
+	}
+#endif
+}
+
+template <typename S, typename D>
+static void interleaveComplex(const mxArray *a, void *dst)
+{
+	size_t nelem = mxGetNumberOfElements(a);
+	npy_intp chunks = (nelem + INTERLEAVE_CHUNK - 1) / INTERLEAVE_CHUNK;
+	// The mx API is not thread-safe, so the workers only get raw pointers
+	const S *re = (const S*) mxGetData(a);
+#if MX_HAS_INTERLEAVED_COMPLEX
+	const S *im = NULL;
+#else
+	const S *im = (const S*) mxGetImagData(a);
+#endif
+
+	Py_BEGIN_ALLOW_THREADS
+	parallelFor(chunks, 2 * nelem * sizeof(D), [&](npy_intp first, npy_intp last) {
+		interleaveComplex<S, D>(re, im, first * INTERLEAVE_CHUNK, std::min(last * INTERLEAVE_CHUNK, (npy_intp) nelem), (D*) dst);
+	});
+	Py_END_ALLOW_THREADS
+}
+
+// Exports a complex array as complex64 or complex128. With MATLAB's
+// interleaved complex API single and double data already has NumPy's layout
+// and is wrapped like real data; otherwise the real and imaginary planes are
+// interleaved in one pass. NumPy has no complex integer types, so integer
+// classes are widened to the smallest complex type holding them exactly.
+// 64-bit integers do not fit into complex128 exactly and are refused unless
+// the 'lossy' option is set.
+static PyObject *complexToPy(const mxArray *a)
+{
+	mxClassID cls = mxGetClassID(a);
+	int typenum;
+	switch (cls) {
+	case mxSINGLE_CLASS:
+	case mxINT8_CLASS:
+	case mxUINT8_CLASS:
+	case mxINT16_CLASS:
+	case mxUINT16_CLASS:
+		typenum = NPY_COMPLEX64;
+		break;
+	case mxINT64_CLASS:
+	case mxUINT64_CLASS:
+		if (!exportOptions.lossy) {
+			matpyError("matpy:LossyConversion", "Complex 64-bit integers cannot be represented exactly as complex128, use 'lossy', true to convert anyway");
+		}
+		// fall through
+	case mxDOUBLE_CLASS:
+	case mxINT32_CLASS:
+	case mxUINT32_CLASS:
+		typenum = NPY_COMPLEX128;
+		break;
+	default:
+		matpyError("matpy:UnsupportedVariableType", "Unsupported variable type");
+		return NULL;
+	}
+
+#if MX_HAS_INTERLEAVED_COMPLEX
+	if (cls == mxSINGLE_CLASS || cls == mxDOUBLE_CLASS) {
+		return numericToPy(a, typenum);
+	}
+#endif
+
+	npy_intp npyDims[NPY_MAXDIMS];
+	int nd = getNpyDims(a, npyDims);
+	PyObject *ndary = PyArray_New(&PyArray_Type, nd, npyDims, typenum, NULL, NULL, 0, NPY_ARRAY_F_CONTIGUOUS, NULL);
+	if (ndary == NULL) {
+		return NULL;
+	}
+
+	void *dst = PyArray_DATA((PyArrayObject*) ndary);
+	switch (cls) {
+	case mxSINGLE_CLASS: interleaveComplex<float, float>(a, dst); break;
+	case mxDOUBLE_CLASS: interleaveComplex<double, double>(a, dst); break;
+	case mxINT8_CLASS: interleaveComplex<signed char, float>(a, dst); break;
+	case mxUINT8_CLASS: interleaveComplex<unsigned char, float>(a, dst); break;
+	case mxINT16_CLASS: interleaveComplex<short, float>(a, dst); break;
+	case mxUINT16_CLASS: interleaveComplex<unsigned short, float>(a, dst); break;
+	case mxINT32_CLASS: interleaveComplex<int, double>(a, dst); break;
+	case mxUINT32_CLASS: interleaveComplex<unsigned int, double>(a, dst); break;
+	case mxINT64_CLASS: interleaveComplex<long long, double>(a, dst); break;
+	case mxUINT64_CLASS: interleaveComplex<unsigned long long, double>(a, dst); break;
+	default: break;
+	}
+	return ndary;
+}
+
+// Returns the id of a PyRef handle or of a uint64 scalar holding one.
+static uint64_t getHandleId(const mxArray *a)
+{
+	if (mxIsClass(a, "PyRef") && mxGetNumberOfElements(a) == 1) {
+		mxArray *id = mxGetProperty(a, 0, "Id");
+		uint64_t result = (id != NULL && mxIsUint64(id) && mxGetNumberOfElements(id) == 1) ? *(uint64_t*) mxGetData(id) : 0;
+		if (id != NULL) mxDestroyArray(id);
+		return result;
+	}
+	if (mxIsUint64(a) && mxGetNumberOfElements(a) == 1) {
+		return *(uint64_t*) mxGetData(a);
+	}
+	matpyError("matpy:InvalidHandle", "Expected a PyRef handle");
+	return 0;
+}
+
+// Returns a new reference to the object pinned by a handle.
+static PyObject *derefHandle(const mxArray *a)
+{
+	std::map<uint64_t, PyObject*>::iterator found = handles.find(getHandleId(a));
+	if (found == handles.end()) {
+		matpyError("matpy:InvalidHandle", "The Python object of this PyRef has been released");
+	}
+	Py_INCREF(found->second);
+	return found->second;
+}
+
+// Returns the class shared by a field of every element of a struct array when
+// they are all real numeric or logical scalars, mxUNKNOWN_CLASS otherwise.
+static mxClassID scalarFieldClass(const mxArray *a, int field)
+{
+	size_t nelem = mxGetNumberOfElements(a);
+	mxClassID cls = mxUNKNOWN_CLASS;
+	for (size_t i = 0; i < nelem; i++) {
+		const mxArray *item = mxGetFieldByNumber(a, i, field);
+		if (item == NULL || mxGetNumberOfElements(item) != 1 || mxIsComplex(item) || mxIsSparse(item) || npyTypeFromClass(mxGetClassID(item)) < 0) {
+			return mxUNKNOWN_CLASS;
+		}
+		if (i > 0 && mxGetClassID(item) != cls) {
+			return mxUNKNOWN_CLASS;
+		}
+		cls = mxGetClassID(item);
+	}
+	return cls;
+}
+
+// Exports a struct array column by column, keeping its dimensions. A field
+// holding scalars of one numeric class in every element becomes a single
+// ndarray of that class; any other field becomes an object ndarray. The
+// columns are returned in a dict, or as a NumPy record array for the
+// 'records' struct mode.
+static PyObject *structToColumns(const mxArray *a)
+{
+	npy_intp npyDims[NPY_MAXDIMS];
+	int nd = getNpyDims(a, npyDims);
+	size_t nelem = mxGetNumberOfElements(a);
+	int nfields = mxGetNumberOfFields(a);
+
+	PyOwned o(PyDict_New());
+	PyOwned names(PyList_New(nfields));
+	PyOwned columns(PyList_New(nfields));
+	for (int i = 0; i < nfields; i++) {
+		const char *fieldName = mxGetFieldNameByNumber(a, i);
+		mxClassID cls = scalarFieldClass(a, i);
+
+		PyOwned column(PyArray_New(&PyArray_Type, nd, npyDims, cls != mxUNKNOWN_CLASS ? npyTypeFromClass(cls) : NPY_OBJECT,
+			NULL, NULL, 0, NPY_ARRAY_F_CONTIGUOUS, NULL));
+		if (column == NULL) {
+			PyErr_Print();
+			matpyError("matpy:PythonError", "Error converting MATLAB value");
+		}
+
+		if (cls != mxUNKNOWN_CLASS) {
+			char *dst = PyArray_BYTES((PyArrayObject*) column.get());
+			size_t elsize = PyArray_ITEMSIZE((PyArrayObject*) column.get());
+			for (size_t j = 0; j < nelem; j++) {
+				memcpy(dst + j * elsize, mxGetData(mxGetFieldByNumber(a, j, i)), elsize);
+			}
+		} else {
+			PyObject **items = (PyObject**) PyArray_DATA((PyArrayObject*) column.get());
+			for (size_t j = 0; j < nelem; j++) {
+				const mxArray *item = mxGetFieldByNumber(a, j, i);
+				if (item == NULL) {
+					matpyError("matpy:NullFieldValue", "Null field in struct");
+				}
+				PyObject *value = mat2py(item);
+				Py_XDECREF(items[j]);
+				items[j] = value;
+			}
+		}
+
+		PyList_SET_ITEM(names.get(), i, PyString_FromString(fieldName));
+		PyDict_SetItemString(o, fieldName, column);
+		PyList_SET_ITEM(columns.get(), i, column.release());
+	}
+
+	if (exportOptions.structMode == ExportOptions::STRUCT_RECORDS) {
+		PyOwned numpy(PyImport_ImportModule("numpy"));
+		PyOwned rec(numpy == NULL ? NULL : PyObject_GetAttrString(numpy, "rec"));
+		o.reset(rec == NULL ? NULL : PyObject_CallMethod(rec, (char*) "fromarrays", (char*) "OOO", columns.get(), Py_None, names.get()));
+		if (o == NULL) {
+			PyErr_Print();
+			matpyError("matpy:PythonError", "Error creating record array");
+		}
+	}
+	return o.release();
+}
+
+// Returns true if a is a char row vector, or empty char array.
+static bool isCharRow(const mxArray *a)
+{
+	return a != NULL && mxIsChar(a) && mxGetNumberOfDimensions(a) == 2 && (mxGetM(a) == 1 || mxGetNumberOfElements(a) == 0);
+}
+
+// Decodes UTF-16 into UCS4 and returns the number of code points written.
+static size_t utf16ToUcs4(const mxChar *src, size_t n, uint32_t *dst)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		uint32_t c = src[i];
+		if (c >= 0xD800 && c < 0xDC00 && i + 1 < n && src[i + 1] >= 0xDC00 && src[i + 1] < 0xE000) {
+			c = 0x10000 + ((c - 0xD800) << 10) + (src[++i] - 0xDC00);
+		}
+		dst[count++] = c;
+	}
+	return count;
+}
+
+// Returns the number of UTF-16 units needed for n code points.
+static size_t utf16Length(const uint32_t *src, size_t n)
+{
+	size_t count = n;
+	for (size_t i = 0; i < n; i++) {
+		count += src[i] >= 0x10000;
+	}
+	return count;
+}
+
+// Encodes n code points as UTF-16 and returns the number of units written.
+static size_t ucs4ToUtf16(const uint32_t *src, size_t n, mxChar *dst)
+{
+	size_t count = 0;
+	for (size_t i = 0; i < n; i++) {
+		if (src[i] >= 0x10000) {
+			dst[count++] = (mxChar) (0xD800 + ((src[i] - 0x10000) >> 10));
+			dst[count++] = (mxChar) (0xDC00 + ((src[i] - 0x10000) & 0x3FF));
+		} else {
+			dst[count++] = (mxChar) src[i];
+		}
+	}
+	return count;
+}
+
+// Converts a char row vector into a unicode object, whatever its content,
+// writing the characters straight into the new object.
+static PyObject *charRowToPy(const mxChar *chars, size_t n)
+{
+	PyObject *o = PyUnicode_FromUnicode(NULL, n);
+	if (o == NULL) {
+		PyErr_Print();
+		matpyError("matpy:PythonError", "Error converting MATLAB value");
+	}
+#if Py_UNICODE_SIZE == 2
+	memcpy(PyUnicode_AS_UNICODE(o), chars, n * sizeof(mxChar));
+#else
+	// Surrogate pairs become one code point, so the object may shrink
+	size_t count = utf16ToUcs4(chars, n, (uint32_t*) PyUnicode_AS_UNICODE(o));
+	if (count < n && PyUnicode_Resize(&o, count) < 0) {
+		PyErr_Print();
+		matpyError("matpy:PythonError", "Error converting MATLAB value");
+	}
+#endif
+	return o;
+}
+
+// Converts a char array into a unicode object when it is a row vector, and
+// otherwise into a unicode ('U') ndarray of its rows: a char matrix with m
+// rows gives m strings, and an m x n x p array an m x p array of them.
+static PyObject *charToPy(const mxArray *a)
+{
+	const mxChar *chars = mxGetChars(a);
+	size_t nelem = mxGetNumberOfElements(a);
+	if (isCharRow(a)) {
+		return charRowToPy(chars, nelem);
+	}
+
+	size_t ndims = mxGetNumberOfDimensions(a);
+	const mwSize *dims = mxGetDimensions(a);
+	size_t rows = dims[0], width = dims[1];
+	npy_intp npyDims[NPY_MAXDIMS];
+	npyDims[0] = (npy_intp) rows;
+	for (size_t d = 2; d < ndims; d++) {
+		npyDims[d - 1] = (npy_intp) dims[d];
+	}
+	int nd = ndims > 2 ? (int) ndims - 1 : 1;
+
+	PyArray_Descr *descr = PyArray_DescrNewFromType(NPY_UNICODE);
+	descr->elsize = (int) (std::max(width, (size_t) 1) * sizeof(uint32_t));
+	PyObject *ndary = PyArray_NewFromDescr(&PyArray_Type, descr, nd, npyDims, NULL, NULL, NPY_ARRAY_F_CONTIGUOUS, NULL);
+	if (ndary == NULL) {
+		PyErr_Print();
+		matpyError("matpy:PythonError", "Error converting MATLAB value");
+	}
+
+	// Row i of page p holds chars[i + rows * (j + width * p)] for column j
+	char *dst = PyArray_BYTES((PyArrayObject*) ndary);
+	size_t elsize = PyArray_ITEMSIZE((PyArrayObject*) ndary);
+	size_t nstrings = PyArray_SIZE((PyArrayObject*) ndary);
+	memset(dst, 0, nstrings * elsize);
+	std::vector<mxChar> row(width);
+	for (size_t k = 0; k < nstrings && width > 0; k++) {
+		size_t i = k % rows, p = k / rows;
+		const mxChar *src = chars + i + rows * width * p;
+		for (size_t j = 0; j < width; j++) {
+			row[j] = src[rows * j];
+		}
+		utf16ToUcs4(&row[0], width, (uint32_t*) (dst + k * elsize));
+	}
+	return ndary;
+}
+
+// Converts a unicode object into a char row vector, writing its UTF-16
+// straight into the new array.
+static mxArray *unicodeToChar(PyObject *o)
+{
+	size_t n = PyUnicode_GET_SIZE(o);
+	const Py_UNICODE *src = PyUnicode_AS_UNICODE(o);
+#if Py_UNICODE_SIZE == 2
+	mwSize dims[] = {1, n};
+	mxArray *a = mxCreateCharArray(2, dims);
+	memcpy(mxGetChars(a), src, n * sizeof(mxChar));
+#else
+	mwSize dims[] = {1, utf16Length((const uint32_t*) src, n)};
+	mxArray *a = mxCreateCharArray(2, dims);
+	ucs4ToUtf16((const uint32_t*) src, n, mxGetChars(a));
+#endif
+	return a;
+}
+
+// Converts a str into a char row vector. A str that is not ASCII is decoded
+// as UTF-8, and as Latin-1, one char per byte, when it is not valid UTF-8.
+static mxArray *stringToChar(PyObject *o)
+{
+	size_t n = PyString_GET_SIZE(o);
+	const unsigned char *src = (const unsigned char*) PyString_AS_STRING(o);
+	bool ascii = true;
+	for (size_t i = 0; i < n && ascii; i++) {
+		ascii = src[i] < 0x80;
+	}
+	if (!ascii) {
+		PyOwned text(PyUnicode_DecodeUTF8((const char*) src, n, "strict"));
+		if (text != NULL) {
+			return unicodeToChar(text);
+		}
+		PyErr_Clear();
+	}
+	mwSize dims[] = {1, n};
+	mxArray *a = mxCreateCharArray(2, dims);
+	mxChar *dst = mxGetChars(a);
+	for (size_t i = 0; i < n; i++) {
+		dst[i] = src[i];
+	}
+	return a;
+}
+
+// Decodes UTF-8 into a char row vector. Invalid bytes become U+FFFD.
+static mxArray *utf8ToCharRow(const std::string &text)
+{
+	std::vector<mxChar> chars;
+	chars.reserve(text.size());
+	for (size_t i = 0; i < text.size(); ) {
+		unsigned char b = text[i];
+		int extra = b < 0x80 ? 0 : (b & 0xE0) == 0xC0 ? 1 : (b & 0xF0) == 0xE0 ? 2 : (b & 0xF8) == 0xF0 ? 3 : -1;
+		uint32_t c = extra == 0 ? b : extra == 1 ? b & 0x1F : extra == 2 ? b & 0x0F : b & 0x07;
+		bool valid = extra >= 0 && i + extra < text.size();
+		for (int k = 1; valid && k <= extra; k++) {
+			unsigned char next = text[i + k];
+			valid = (next & 0xC0) == 0x80;
+			c = (c << 6) | (next & 0x3F);
+		}
+		if (!valid) {
+			chars.push_back(0xFFFD);
+			i++;
+		} else if (c >= 0x10000) {
+			chars.push_back((mxChar) (0xD800 + ((c - 0x10000) >> 10)));
+			chars.push_back((mxChar) (0xDC00 + ((c - 0x10000) & 0x3FF)));
+			i += extra + 1;
+		} else {
+			chars.push_back((mxChar) c);
+			i += extra + 1;
+		}
+	}
+	mwSize dims[] = {1, chars.size()};
+	mxArray *a = mxCreateCharArray(2, dims);
+	if (!chars.empty()) {
+		memcpy(mxGetChars(a), &chars[0], chars.size() * sizeof(mxChar));
+	}
+	return a;
+}
+
+// Packs a cell array whose cells all hold real scalars of one numeric class
+// into an ndarray of that class, and a cellstr into a fixed width unicode
+// ndarray, both with the cell array's dimensions. Returns NULL, without an
+// error, for any other cell array.
+static PyObject *packCell(const mxArray *a)
+{
+	size_t nelem = mxGetNumberOfElements(a);
+	if (nelem == 0) {
+		return NULL;
+	}
+
+	const mxArray *first = mxGetCell(a, 0);
+	bool strings = isCharRow(first);
+	mxClassID cls = first == NULL ? mxUNKNOWN_CLASS : mxGetClassID(first);
+	size_t width = 1;
+	for (size_t i = 0; i < nelem; i++) {
+		const mxArray *item = mxGetCell(a, i);
+		if (strings) {
+			if (!isCharRow(item)) return NULL;
+			width = std::max(width, mxGetNumberOfElements(item));
+		} else if (item == NULL || mxGetClassID(item) != cls || mxGetNumberOfElements(item) != 1
+			|| mxIsComplex(item) || mxIsSparse(item) || npyTypeFromClass(cls) < 0) {
+			return NULL;
+		}
+	}
+
+	npy_intp npyDims[NPY_MAXDIMS];
+	int nd = getNpyDims(a, npyDims);
+	PyObject *ndary;
+	if (strings) {
+		// Every UTF-16 unit yields at most one code point, so the longest
+		// string in units is wide enough
+		PyArray_Descr *descr = PyArray_DescrNewFromType(NPY_UNICODE);
+		descr->elsize = (int) (width * sizeof(uint32_t));
+		ndary = PyArray_NewFromDescr(&PyArray_Type, descr, nd, npyDims, NULL, NULL, NPY_ARRAY_F_CONTIGUOUS, NULL);
+	} else {
+		ndary = PyArray_New(&PyArray_Type, nd, npyDims, npyTypeFromClass(cls), NULL, NULL, 0, NPY_ARRAY_F_CONTIGUOUS, NULL);
+	}
+	if (ndary == NULL) {
+		PyErr_Print();
+		matpyError("matpy:PythonError", "Error converting MATLAB value");
+	}
+
+	char *dst = PyArray_BYTES((PyArrayObject*) ndary);
+	size_t elsize = PyArray_ITEMSIZE((PyArrayObject*) ndary);
+	if (strings) {
+		memset(dst, 0, nelem * elsize);
+	}
+	for (size_t i = 0; i < nelem; i++) {
+		const mxArray *item = mxGetCell(a, i);
+		if (strings) {
+			utf16ToUcs4(mxGetChars(item), mxGetNumberOfElements(item), (uint32_t*) (dst + i * elsize));
+		} else {
+			memcpy(dst + i * elsize, mxGetData(item), elsize);
+		}
+	}
+	return ndary;
+}
+
+// Returns a 1-D ndarray of n elements of typenum at data. With an owner the
+// array shares the data and keeps the owner alive, otherwise it gets a copy.
+static PyObject *sparseVector(void *data, npy_intp n, int typenum, PyObject *owner)
+{
+	PyObject *ndary = PyArray_New(&PyArray_Type, 1, &n, typenum, NULL, owner == NULL ? NULL : data, 0, NPY_ARRAY_CARRAY, NULL);
+	if (ndary == NULL || owner == NULL) {
+		if (ndary != NULL) {
+			memcpy(PyArray_DATA((PyArrayObject*) ndary), data, PyArray_NBYTES((PyArrayObject*) ndary));
+		}
+		return ndary;
+	}
+
+	Py_INCREF(owner);
+	if (PyArray_SetBaseObject((PyArrayObject*) ndary, owner) < 0) {
+		Py_DECREF(ndary);
+		return NULL;
+	}
+	return ndary;
+}
+
+// Exports a sparse double or logical matrix as a scipy.sparse.csc_matrix,
+// which stores the same compressed columns as MATLAB. NumPy index types as
+// wide as mwIndex exist, so unless a copy was requested the data, row
+// indices and column pointers of a private duplicate are shared with the
+// matrix. Complex data without the interleaved API is interleaved in one
+// copy. The arrays are assigned to an empty matrix, whose dtype follows its
+// data, as the csc_matrix constructor would copy indices that fit into int32.
+static PyObject *sparseToPy(const mxArray *a)
+{
+	PyObject *sparse = PyImport_ImportModule("scipy.sparse");
+	if (sparse == NULL) {
+		PyErr_Clear();
+		matpyError("matpy:MissingModule", "Exporting sparse matrices requires scipy");
+	}
+
+	size_t m = mxGetM(a);
+	size_t n = mxGetN(a);
+	npy_intp nnz = mxGetJc(a)[n];
+	int indexType = sizeof(mwIndex) == sizeof(npy_int64) ? NPY_INT64 : NPY_INT32;
+	int dataType = mxIsLogical(a) ? NPY_BOOL : mxIsComplex(a) ? NPY_COMPLEX128 : NPY_DOUBLE;
+
+	PyObject *owner = NULL;
+	if (!exportOptions.copy) {
+		mxArray *dup = mxDuplicateArray(a);
+		mexMakeArrayPersistent(dup);
+		owner = PyCapsule_New(dup, MXARRAY_CAPSULE, destroyMxArrayCapsule);
+		if (owner == NULL) {
+			mxDestroyArray(dup);
+			PyErr_Clear();
+		} else {
+			a = dup;
+		}
+	}
+
+	PyObject *indices = sparseVector(mxGetIr(a), nnz, indexType, owner);
+	PyObject *indptr = sparseVector(mxGetJc(a), n + 1, indexType, owner);
+	PyObject *data;
+#if !MX_HAS_INTERLEAVED_COMPLEX
+	if (mxIsComplex(a)) {
+		data = PyArray_New(&PyArray_Type, 1, &nnz, NPY_COMPLEX128, NULL, NULL, 0, NPY_ARRAY_CARRAY, NULL);
+		if (data != NULL) {
+			double *dst = (double*) PyArray_DATA((PyArrayObject*) data);
+			const double *re = mxGetPr(a);
+			const double *im = mxGetPi(a);
+			for (npy_intp i = 0; i < nnz; i++) {
+				dst[2 * i] = re[i];
+				dst[2 * i + 1] = im[i];
+			}
+		}
+	} else
+#endif
+	data = sparseVector(mxGetData(a), nnz, dataType, owner);
+	Py_XDECREF(owner);
+
+	PyObject *matrix = NULL;
+	if (indices != NULL && indptr != NULL && data != NULL) {
+		matrix = PyObject_CallMethod(sparse, (char*) "csc_matrix", (char*) "((nn))", (Py_ssize_t) m, (Py_ssize_t) n);
+	}
+	if (matrix != NULL && (PyObject_SetAttrString(matrix, "data", data) < 0
+		|| PyObject_SetAttrString(matrix, "indices", indices) < 0
+		|| PyObject_SetAttrString(matrix, "indptr", indptr) < 0)) {
+		Py_CLEAR(matrix);
+	}
+	Py_XDECREF(indices);
+	Py_XDECREF(indptr);
+	Py_XDECREF(data);
+	Py_DECREF(sparse);
+	return matrix;
+}
+
+// Returns a property, such as the message, of a trapped MATLAB exception.
+static std::string exceptionText(const mxArray *exception, const char *property)
+{
+	mxArray *value = mxIsStruct(exception) ? mxGetField(exception, 0, property) : mxGetProperty(exception, 0, property);
+	char *text = value == NULL ? NULL : mxArrayToString(value);
+	std::string result = text == NULL ? "" : text;
+	mxFree(text);
+	if (value != NULL && !mxIsStruct(exception)) {
+		mxDestroyArray(value);
+	}
+	return result;
+}
+
+// Calls the MATLAB function name, turning a MATLAB error into a matpy error
+// rather than leaving the MEX file with the GIL held.
+static void callMatlab(int nout, mxArray **out, int nin, mxArray **in, const char *name)
+{
+	mxArray *exception;
+	{
+		// A PyRef MATLAB destroys meanwhile is released through the queue
+		// rather than by re-entering the running command
+		CallbackScope scope;
+		exception = mexCallMATLABWithTrap(nout, out, nin, in, name);
+	}
+	if (callbackDepth == 0) {
+		releasePendingHandles();
+	}
+	if (exception != NULL) {
+		std::string message = exceptionText(exception, "message");
+		mxDestroyArray(exception);
+		matpyError("matpy:MatlabError", "Error calling %s: %s", name, message.c_str());
+	}
+}
+
+// Turns an m x 1 ndarray into a 1-d view of it, as a DataFrame column.
+static PyObject *tableColumn(PyObject *o, const char *name)
+{
+	if (o == NULL || !PyArray_Check(o) || PyArray_NDIM((PyArrayObject*) o) != 2) {
+		return o;
+	}
+	if (PyArray_DIMS((PyArrayObject*) o)[1] != 1) {
 		Py_DECREF(o);
-		return a;
-	} else if (PyUnicode_Check(o)) {
-		PyObject *tmpASCII = PyUnicode_AsASCIIString(o);
-		PyObject *tmpObject = PyObject_Str(tmpASCII);
-		Py_DECREF(tmpASCII);
-		char* tmpString = PyString_AsString(tmpObject);
-		Py_DECREF(tmpObject);
-		mxArray *a = mxCreateString(tmpString);
+		matpyError("matpy:UnsupportedVariableType", "Table variable '%s' has more than one column", name);
+	}
+	PyObject *column = PyArray_Ravel((PyArrayObject*) o, NPY_FORTRANORDER);
+	Py_DECREF(o);
+	return column;
+}
+
+// Converts a categorical column into a pandas Categorical from its codes and
+// categories.
+static PyObject *categoricalToPy(PyObject *pandas, mxArray *column)
+{
+	mxArray *values, *categories, *ordinal;
+	callMatlab(1, &values, 1, &column, "double");
+	callMatlab(1, &categories, 1, &column, "categories");
+	callMatlab(1, &ordinal, 1, &column, "isordinal");
+
+	// Codes are 1-based with NaN for <undefined>, pandas' 0-based with -1
+	npy_intp n = mxGetNumberOfElements(values);
+	PyOwned codes(PyArray_SimpleNew(1, &n, NPY_INT32));
+	const double *src = (const double*) mxGetData(values);
+	int32_t *dst = (int32_t*) PyArray_DATA((PyArrayObject*) codes.get());
+	for (npy_intp i = 0; i < n; i++) {
+		dst[i] = mxIsNaN(src[i]) ? -1 : (int32_t) src[i] - 1;
+	}
+	PyOwned names(mat2py(categories));
+	PyOwned categorical(PyObject_GetAttrString(pandas, "Categorical"));
+	PyObject *o = categorical == NULL ? NULL : PyObject_CallMethod(categorical, (char*) "from_codes", (char*) "OOO",
+		codes.get(), names.get(), mxIsLogicalScalarTrue(ordinal) ? Py_True : Py_False);
+	mxDestroyArray(values);
+	mxDestroyArray(categories);
+	mxDestroyArray(ordinal);
+	return o;
+}
+
+// Converts a table into a pandas DataFrame one variable at a time. Numeric
+// and logical variables take the usual array export, so they share the
+// MATLAB data unless 'copy' is set, cellstr and string variables become
+// unicode arrays and categorical ones pandas Categoricals. Row names become
+// the index.
+static PyObject *tableToPy(const mxArray *a)
+{
+	PyOwned pandas(PyImport_ImportModule("pandas"));
+	if (pandas == NULL) {
+		PyErr_Clear();
+		matpyError("matpy:MissingModule", "Exporting tables requires pandas");
+	}
+
+	mxArray *columns, *rowNames;
+	mxArray *toStruct[] = {(mxArray*) a, mxCreateString("ToScalar"), mxCreateLogicalScalar(true)};
+	callMatlab(1, &columns, 3, toStruct, "table2struct");
+	mxDestroyArray(toStruct[1]);
+	mxDestroyArray(toStruct[2]);
+	const char *subsFields[] = {"type", "subs"};
+	mxArray *subs = mxCreateStructMatrix(1, 2, 2, subsFields);
+	mxSetField(subs, 0, "type", mxCreateString("."));
+	mxSetField(subs, 0, "subs", mxCreateString("Properties"));
+	mxSetField(subs, 1, "type", mxCreateString("."));
+	mxSetField(subs, 1, "subs", mxCreateString("RowNames"));
+	mxArray *getRowNames[] = {(mxArray*) a, subs};
+	callMatlab(1, &rowNames, 2, getRowNames, "subsref");
+	mxDestroyArray(subs);
+
+	int ncols = mxGetNumberOfFields(columns);
+	// The columns converted so far are released if a later one throws
+	PyOwned data(PyDict_New());
+	PyOwned names(PyList_New(ncols));
+	for (int i = 0; i < ncols; i++) {
+		const char *name = mxGetFieldNameByNumber(columns, i);
+		mxArray *column = mxGetFieldByNumber(columns, 0, i);
+		PyObject *o;
+		if (mxIsClass(column, "categorical")) {
+			o = categoricalToPy(pandas, column);
+		} else {
+			mxArray *strings = NULL;
+			if (mxIsClass(column, "string")) {
+				callMatlab(1, &strings, 1, &column, "cellstr");
+				column = strings;
+			}
+			o = mxIsCell(column) ? packCell(column) : NULL;
+			o = tableColumn(o != NULL ? o : mat2py(column), name);
+			if (strings != NULL) {
+				mxDestroyArray(strings);
+			}
+		}
+		if (o == NULL) {
+			break;
+		}
+		PyDict_SetItemString(data, name, o);
+		Py_DECREF(o);
+		PyList_SET_ITEM(names.get(), i, PyString_FromString(name));
+	}
+	mxDestroyArray(columns);
+
+	PyObject *df = NULL;
+	if (!PyErr_Occurred()) {
+		PyOwned kwargs(Py_BuildValue("{s:O}", "columns", names.get()));
+		if (!mxIsEmpty(rowNames)) {
+			PyOwned index(mat2py(rowNames));
+			PyDict_SetItemString(kwargs, "index", index);
+		}
+		PyOwned args(Py_BuildValue("(O)", data.get()));
+		PyOwned frame(PyObject_GetAttrString(pandas, "DataFrame"));
+		df = frame == NULL ? NULL : PyObject_Call(frame, args, kwargs);
+	}
+	mxDestroyArray(rowNames);
+	if (df == NULL) {
+		PyErr_Print();
+		matpyError("matpy:PythonError", "Error converting a table to a DataFrame");
+	}
+	return df;
+}
+
+// Returns the number of bytes of data held by a and, for cells and structs,
+// by its elements.
+static double mxTreeBytes(const mxArray *a)
+{
+	if (a == NULL) {
+		return 0;
+	}
+	size_t nelem = mxGetNumberOfElements(a);
+	double bytes = 0;
+	if (mxIsCell(a)) {
+		for (size_t i = 0; i < nelem; i++) {
+			bytes += mxTreeBytes(mxGetCell(a, i));
+		}
+	} else if (mxIsStruct(a)) {
+		int nfields = mxGetNumberOfFields(a);
+		for (size_t i = 0; i < nelem; i++) {
+			for (int f = 0; f < nfields; f++) {
+				bytes += mxTreeBytes(mxGetFieldByNumber(a, i, f));
+			}
+		}
+	} else {
+#if MX_HAS_INTERLEAVED_COMPLEX
+		double elsize = (double) mxGetElementSize(a);
+#else
+		double elsize = (double) mxGetElementSize(a) * (mxIsComplex(a) ? 2 : 1);
+#endif
+		if (mxIsSparse(a)) {
+			size_t nnz = mxGetJc(a)[mxGetN(a)];
+			bytes = nnz * (elsize + sizeof(mwIndex)) + (mxGetN(a) + 1) * sizeof(mwIndex);
+		} else {
+			bytes = nelem * elsize;
+		}
+	}
+	return bytes;
+}
+
+// Exports a real numeric or logical 1x1 value as a Python bool, int, long or
+// float, and a vector as a 1-d ndarray, for the native export option.
+// Returns NULL, without an error, for other values.
+static PyObject *nativeToPy(const mxArray *a)
+{
+	size_t nelem = mxGetNumberOfElements(a);
+	mxClassID cls = mxGetClassID(a);
+	int typenum = npyTypeFromClass(cls);
+	if (typenum < 0 || mxIsComplex(a) || mxIsSparse(a) || mxGetNumberOfDimensions(a) != 2
+		|| (mxGetM(a) != 1 && mxGetN(a) != 1)) {
+		return NULL;
+	}
+
+	if (nelem == 1) {
+		const void *data = mxGetData(a);
+		switch (cls) {
+		case mxDOUBLE_CLASS: return PyFloat_FromDouble(*(const double*) data);
+		case mxSINGLE_CLASS: return PyFloat_FromDouble(*(const float*) data);
+		case mxLOGICAL_CLASS: return PyBool_FromLong(*(const mxLogical*) data);
+		case mxINT8_CLASS: return PyInt_FromLong(*(const int8_t*) data);
+		case mxUINT8_CLASS: return PyInt_FromLong(*(const uint8_t*) data);
+		case mxINT16_CLASS: return PyInt_FromLong(*(const int16_t*) data);
+		case mxUINT16_CLASS: return PyInt_FromLong(*(const uint16_t*) data);
+		case mxINT32_CLASS: return PyInt_FromLong(*(const int32_t*) data);
+		case mxUINT32_CLASS: return PyLong_FromUnsignedLong(*(const uint32_t*) data);
+		case mxINT64_CLASS: return PyLong_FromLongLong(*(const int64_t*) data);
+		case mxUINT64_CLASS: return PyLong_FromUnsignedLongLong(*(const uint64_t*) data);
+		default: return NULL;
+		}
+	}
+
+	npy_intp n = (npy_intp) nelem;
+	PyObject *vector = PyArray_SimpleNew(1, &n, typenum);
+	if (vector != NULL && nelem > 0) {
+		memcpy(PyArray_DATA((PyArrayObject*) vector), mxGetData(a), nelem * mxGetElementSize(a));
+	}
+	return vector;
+}
+
+static PyObject* convertToPy(const mxArray *a);
+
+// Converts a MATLAB value into a new Python reference, counting the work
+// towards the current command's conversion phase.
+static PyObject* mat2py(const mxArray *a)
+{
+	PhaseTimer timer(PHASE_IN);
+	if (timer.phase >= 0) {
+		statsCall.bytesIn += mxTreeBytes(a);
+	}
+	statsCall.objectsIn++;
+	return convertToPy(a);
+}
+
+static PyObject* convertToPy(const mxArray *a) {
+	size_t ndims = mxGetNumberOfDimensions(a);
+	const mwSize *dims = mxGetDimensions(a);
+	mxClassID cls = mxGetClassID(a);
+	size_t nelem = mxGetNumberOfElements(a);
+
+	if (debug) mexPrintf("cls = %d, nelem = %d, ndims = %d, dims[0] = %d, dims[1] = %d\n", cls, nelem, ndims, dims[0], dims[1]);
+
+	if (cls == mxOBJECT_CLASS && mxIsClass(a, "PyRef")) {
+		return derefHandle(a);
+	} else if (mxIsClass(a, "table")) {
+		return tableToPy(a);
+	} else if (cls == mxCHAR_CLASS) {
+		return charToPy(a);
+	} else if (mxIsStruct(a) && exportOptions.structMode != ExportOptions::STRUCT_LISTS) {
+		return structToColumns(a);
+	} else if (mxIsStruct(a)) {
+		PyOwned o(PyDict_New());
+		int nfields = mxGetNumberOfFields(a);
+		if (debug) mexPrintf("nfields = %d, nelem = %d\n", nfields, nelem);
+
+		for (int i = 0; i < nfields; i++) {
+			PyOwned list(PyList_New(nelem));
+			for (size_t j = 0; j < nelem; j++) {
+				mxArray *item = mxGetFieldByNumber(a, j, i);
+				if (item == NULL) {
+					matpyError("matpy:NullFieldValue", "Null field in struct");
+				}
+				PyObject *pyItem = mat2py(item);
+				if (pyItem == NULL) {
+					matpyError("matpy:UnsupportedVariableType", "Unsupported variable type in struct");
+				}
+				PyList_SET_ITEM(list.get(), j, pyItem);
+			}
+			PyDict_SetItemString(o, mxGetFieldNameByNumber(a, i), list);
+		}
+		return o.release();
+	}
+
+	if (mxIsCell(a) && exportOptions.cellMode == ExportOptions::CELL_PACKED)
+	{
+		PyObject *packed = packCell(a);
+		if (packed != NULL)
+		{
+			return packed;
+		}
+	}
+
+	if (mxIsCell(a)) 
+	{
+		PyOwned list(PyList_New(nelem));
+
+		for (size_t i = 0; i < nelem; i++) 
+		{
+			const mxArray *cell = mxGetCell(a, i);
+			if (cell == NULL)
+			{
+				matpyError("matpy:NullFieldValue", "Null cell in cell array");
+			}
+			PyObject *item = mat2py(cell);
+			if (NULL == item)
+			{
+				matpyError("matpy:UnsupportedVariableType", "Unsupported variable type in a cell");
+			}
+			PyList_SET_ITEM(list.get(), i, item);
+		}
+		return list.release();
+	}
+
+	if (exportOptions.native) {
+		PyObject *native = nativeToPy(a);
+		if (native != NULL) {
+			return native;
+		}
+		if (PyErr_Occurred()) {
+			PyErr_Print();
+			matpyError("matpy:PythonError", "Error converting MATLAB value");
+		}
+	}
+
+	PyObject *ndary;
+	if (mxIsSparse(a)) {
+		ndary = sparseToPy(a);
+	} else if (mxIsComplex(a)) {
+		ndary = complexToPy(a);
+	} else {
+		int typenum = npyTypeFromClass(cls);
+		if (typenum < 0) {
+			matpyError("matpy:UnsupportedVariableType", "Unsupported variable type");
+		}
+		ndary = numericToPy(a, typenum);
+	}
+
+	if (ndary == NULL) {
+		PyErr_Print();
+		matpyError("matpy:PythonError", "Error converting MATLAB value");
+	}
+	if (debug) mexPrintf("ndary = 0x%08X copy = %d\n", ndary, exportOptions.copy);
+	return ndary;
+}
+
+// Imports an ndarray by copying its memory straight into a new mxArray.
+// Does not steal the reference to ary.
+static mxArray *ndarrayToMat(PyArrayObject *ary)
+{
+	mxClassID cls;
+	bool isComplex;
+	if (!classFromDescr(PyArray_DESCR(ary), &cls, &isComplex, true)) {
+		matpyError("matpy:UnsupportedVariableType", "Unsupported variable type");
+	}
+
+	int typenum = isComplex ? (cls == mxSINGLE_CLASS ? NPY_COMPLEX64 : NPY_COMPLEX128) : npyTypeFromClass(cls);
+	if (!isComplex && (size_t) PyArray_NBYTES(ary) <= SMALL_ARRAY_BYTES && PyArray_EquivTypenums(PyArray_TYPE(ary), typenum)
+		&& PyArray_ISNOTSWAPPED(ary) && PyArray_ISALIGNED(ary) && PyArray_IS_F_CONTIGUOUS(ary)) {
+		// Small arrays already laid out as MATLAB wants them are copied
+		// directly, without a NumPy view or giving up the GIL
+		int nd = PyArray_NDIM(ary);
+		mwSize dims[NPY_MAXDIMS] = {1, 1};
+		for (int i = 0; i < nd; i++) {
+			dims[i] = PyArray_DIMS(ary)[i];
+		}
+		mxArray *a = mxCreateUninitNumericArray(std::max(nd, 2), dims, cls, mxREAL);
+		memcpy(mxGetData(a), PyArray_DATA(ary), PyArray_NBYTES(ary));
+		return a;
+	}
+
+	// An aligned, native byte order view of the data in whatever layout it
+	// has; NumPy only copies when the array is not like that already.
+	PyArrayObject *src = (PyArrayObject*) PyArray_FromAny((PyObject*) ary, PyArray_DescrFromType(typenum), 0, 0,
+		NPY_ARRAY_ALIGNED, NULL);
+	if (src == NULL) {
+		PyErr_Print();
+		matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+	}
+
+	int nd = PyArray_NDIM(src);
+	mwSize ndims = nd;
+	mwSize dims[NPY_MAXDIMS];
+	for (int i = 0; i < nd; i++) {
+		dims[i] = PyArray_DIMS(src)[i];
+	}
+	if (nd == 0) {
+		ndims = 2;
+		dims[0] = dims[1] = 1;
+	}
+	if (debug) mexPrintf("ndims = %d, dims[0] = %d, dims[1] = %d, typenum = %d, fortran = %d\n", ndims, dims[0], ndims > 1 ? dims[1] : 1, typenum, PyArray_IS_F_CONTIGUOUS(src));
+
+	mxArray *a = mxCreateUninitNumericArray(ndims, dims, cls, isComplex ? mxCOMPLEX : mxREAL);
+	if (PyArray_SIZE(src) > 0) {
+#if MX_HAS_INTERLEAVED_COMPLEX
+		// complex64 and complex128 already match MATLAB's interleaved layout
+		copyToColumnMajor(src, mxGetData(a), NULL);
+#else
+		copyToColumnMajor(src, mxGetData(a), isComplex ? mxGetImagData(a) : NULL);
+#endif
+	}
+	Py_DECREF(src);
+
+	return a;
+}
+
+// Fills field number field of every element of a struct array from the
+// elements of an ndarray column taken in column-major order. Numeric columns
+// are copied in bulk and then split into scalars without creating Python
+// objects.
+static void setStructColumn(mxArray *s, int field, PyArrayObject *column)
+{
+	size_t nelem = mxGetNumberOfElements(s);
+	mxClassID cls;
+	bool isComplex;
+
+	if (classFromDescr(PyArray_DESCR(column), &cls, &isComplex, true)) {
+		mxArray *values = ndarrayToMat(column);
+		const char *data = (const char*) mxGetData(values);
+		size_t elsize = mxGetElementSize(values);
+		mwSize dims[] = {1, 1};
+		for (size_t j = 0; j < nelem; j++) {
+			mxArray *item = mxCreateUninitNumericArray(2, dims, cls, isComplex ? mxCOMPLEX : mxREAL);
+			memcpy(mxGetData(item), data + j * elsize, elsize);
+#if !MX_HAS_INTERLEAVED_COMPLEX
+			if (isComplex) {
+				memcpy(mxGetImagData(item), (const char*) mxGetImagData(values) + j * elsize, elsize);
+			}
+#endif
+			mxSetFieldByNumber(s, j, field, item);
+		}
+		mxDestroyArray(values);
+		return;
+	}
+
+	PyOwned raveled(PyArray_Ravel(column, NPY_FORTRANORDER));
+	if (raveled == NULL) {
+		PyErr_Print();
+		matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+	}
+	PyArrayObject *items = (PyArrayObject*) raveled.get();
+	const char *data = PyArray_BYTES(items);
+	size_t elsize = PyArray_ITEMSIZE(items);
+	for (size_t j = 0; j < nelem; j++) {
+		PyOwned item(PyArray_GETITEM(items, data + j * elsize));
+		if (item == NULL) {
+			PyErr_Print();
+			matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+		}
+		// py2mat takes over the reference
+		mxSetFieldByNumber(s, j, field, py2mat(item.release()));
+	}
+}
+
+// Converts a dict into a struct array with one field per key. The values are
+// either lists of equal length, giving a 1xN struct array, or ndarrays of
+// equal shape, giving a struct array of that shape.
+static mxArray *dictToStruct(PyObject *o)
+{
+	PyOwned keys(PyDict_Keys(o));
+	PyOwned items(PyDict_Values(o));
+	int nfields = (int) PyDict_Size(o);
+	std::vector<const char*> fieldNames(nfields);
+	bool arrays = nfields > 0 && PyArray_Check(PyList_GetItem(items, 0));
+	std::vector<mwSize> dims(2, 1);
+
+	for(int i = 0; i < nfields; i++) {
+		PyObject *item = PyList_GetItem(items, i);
+		fieldNames[i] = PyString_AsString(PyList_GetItem(keys, i));
+		if (fieldNames[i] == NULL) {
+			PyErr_Clear();
+			matpyError("matpy:IncorrectStructForm", "Dictionary keys must be strings");
+		}
+
+		if (arrays && PyArray_Check(item)) {
+			PyArrayObject *column = (PyArrayObject*) item;
+			int nd = PyArray_NDIM(column);
+			std::vector<mwSize> shape(std::max(nd, 2), 1);
+			for (int d = 0; d < nd; d++) {
+				shape[nd == 1 ? 1 : d] = PyArray_DIMS(column)[d];
+			}
+			if (i == 0) {
+				dims = shape;
+			} else if (shape != dims) {
+				matpyError("matpy:IncorrectStructForm", "Inconsistent number of elements");
+			}
+		} else if (!arrays && PyList_Check(item)) {
+			if (i == 0) {
+				dims[1] = PyList_Size(item);
+			} else if (dims[1] != (mwSize) PyList_Size(item)) {
+				matpyError("matpy:IncorrectStructForm", "Inconsistent number of elements");
+			}
+		} else {
+			matpyError("matpy:IncorrectStructForm", "Dictionary must have a list or an ndarray of values for each field");
+		}
+	}
+
+	if (debug) mexPrintf("nfields = %d, arrays = %d, dims[0] = %d, dims[1] = %d\n", nfields, arrays, dims[0], dims[1]);
+	mxArray *a = mxCreateStructArray(dims.size(), &dims[0], nfields, nfields > 0 ? &fieldNames[0] : NULL);
+
+	for(int i = 0; i < nfields; i++) {
+		PyObject *item = PyList_GetItem(items, i);
+		if (arrays) {
+			setStructColumn(a, i, (PyArrayObject*) item);
+			continue;
+		}
+		for(mwSize j = 0; j < dims[1]; j++) {
+			PyObject *value = PyList_GetItem(item, j);
+			Py_INCREF(value);
+			mxArray *mat_item = py2mat(value);
+			if (debug) mexPrintf("mat_item = 0x%08X\n", mat_item);
+			mxSetFieldByNumber(a, j, i, mat_item);
+		}
+	}
+
+	return a;
+}
+
+// Converts a NumPy structured array into a struct array of the same shape
+// with one field per dtype field.
+static mxArray *recordsToStruct(PyArrayObject *ary)
+{
+	PyObject *names = PyArray_DESCR(ary)->names;
+	// Released if a field cannot be converted and dictToStruct throws
+	PyOwned columns(PyDict_New());
+	for (Py_ssize_t i = 0; i < PyTuple_Size(names); i++) {
+		PyObject *name = PyTuple_GetItem(names, i);
+		PyOwned column(PyObject_GetItem((PyObject*) ary, name));
+		if (column == NULL) {
+			PyErr_Print();
+			matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+		}
+		PyDict_SetItem(columns, name, column);
+	}
+	return dictToStruct(columns);
+}
+
+// Converts a NumPy bytes ('S') or unicode ('U') array into a cellstr with
+// the array's dimensions, reading the fixed width elements directly.
+static mxArray *stringArrayToCell(PyArrayObject *ary)
+{
+	bool unicode = PyArray_DESCR(ary)->kind == 'U';
+	PyArrayObject *items = (PyArrayObject*) PyArray_FromAny((PyObject*) ary, NULL, 0, 0, NPY_ARRAY_F_CONTIGUOUS | NPY_ARRAY_ALIGNED, NULL);
+	if (items == NULL || (unicode && !PyArray_ISNOTSWAPPED(items))) {
+		Py_XDECREF(items);
+		PyErr_Clear();
+		matpyError("matpy:UnsupportedVariableType", "Unsupported variable type");
+	}
+
+	int nd = PyArray_NDIM(items);
+	std::vector<mwSize> dims(std::max(nd, 2), 1);
+	for (int d = 0; d < nd; d++) {
+		dims[nd == 1 ? 1 : d] = PyArray_DIMS(items)[d];
+	}
+	mxArray *a = mxCreateCellArray(dims.size(), &dims[0]);
+
+	size_t nelem = PyArray_SIZE(items);
+	size_t elsize = PyArray_ITEMSIZE(items);
+	const char *data = PyArray_BYTES(items);
+	std::vector<mxChar> chars;
+	for (size_t i = 0; i < nelem; i++) {
+		const char *item = data + i * elsize;
+		chars.clear();
+		if (unicode) {
+			const uint32_t *cp = (const uint32_t*) item;
+			size_t len = elsize / sizeof(uint32_t);
+			while (len > 0 && cp[len - 1] == 0) len--;
+			chars.resize(utf16Length(cp, len));
+			ucs4ToUtf16(cp, len, chars.empty() ? NULL : &chars[0]);
+		} else {
+			size_t len = elsize;
+			while (len > 0 && item[len - 1] == 0) len--;
+			for (size_t j = 0; j < len; j++) {
+				chars.push_back((mxChar) (unsigned char) item[j]);
+			}
+		}
+
+		mwSize charDims[] = {1, chars.size()};
+		mxArray *str = mxCreateCharArray(2, charDims);
+		if (!chars.empty()) {
+			memcpy(mxGetChars(str), &chars[0], chars.size() * sizeof(mxChar));
+		}
+		mxSetCell(a, i, str);
+	}
+	Py_DECREF(items);
+	return a;
+}
+
+// Converts a list or tuple whose items all have the same Python scalar type
+// into a 1xN numeric array of the class a single item would get. Returns NULL
+// for any other sequence.
+static mxArray *packList(PyObject *o)
+{
+	if (!PyList_Check(o) && !PyTuple_Check(o)) {
+		return NULL;
+	}
+	PyObject *seq = PySequence_Fast(o, "");
+	Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+	PyObject **items = PySequence_Fast_ITEMS(seq);
+	PyTypeObject *type = n > 0 ? Py_TYPE(items[0]) : NULL;
+	mxClassID cls = mxUNKNOWN_CLASS;
+	if (type == &PyBool_Type) cls = mxLOGICAL_CLASS;
+	else if (type == &PyInt_Type) cls = mxINT32_CLASS;
+	else if (type == &PyLong_Type) cls = mxINT64_CLASS;
+	else if (type == &PyFloat_Type) cls = mxDOUBLE_CLASS;
+	for (Py_ssize_t i = 1; i < n && cls != mxUNKNOWN_CLASS; i++) {
+		if (Py_TYPE(items[i]) != type) cls = mxUNKNOWN_CLASS;
+	}
+	if (cls == mxUNKNOWN_CLASS) {
+		Py_DECREF(seq);
+		return NULL;
+	}
+
+	mwSize dims[] = {1, (mwSize) n};
+	mxArray *a = mxCreateUninitNumericArray(2, dims, cls, mxREAL);
+	void *data = mxGetData(a);
+	for (Py_ssize_t i = 0; i < n; i++) {
+		switch (cls) {
+		case mxLOGICAL_CLASS: ((mxLogical*) data)[i] = items[i] == Py_True; break;
+		case mxINT32_CLASS: ((int*) data)[i] = (int) PyInt_AS_LONG(items[i]); break;
+		case mxINT64_CLASS: ((long long*) data)[i] = PyLong_AsLongLong(items[i]); break;
+		default: ((double*) data)[i] = PyFloat_AS_DOUBLE(items[i]); break;
+		}
+	}
+	Py_DECREF(seq);
+	return a;
+}
+
+// Sorts COO triplets into compressed sparse columns with two counting sorts,
+// by row and then stably by column, then sums duplicate entries and drops
+// the zeros, as MATLAB's sparse does.
+template <typename T>
+static void cooToCsc(size_t m, size_t n, const std::vector<npy_intp> &row, const std::vector<npy_intp> &col, const T *values,
+	std::vector<mwIndex> &jc, std::vector<mwIndex> &ir, std::vector<T> &pr)
+{
+	size_t nnz = row.size();
+	std::vector<mwIndex> rowStart(m + 1, 0);
+	for (size_t k = 0; k < nnz; k++) rowStart[row[k] + 1]++;
+	for (size_t i = 0; i < m; i++) rowStart[i + 1] += rowStart[i];
+	std::vector<mwIndex> byRow(nnz);
+	for (size_t k = 0; k < nnz; k++) byRow[rowStart[row[k]]++] = k;
+
+	std::vector<mwIndex> colStart(n + 1, 0);
+	for (size_t k = 0; k < nnz; k++) colStart[col[k] + 1]++;
+	for (size_t j = 0; j < n; j++) colStart[j + 1] += colStart[j];
+	std::vector<mwIndex> order(nnz);
+	std::vector<mwIndex> next(colStart.begin(), colStart.end() - 1);
+	for (size_t i = 0; i < nnz; i++) order[next[col[byRow[i]]]++] = byRow[i];
+
+	jc.assign(n + 1, 0);
+	ir.clear();
+	pr.clear();
+	for (size_t j = 0; j < n; j++) {
+		size_t first = ir.size();
+		for (mwIndex i = colStart[j]; i < colStart[j + 1]; i++) {
+			mwIndex k = order[i];
+			if (ir.size() > first && ir.back() == (mwIndex) row[k]) {
+				pr.back() = pr.back() + values[k];
+			} else {
+				ir.push_back(row[k]);
+				pr.push_back(values[k]);
+			}
+		}
+		size_t last = first;
+		for (size_t i = first; i < ir.size(); i++) {
+			if (!(pr[i] == T())) {
+				ir[last] = ir[i];
+				pr[last++] = pr[i];
+			}
+		}
+		ir.resize(last);
+		pr.resize(last);
+		jc[j + 1] = last;
+	}
+}
+
+// Copies the column pointers and row indices of compressed sparse columns
+// into a newly created sparse mxArray a.
+static mxArray *createSparse(const std::vector<mwIndex> &jc, const std::vector<mwIndex> &ir, mxArray *a)
+{
+	memcpy(mxGetJc(a), &jc[0], jc.size() * sizeof(mwIndex));
+	if (!ir.empty()) {
+		memcpy(mxGetIr(a), &ir[0], ir.size() * sizeof(mwIndex));
+	}
+	return a;
+}
+
+// Returns true if o is a scipy.sparse matrix.
+static bool isSparseMatrix(PyObject *o)
+{
+	// Any sparse matrix has imported scipy.sparse already
+	PyObject *sparse = PyDict_GetItemString(PyImport_GetModuleDict(), "scipy.sparse");
+	if (sparse == NULL) {
+		return false;
+	}
+	PyObject *isSparse = PyObject_CallMethod(sparse, (char*) "issparse", (char*) "O", o);
+	bool yes = isSparse != NULL && PyObject_IsTrue(isSparse) == 1;
+	Py_XDECREF(isSparse);
+	PyErr_Clear();
+	return yes;
+}
+
+// Converts any scipy.sparse matrix into a sparse MATLAB array: logical for
+// boolean data and double, complex if needed, otherwise. The matrix is taken
+// as COO triplets and compressed into columns here, never densified.
+static mxArray *sparseToMat(PyObject *o)
+{
+	Py_ssize_t m = 0, n = 0;
+	PyOwned shape(PyObject_GetAttrString(o, "shape"));
+	PyOwned coo(PyObject_CallMethod(o, (char*) "tocoo", NULL));
+	PyOwned rowObj(coo == NULL ? NULL : PyObject_GetAttrString(coo, "row"));
+	PyOwned colObj(coo == NULL ? NULL : PyObject_GetAttrString(coo, "col"));
+	PyOwned dataObj(coo == NULL ? NULL : PyObject_GetAttrString(coo, "data"));
+	PyOwned rowOwner, colOwner, dataOwner;
+	if (shape != NULL && PyArg_ParseTuple(shape, "nn", &m, &n) && rowObj != NULL && colObj != NULL && dataObj != NULL) {
+		char kind = PyArray_Check(dataObj) ? PyArray_DESCR((PyArrayObject*) dataObj.get())->kind : 'f';
+		int dataType = kind == 'b' ? NPY_BOOL : kind == 'c' ? NPY_COMPLEX128 : NPY_DOUBLE;
+		rowOwner.reset(PyArray_FromAny(rowObj, PyArray_DescrFromType(NPY_INTP), 1, 1, NPY_ARRAY_CARRAY_RO, NULL));
+		colOwner.reset(PyArray_FromAny(colObj, PyArray_DescrFromType(NPY_INTP), 1, 1, NPY_ARRAY_CARRAY_RO, NULL));
+		dataOwner.reset(PyArray_FromAny(dataObj, PyArray_DescrFromType(dataType), 1, 1, NPY_ARRAY_CARRAY_RO, NULL));
+	}
+	if (rowOwner == NULL || colOwner == NULL || dataOwner == NULL) {
+		PyErr_Print();
+		matpyError("matpy:ConversionError", "Error converting sparse matrix to MATLAB variable");
+	}
+	PyArrayObject *rowAry = (PyArrayObject*) rowOwner.get();
+	PyArrayObject *colAry = (PyArrayObject*) colOwner.get();
+	PyArrayObject *dataAry = (PyArrayObject*) dataOwner.get();
+
+	// A malformed COO object must not make us read past its index arrays
+	size_t nnz = PyArray_SIZE(dataAry);
+	if ((size_t) PyArray_SIZE(rowAry) != nnz || (size_t) PyArray_SIZE(colAry) != nnz) {
+		matpyError("matpy:ConversionError", "Sparse matrix has row, column and data arrays of different lengths");
+	}
+	const npy_intp *rows = (const npy_intp*) PyArray_DATA(rowAry);
+	const npy_intp *cols = (const npy_intp*) PyArray_DATA(colAry);
+	std::vector<npy_intp> row(rows, rows + nnz), col(cols, cols + nnz);
+	for (size_t k = 0; k < nnz; k++) {
+		if (row[k] < 0 || row[k] >= m || col[k] < 0 || col[k] >= n) {
+			matpyError("matpy:ConversionError", "Sparse matrix has indices out of range");
+		}
+	}
+
+	std::vector<mwIndex> jc, ir;
+	mxArray *a;
+	const void *values = PyArray_DATA(dataAry);
+	if (PyArray_TYPE(dataAry) == NPY_BOOL) {
+		std::vector<mxLogical> pr;
+		cooToCsc(m, n, row, col, (const mxLogical*) values, jc, ir, pr);
+		a = createSparse(jc, ir, mxCreateSparseLogicalMatrix(m, n, std::max<size_t>(ir.size(), 1)));
+		std::copy(pr.begin(), pr.end(), mxGetLogicals(a));
+	} else if (PyArray_TYPE(dataAry) == NPY_COMPLEX128) {
+		std::vector<std::complex<double> > pr;
+		cooToCsc(m, n, row, col, (const std::complex<double>*) values, jc, ir, pr);
+		a = createSparse(jc, ir, mxCreateSparse(m, n, std::max<size_t>(ir.size(), 1), mxCOMPLEX));
+#if MX_HAS_INTERLEAVED_COMPLEX
+		std::copy(pr.begin(), pr.end(), (std::complex<double>*) mxGetComplexDoubles(a));
+#else
+		double *re = mxGetPr(a);
+		double *im = mxGetPi(a);
+		for (size_t k = 0; k < pr.size(); k++) {
+			re[k] = pr[k].real();
+			im[k] = pr[k].imag();
+		}
+#endif
+	} else {
+		std::vector<double> pr;
+		cooToCsc(m, n, row, col, (const double*) values, jc, ir, pr);
+		a = createSparse(jc, ir, mxCreateSparse(m, n, std::max<size_t>(ir.size(), 1), mxREAL));
+		std::copy(pr.begin(), pr.end(), (double*) mxGetData(a));
+	}
+	return a;
+}
+
+static bool isDataFrame(PyObject *o)
+{
+	// Any DataFrame has imported pandas already
+	PyObject *pandas = PyDict_GetItemString(PyImport_GetModuleDict(), "pandas");
+	PyObject *frame = pandas == NULL ? NULL : PyObject_GetAttrString(pandas, "DataFrame");
+	bool yes = frame != NULL && PyObject_IsInstance(o, frame) == 1;
+	Py_XDECREF(frame);
+	PyErr_Clear();
+	return yes;
+}
+
+// Returns str(o), or unicode(o) when that fails, as a char row vector.
+static mxArray *textToChar(PyObject *o)
+{
+	if (o == NULL) {
+		PyErr_Print();
+		matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+	}
+	PyObject *text = PyUnicode_Check(o) ? NULL : PyObject_Str(o);
+	if (text == NULL) {
+		PyErr_Clear();
+		text = PyObject_Unicode(o);
+	}
+	if (text == NULL) {
+		PyErr_Print();
+		matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+	}
+	mxArray *a = PyUnicode_Check(text) ? unicodeToChar(text) : stringToChar(text);
+	Py_DECREF(text);
+	return a;
+}
+
+// Converts the values of a DataFrame column into an m x 1 MATLAB array:
+// numeric and boolean columns in bulk, string and object columns into cell
+// arrays and Categoricals into categorical arrays.
+static mxArray *frameColumnToMat(PyObject *series, size_t m)
+{
+	PyOwned dtype(PyObject_GetAttrString(series, "dtype"));
+	PyOwned dtypeName(dtype == NULL ? NULL : PyObject_Str(dtype));
+	bool categorical = dtypeName != NULL && !strcmp(PyString_AsString(dtypeName), "category");
+
+	mxArray *a;
+	if (categorical) {
+		PyOwned cat(PyObject_GetAttrString(series, "cat"));
+		PyOwned codes(cat == NULL ? NULL : PyObject_GetAttrString(cat, "codes"));
+		PyOwned codeValues(codes == NULL ? NULL : PyObject_GetAttrString(codes, "values"));
+		PyOwned categories(cat == NULL ? NULL : PyObject_GetAttrString(cat, "categories"));
+		PyOwned ordered(cat == NULL ? NULL : PyObject_GetAttrString(cat, "ordered"));
+		PyOwned codeOwner(codeValues == NULL ? NULL : PyArray_FROM_OTF(codeValues, NPY_INT64, NPY_ARRAY_CARRAY_RO));
+		PyArrayObject *codeArray = (PyArrayObject*) codeOwner.get();
+		Py_ssize_t k = categories == NULL ? -1 : PySequence_Size(categories);
+		if (codeArray == NULL || ordered == NULL || k < 0) {
+			PyErr_Print();
+			matpyError("matpy:ConversionError", "Error converting a Categorical");
+		}
+
+		// MATLAB's categorical(codes, 1:k, names) leaves 0, pandas' -1,
+		// undefined
+		mxArray *args[5];
+		args[0] = mxCreateDoubleMatrix(m, 1, mxREAL);
+		const npy_int64 *src = (const npy_int64*) PyArray_DATA(codeArray);
+		double *codesDst = (double*) mxGetData(args[0]);
+		for (size_t i = 0; i < m; i++) {
+			codesDst[i] = (double) (src[i] + 1);
+		}
+		args[1] = mxCreateDoubleMatrix(1, k, mxREAL);
+		args[2] = mxCreateCellMatrix(1, k);
+		for (Py_ssize_t i = 0; i < k; i++) {
+			((double*) mxGetData(args[1]))[i] = (double) (i + 1);
+			PyOwned name(PySequence_GetItem(categories, i));
+			mxSetCell(args[2], i, textToChar(name));
+		}
+		args[3] = mxCreateString("Ordinal");
+		args[4] = mxCreateLogicalScalar(PyObject_IsTrue(ordered) == 1);
+		callMatlab(1, &a, 5, args, "categorical");
+		for (int i = 0; i < 5; i++) {
+			mxDestroyArray(args[i]);
+		}
+		return a;
+	}
+
+	PyOwned values(PyObject_GetAttrString(series, "values"));
+	if (values == NULL) {
+		PyErr_Print();
+		matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+	}
+	if (PyArray_Check(values) && PyArray_DESCR((PyArrayObject*) values.get())->kind == 'O') {
+		a = mxCreateCellMatrix(m, 1);
+		for (size_t i = 0; i < m; i++) {
+			mxSetCell(a, i, py2mat(PySequence_GetItem(values, i)));
+		}
+	} else {
+		a = py2mat(values.release());
+	}
+	if (mxGetNumberOfElements(a) == m) {
+		mwSize dims[] = {m, 1};
+		mxSetDimensions(a, dims, 2);
+	}
+	return a;
+}
+
+// Converts a DataFrame into a table one column at a time, with its column
+// names as variable names and a string index as row names.
+static mxArray *dataFrameToMat(PyObject *o)
+{
+	PyOwned columns(PyObject_GetAttrString(o, "columns"));
+	PyOwned index(PyObject_GetAttrString(o, "index"));
+	PyOwned iloc(PyObject_GetAttrString(o, "iloc"));
+	Py_ssize_t ncols = columns == NULL ? -1 : PySequence_Size(columns);
+	Py_ssize_t m = index == NULL ? -1 : PySequence_Size(index);
+	if (iloc == NULL || ncols < 0 || m < 0) {
+		PyErr_Print();
+		matpyError("matpy:ConversionError", "Error converting a DataFrame");
+	}
+
+	std::vector<mxArray*> args;
+	mxArray *names = mxCreateCellMatrix(1, ncols);
+	for (Py_ssize_t i = 0; i < ncols; i++) {
+		PyOwned name(PySequence_GetItem(columns, i));
+		mxSetCell(names, i, textToChar(name));
+
+		PyOwned key(Py_BuildValue("(Nn)", PySlice_New(NULL, NULL, NULL), i));
+		PyOwned series(key == NULL ? NULL : PyObject_GetItem(iloc, key));
+		if (series == NULL) {
+			PyErr_Print();
+			matpyError("matpy:ConversionError", "Error converting a DataFrame");
+		}
+		args.push_back(frameColumnToMat(series, m));
+	}
+	args.push_back(mxCreateString("VariableNames"));
+	args.push_back(names);
+
+	PyOwned indexValues(PyObject_GetAttrString(index, "values"));
+	if (indexValues != NULL && PyArray_Check(indexValues) && PyArray_DESCR((PyArrayObject*) indexValues.get())->kind == 'O') {
+		mxArray *rowNames = mxCreateCellMatrix(m, 1);
+		for (Py_ssize_t i = 0; i < m; i++) {
+			PyOwned name(PySequence_GetItem(indexValues, i));
+			mxSetCell(rowNames, i, textToChar(name));
+		}
+		args.push_back(mxCreateString("RowNames"));
+		args.push_back(rowNames);
+	}
+	PyErr_Clear();
+
+	mxArray *a;
+	callMatlab(1, &a, (int) args.size(), &args[0], "table");
+	for (size_t i = 0; i < args.size(); i++) {
+		mxDestroyArray(args[i]);
+	}
+	return a;
+}
+
+static mxArray* convertToMat(PyObject *o);
+
+// Converts a Python value into a MATLAB value, stealing the reference and
+// counting the work towards the current command's conversion phase.
+static mxArray* py2mat(PyObject *o)
+{
+	PhaseTimer timer(PHASE_OUT);
+	mxArray *a = convertToMat(o);
+	if (timer.phase >= 0) {
+		statsCall.bytesOut += mxTreeBytes(a);
+	}
+	statsCall.objectsOut++;
+	return a;
+}
+
+// Converts o with the converter registered for its type or the nearest of
+// its base classes. Returns NULL when there is none. o is borrowed.
+static mxArray *applyConverter(PyObject *o, bool exactType)
+{
+	if (PyDict_Size(converters) == 0) {
+		return NULL;
+	}
+	PyObject *converter = NULL;
+	if (exactType) {
+		converter = PyDict_GetItem(converters, (PyObject*) Py_TYPE(o));
+	} else {
+		PyObject *mro = Py_TYPE(o)->tp_mro;
+		for (Py_ssize_t i = 1; mro != NULL && i < PyTuple_GET_SIZE(mro) && converter == NULL; i++) {
+			converter = PyDict_GetItem(converters, PyTuple_GET_ITEM(mro, i));
+		}
+	}
+	if (converter == NULL) {
+		return NULL;
+	}
+
+	PyObject *value = PyObject_CallFunctionObjArgs(converter, o, NULL);
+	if (value == NULL) {
+		PyErr_Print();
+		matpyError("matpy:ConversionError", "Error in a registered converter");
+	}
+	if (Py_TYPE(value) == Py_TYPE(o)) {
+		Py_DECREF(value);
+		matpyError("matpy:ConversionError", "A registered converter returned a value of the type it converts");
+	}
+	return convertToMat(value);
+}
+
+// Converts a datetime64 array into datenums, and a timedelta64 array into
+// days, NaT becoming NaN. Does not steal the reference to ary.
+static mxArray *datetimeToMat(PyArrayObject *ary)
+{
+	bool timedelta = PyArray_DESCR(ary)->kind == 'm';
+	PyObject *unit = PyString_FromString(timedelta ? "m8[us]" : "M8[us]");
+	PyArray_Descr *descr = NULL;
+	PyArray_DescrConverter(unit, &descr);
+	Py_DECREF(unit);
+	// Going to a coarser unit such as from ns to us is an unsafe cast, which
+	// PyArray_FromAny only does when forced
+	PyOwned usOwner(descr == NULL ? NULL : PyArray_FromAny((PyObject*) ary, descr, 0, 0, NPY_ARRAY_CARRAY_RO | NPY_ARRAY_FORCECAST, NULL));
+	if (usOwner == NULL) {
+		PyErr_Print();
+		matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+	}
+	PyArrayObject *us = (PyArrayObject*) usOwner.get();
+
+	PyOwned daysOwner(PyArray_SimpleNew(PyArray_NDIM(us), PyArray_DIMS(us), NPY_FLOAT64));
+	PyArrayObject *days = (PyArrayObject*) daysOwner.get();
+	const npy_int64 *src = (const npy_int64*) PyArray_DATA(us);
+	double *dst = (double*) PyArray_DATA(days);
+	// datenum 719529 is 1970-01-01
+	double offset = timedelta ? 0 : 719529;
+	for (npy_intp i = 0; i < PyArray_SIZE(us); i++) {
+		dst[i] = src[i] == std::numeric_limits<npy_int64>::min() ? std::numeric_limits<double>::quiet_NaN() : offset + src[i] / 86400e6;
+	}
+	return ndarrayToMat(days);
+}
+
+static bool isDecimal(PyObject *o)
+{
+	// Any Decimal has imported decimal already
+	PyObject *decimal = PyDict_GetItemString(PyImport_GetModuleDict(), "decimal");
+	PyObject *type = decimal == NULL ? NULL : PyObject_GetAttrString(decimal, "Decimal");
+	bool yes = type != NULL && PyObject_IsInstance(o, type) == 1;
+	Py_XDECREF(type);
+	PyErr_Clear();
+	return yes;
+}
+
+static mxArray* convertToMat(PyObject *o) {
+	if (o == NULL) {
+		PyErr_Print();
+		matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+	}
+	// Released however the conversion ends
+	PyOwned owner(o);
+	mxArray *converted = applyConverter(o, true);
+	if (converted != NULL) {
+		return converted;
+	}
+	// NumPy scalars, such as float32 and datetime64, convert as 0-d arrays.
+	// This comes before the int and float checks since on Python 2 int64
+	// subclasses int, which would truncate it to int32. NumPy strings stay
+	// strings.
+	if (PyArray_IsScalar(o, Generic) && !PyString_Check(o) && !PyUnicode_Check(o)) {
+		PyObject *ary = PyArray_FromAny(o, NULL, 0, 0, 0, NULL);
+		if (ary == NULL) {
+			PyErr_Print();
+			matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+		}
+		return convertToMat(ary);
+	}
+#undef CASE
+#define CASE(check, c_type, cls, conv) \
+	if (check(o)) { \
+		if (debug) mexPrintf("%s\n", #c_type); \
+		mwSize dims[] = {1,1}; \
+		mxArray *a = mxCreateNumericArray(2, dims, cls, mxREAL); \
+		c_type *data = (c_type*) mxGetData(a); \
+		*data = (c_type) conv(o); \
+		return a; \
+	}
+	CASE(PyBool_Check, bool, mxLOGICAL_CLASS, PyInt_AsLong) else
+	CASE(PyInt_Check, int, mxINT32_CLASS, PyInt_AsLong) else
+	CASE(PyLong_Check, long long, mxINT64_CLASS, PyLong_AsLongLong) else
+	CASE(PyFloat_Check, double, mxDOUBLE_CLASS, PyFloat_AsDouble) else
+	if (PyComplex_Check(o)) {
+		mwSize dims[] = {1,1};
+		mxArray *a = mxCreateNumericArray(2, dims, mxDOUBLE_CLASS, mxCOMPLEX);
+#if MX_HAS_INTERLEAVED_COMPLEX
+		mxComplexDouble *data = mxGetComplexDoubles(a);
+		data->real = PyComplex_RealAsDouble(o);
+		data->imag = PyComplex_ImagAsDouble(o);
+#else
+		double *data = mxGetPr(a);
+		double *imagData = mxGetPi(a);
+		*data = PyComplex_RealAsDouble(o);
+		*imagData = PyComplex_ImagAsDouble(o);
+#endif
+		return a;
+	} else if (PyUnicode_Check(o)) {
+		return unicodeToChar(o);
+	} else if (PyString_Check(o)) {
+		return stringToChar(o);
+	} else if (PyObject_IsInstance(o, ndarray_cls) && (PyArray_DESCR((PyArrayObject*) o)->kind == 'M' || PyArray_DESCR((PyArrayObject*) o)->kind == 'm')) {
+		return datetimeToMat((PyArrayObject*) o);
+	} else if (PyObject_IsInstance(o, ndarray_cls) && (PyArray_DESCR((PyArrayObject*) o)->kind == 'S' || PyArray_DESCR((PyArrayObject*) o)->kind == 'U')) {
+		return stringArrayToCell((PyArrayObject*) o);
+	} else if (PyObject_IsInstance(o, ndarray_cls)) {
+		return PyDataType_HASFIELDS(PyArray_DESCR((PyArrayObject*) o)) ? recordsToStruct((PyArrayObject*) o) : ndarrayToMat((PyArrayObject*) o);
+	} else if (isSparseMatrix(o)) {
+		return sparseToMat(o);
+	} else if (isDataFrame(o)) {
+		return dataFrameToMat(o);
+	} else if (PySequence_Check(o)) {
+		mxArray *packed = importOptions.packLists ? packList(o) : NULL;
+		if (packed != NULL) {
+			return packed;
+		}
+		Py_ssize_t size = PySequence_Size(o);
+		if (size < 0)
+		{
+			PyErr_Print();
+			matpyError("matpy:ConversionError", "Error getting the length of a sequence");
+		}
+		mwSize nelem = (mwSize) size;
+		mwSize dims[] = {1, nelem};
+		mxArray *a = mxCreateCellArray(2, dims);
+		if (debug) mexPrintf("a = 0x%08X nelem = %d\n", a, nelem);
+		for (mwSize i = 0; i < nelem; i++) {
+			PyObject *item = PySequence_GetItem(o, (Py_ssize_t) i);
+			if (item == NULL)
+			{
+				PyErr_Print();
+				matpyError("matpy:ConversionError", "Error getting item %lld of a sequence", (long long) (i + 1));
+			}
+			mxArray *mat_item = py2mat(item);
+			if(mat_item == NULL)
+			{
+				matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+			}
+			if (debug) mexPrintf("mat_item = 0x%08X\n", mat_item);
+			mxSetCell(a, i, mat_item);
+		}
+		return a;
+	} else if(PyDict_Check(o)){
+		return dictToStruct(o);
+	} else if (isDecimal(o)) {
+		return mxCreateDoubleScalar(PyFloat_AsDouble(o));
+	} else if ((converted = applyConverter(o, false)) != NULL) {
+		return converted;
+	} else{
+		matpyError("matpy:UnsupportedVariableType", "Unsupported variable type");
+	}
+	return NULL;
+}
+
+// The matlab module lets Python code running in a py command call back into
+// MATLAB: matlab.call runs a MATLAB function, matlab.get and matlab.put read
+// and write workspace variables. Values convert as in py('set') and
+// py('get'), except that numeric arrays MATLAB returns are handed to NumPy
+// without a copy, as nothing else references them. Only the MATLAB thread
+// can call back, and only while a py command runs.
+static PyObject *matlabError;
+
+static bool checkCallbackThread(const char *function)
+{
+	if (std::this_thread::get_id() != matlabThread) {
+		PyErr_Format(PyExc_RuntimeError, "matlab.%s can only be called from the thread running py commands, not from async jobs", function);
+		return false;
+	}
+	return true;
+}
+
+// Converts an array MATLAB handed over to us, and destroys it. Real numeric
+// arrays become the data of the ndarray itself.
+static PyObject *ownedToPy(mxArray *a)
+{
+	int typenum = npyTypeFromClass(mxGetClassID(a));
+	if (typenum >= 0 && !mxIsComplex(a) && !mxIsSparse(a) && mxGetNumberOfElements(a) > 0) {
+		mexMakeArrayPersistent(a);
+		return wrapMxArray(a, typenum);
+	}
+	PyObject *o;
+	try {
+		o = mat2py(a);
+	} catch (const MatpyError &) {
+		mxDestroyArray(a);
+		throw;
+	}
+	mxDestroyArray(a);
+	return o;
+}
+
+static bool parseWorkspace(const char *workspace)
+{
+	if (strcmp(workspace, "base") && strcmp(workspace, "caller") && strcmp(workspace, "global")) {
+		PyErr_Format(PyExc_ValueError, "workspace must be 'base', 'caller' or 'global', not '%s'", workspace);
+		return false;
+	}
+	return true;
+}
+
+static void setMatpyError(const MatpyError &error)
+{
+	PyErr_Format(matlabError, "%s: %s", error.id.c_str(), error.message.c_str());
+}
+
+static PyObject *matlab_call(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	Py_ssize_t nargs = PyTuple_GET_SIZE(args);
+	if (nargs < 1 || !PyString_Check(PyTuple_GET_ITEM(args, 0))) {
+		PyErr_SetString(PyExc_TypeError, "matlab.call(name, *args, nout=1) needs the name of a MATLAB function");
+		return NULL;
+	}
+	const char *name = PyString_AS_STRING(PyTuple_GET_ITEM(args, 0));
+	int nout = 1;
+	PyObject *noutArg = kwargs == NULL ? NULL : PyDict_GetItemString(kwargs, "nout");
+	if (kwargs != NULL && PyDict_Size(kwargs) > (noutArg != NULL ? 1 : 0)) {
+		PyErr_SetString(PyExc_TypeError, "matlab.call only takes the keyword argument nout");
+		return NULL;
+	}
+	if (noutArg != NULL) {
+		nout = (int) PyInt_AsLong(noutArg);
+		if (nout == -1 && PyErr_Occurred()) {
+			return NULL;
+		}
+		if (nout < 0) {
+			PyErr_SetString(PyExc_ValueError, "nout must not be negative");
+			return NULL;
+		}
+	}
+	if (!checkCallbackThread("call")) {
+		return NULL;
+	}
+
+	std::vector<mxArray*> in, out(nout, (mxArray*) NULL);
+	PyObject *result = NULL;
+	{
+		CallbackScope scope;
+		try {
+			for (Py_ssize_t i = 1; i < nargs; i++) {
+				PyObject *arg = PyTuple_GET_ITEM(args, i);
+				Py_INCREF(arg);
+				in.push_back(py2mat(arg));
+			}
+			// What Python printed so far comes before what MATLAB prints
+			flushOutput(true);
+			mxArray *exception = mexCallMATLABWithTrap(nout, out.data(), (int) in.size(), in.data(), name);
+			if (exception != NULL) {
+				std::string id = exceptionText(exception, "identifier");
+				std::string message = exceptionText(exception, "message");
+				mxDestroyArray(exception);
+				MatpyError error = {id.empty() ? "MATLAB:error" : id, message};
+				throw error;
+			}
+
+			result = nout == 1 ? NULL : PyTuple_New(nout);
+			for (int i = 0; i < nout; i++) {
+				mxArray *a = out[i];
+				out[i] = NULL;
+				PyObject *o = ownedToPy(a);
+				if (o == NULL) {
+					matpyError("matpy:ConversionError", "Error converting output %d of %s to a Python variable", i + 1, name);
+				}
+				if (nout == 1) {
+					result = o;
+				} else {
+					PyTuple_SET_ITEM(result, i, o);
+				}
+			}
+			if (nout == 0) {
+				result = Py_None;
+				Py_INCREF(result);
+			}
+		} catch (const MatpyError &error) {
+			Py_CLEAR(result);
+			setMatpyError(error);
+		}
+	}
+	for (size_t i = 0; i < in.size(); i++) {
+		mxDestroyArray(in[i]);
+	}
+	for (int i = 0; i < nout; i++) {
+		if (out[i] != NULL) {
+			mxDestroyArray(out[i]);
+		}
+	}
+	// PyRefs the MATLAB function cleared
+	if (callbackDepth == 0) {
+		releasePendingHandles();
+	}
+	return result;
+}
+
+static PyObject *matlab_get(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"name", "workspace", NULL};
+	const char *name, *workspace = "base";
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|s", (char**) keywords, &name, &workspace)
+		|| !parseWorkspace(workspace) || !checkCallbackThread("get")) {
+		return NULL;
+	}
+
+	mxArray *a = mexGetVariable(workspace, name);
+	if (a == NULL) {
+		PyErr_Format(PyExc_NameError, "There is no variable '%s' in the %s workspace", name, workspace);
+		return NULL;
+	}
+	CallbackScope scope;
+	try {
+		PyObject *o = ownedToPy(a);
+		if (o == NULL) {
+			matpyError("matpy:ConversionError", "Error converting '%s' to a Python variable", name);
+		}
+		return o;
+	} catch (const MatpyError &error) {
+		setMatpyError(error);
+		return NULL;
+	}
+}
+
+static PyObject *matlab_put(PyObject *self, PyObject *args, PyObject *kwargs)
+{
+	static const char *keywords[] = {"name", "value", "workspace", NULL};
+	const char *name, *workspace = "base";
+	PyObject *value;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "sO|s", (char**) keywords, &name, &value, &workspace)
+		|| !parseWorkspace(workspace) || !checkCallbackThread("put")) {
+		return NULL;
+	}
+
+	CallbackScope scope;
+	try {
+		Py_INCREF(value);
+		mxArray *a = py2mat(value);
+		int status = mexPutVariable(workspace, name, a);
+		mxDestroyArray(a);
+		if (status != 0) {
+			PyErr_Format(PyExc_ValueError, "Could not set '%s' in the %s workspace", name, workspace);
+			return NULL;
+		}
+	} catch (const MatpyError &error) {
+		setMatpyError(error);
+		return NULL;
+	}
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef matlabMethods[] =
+{
+    {"call", (PyCFunction) matlab_call, METH_VARARGS | METH_KEYWORDS,
+     "call(name, *args, nout=1) calls the MATLAB function name and returns its output, None for nout=0 and a tuple for nout > 1"},
+    {"get", (PyCFunction) matlab_get, METH_VARARGS | METH_KEYWORDS,
+     "get(name, workspace='base') returns a variable of a MATLAB workspace: 'base', 'caller' or 'global'"},
+    {"put", (PyCFunction) matlab_put, METH_VARARGS | METH_KEYWORDS,
+     "put(name, value, workspace='base') sets a variable in a MATLAB workspace: 'base', 'caller' or 'global'"},
+    {NULL, NULL, 0, NULL}
+};
+
+static void initMatlabModule(void)
+{
+    PyObject *matlabModule = Py_InitModule3("matlab", matlabMethods, "Calls back into the MATLAB running matpy");
+    if (NULL != matlabModule)
+    {
+        matlabError = PyErr_NewException((char*) "matlab.MatlabError", PyExc_RuntimeError, NULL);
+        Py_INCREF(matlabError);
+        PyModule_AddObject(matlabModule, "MatlabError", matlabError);
+    }
+}
+
+static bool isOption(const mxArray *a, const char *name)
+{
+	char key[64];
+	return mxIsChar(a) && mxGetString(a, key, sizeof(key)) == 0 && !strcmp(key, name);
+}
+
+// Validates that prhs[first..] is a list of 'name', value pairs whose names
+// are all in the NULL terminated list known.
+static void checkOptions(int first, const char *const known[], const char *usage)
+{
+	if ((nrhs - first) % 2 != 0)
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+	for (int i = first; i < nrhs; i += 2)
+	{
+		bool found = false;
+		for (int k = 0; known[k] != NULL && !found; k++)
+		{
+			found = isOption(prhs[i], known[k]);
+		}
+		if (!found)
+		{
+			matpyError("matpy:UnrecognizedOption", usage);
+		}
+	}
+}
+
+// Returns the value given for the option name in prhs[first..], or NULL.
+static const mxArray *getOption(int first, const char *name)
+{
+	for (int i = first; i + 1 < nrhs; i += 2)
+	{
+		if (isOption(prhs[i], name))
+		{
+			return prhs[i + 1];
+		}
+	}
+	return NULL;
+}
+
+// Returns the position of the value of option name in the NULL terminated
+// list choices, or defaultValue when the option was not given.
+static int getChoiceOption(int first, const char *name, const char *const choices[], int defaultValue)
+{
+	const mxArray *value = getOption(first, name);
+	if (value == NULL)
+	{
+		return defaultValue;
+	}
+	for (int i = 0; choices[i] != NULL; i++)
+	{
+		if (isOption(value, choices[i]))
+		{
+			return i;
+		}
+	}
+	matpyError("matpy:WrongOptionValue", "Unrecognized value for option '%s'", name);
+	return defaultValue;
+}
+
+static bool boolOptionValue(const mxArray *value, const char *name)
+{
+	if (!(mxIsLogical(value) || mxIsNumeric(value)) || mxGetNumberOfElements(value) != 1)
+	{
+		matpyError("matpy:WrongOptionValue", "Option '%s' must be a logical scalar", name);
+	}
+	return mxGetScalar(value) != 0;
+}
+
+static bool getBoolOption(int first, const char *name, bool defaultValue)
+{
+	const mxArray *value = getOption(first, name);
+	return value == NULL ? defaultValue : boolOptionValue(value, name);
+}
+
+// LRU cache of compiled code objects keyed by compile mode and source text,
+// so that expressions sent over and over are only parsed once.
+struct CodeCacheEntry
+{
+	std::string key;
+	PyObject *code;
+};
+static std::list<CodeCacheEntry> codeCache; // most recently used first
+static std::unordered_map<std::string, std::list<CodeCacheEntry>::iterator> codeCacheIndex;
+static size_t codeCacheCapacity = 256;
+static double codeCacheHits, codeCacheMisses, codeCacheEvictions;
+
+static void trimCodeCache(size_t capacity)
+{
+	while (codeCache.size() > capacity) {
+		CodeCacheEntry &entry = codeCache.back();
+		codeCacheIndex.erase(entry.key);
+		Py_DECREF(entry.code);
+		codeCache.pop_back();
+		codeCacheEvictions++;
+	}
+}
+
+// Returns a new reference to the code object for source, compiling it with
+// mode (Py_eval_input or Py_file_input) if it is not cached. Returns NULL with
+// the Python error set if compilation fails.
+static PyCodeObject *compileCached(const char *source, int mode)
+{
+	std::string key = std::to_string(mode) + ':' + source;
+	std::unordered_map<std::string, std::list<CodeCacheEntry>::iterator>::iterator found = codeCacheIndex.find(key);
+	if (found != codeCacheIndex.end()) {
+		codeCacheHits++;
+		codeCache.splice(codeCache.begin(), codeCache, found->second);
+		Py_INCREF(found->second->code);
+		return (PyCodeObject*) found->second->code;
+	}
+
+	codeCacheMisses++;
+	PyObject *code;
+	{
+		PhaseTimer timer(PHASE_COMPILE);
+		code = Py_CompileString(source, "<string>", mode);
+	}
+	if (code != NULL && codeCacheCapacity > 0) {
+		Py_INCREF(code);
+		CodeCacheEntry entry = {key, code};
+		codeCache.push_front(entry);
+		codeCacheIndex[key] = codeCache.begin();
+		trimCodeCache(codeCacheCapacity);
+	}
+	return (PyCodeObject*) code;
+}
+
+// stats = py('stats'), py('stats', 'reset'), py('stats', 'trace', file) starts
+// writing a Chrome trace_event timeline to file and py('stats', 'trace', '')
+// finishes it.
+static void do_stats()
+{
+	const char *usage = "Usage: stats = py('stats'), py('stats', 'reset') or py('stats', 'trace', file)";
+	if (nrhs == 1)
+	{
+		std::vector<const char*> commands;
+		for (std::map<std::string, CommandStats>::iterator it = commandStats.begin(); it != commandStats.end(); ++it)
+		{
+			commands.push_back(it->first.c_str());
+		}
+		const char *fields[] = {"calls", "time", "maxTime", "convertInTime", "convertInMaxTime", "compileTime", "compileMaxTime",
+			"executeTime", "executeMaxTime", "convertOutTime", "convertOutMaxTime", "bytesIn", "bytesOut", "objectsIn", "objectsOut"};
+		const int nfields = sizeof(fields) / sizeof(fields[0]);
+		plhs[0] = mxCreateStructMatrix(1, 1, (int) commands.size(), commands.empty() ? NULL : &commands[0]);
+		for (size_t c = 0; c < commands.size(); c++)
+		{
+			const CommandStats &stats = commandStats[commands[c]];
+			double values[nfields] = {stats.calls, stats.time, stats.maxTime};
+			for (int i = 0; i < PHASE_COUNT; i++)
+			{
+				values[3 + 2 * i] = stats.phaseTime[i];
+				values[4 + 2 * i] = stats.phaseMaxTime[i];
+			}
+			values[11] = stats.bytesIn;
+			values[12] = stats.bytesOut;
+			values[13] = stats.objectsIn;
+			values[14] = stats.objectsOut;
+
+			mxArray *entry = mxCreateStructMatrix(1, 1, nfields, fields);
+			for (int i = 0; i < nfields; i++)
+			{
+				mxSetFieldByNumber(entry, 0, i, mxCreateDoubleScalar(values[i]));
+			}
+			mxSetFieldByNumber(plhs[0], 0, (int) c, entry);
+		}
+	}
+	else if (isOption(prhs[1], "reset") && nrhs == 2)
+	{
+		commandStats.clear();
+	}
+	else if (isOption(prhs[1], "trace") && nrhs == 3 && mxIsChar(prhs[2]))
+	{
+		stopTrace();
+		char *file = mxArrayToString(prhs[2]);
+		std::string traceFile = file;
+		mxFree(file);
+		if (!traceFile.empty())
+		{
+			FILE *f = fopen(traceFile.c_str(), "w");
+			if (f == NULL)
+			{
+				matpyError("matpy:TraceFileError", "Could not write trace file %s", traceFile.c_str());
+			}
+			fprintf(f, "{\"traceEvents\": [\n");
+			std::lock_guard<std::mutex> lock(traceMutex);
+			traceOut = f;
+			traceCount = 0;
+			traceOrigin = StatsClock::now();
+		}
+	}
+	else
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+}
+
+static void do_cache()
+{
+	const char *usage = "Usage: py('cache', 'clear'), stats = py('cache', 'stats') or py('cache', 'size', n)";
+	if (nrhs < 2 || !mxIsChar(prhs[1]))
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+
+	if (isOption(prhs[1], "clear") && nrhs == 2)
+	{
+		trimCodeCache(0);
+		PyDict_Clear(callableCache);
+		codeCacheHits = codeCacheMisses = codeCacheEvictions = 0;
+	}
+	else if (isOption(prhs[1], "stats") && nrhs == 2)
+	{
+		const char *fields[] = {"hits", "misses", "evictions", "size", "capacity"};
+		plhs[0] = mxCreateStructMatrix(1, 1, 5, fields);
+		mxSetFieldByNumber(plhs[0], 0, 0, mxCreateDoubleScalar(codeCacheHits));
+		mxSetFieldByNumber(plhs[0], 0, 1, mxCreateDoubleScalar(codeCacheMisses));
+		mxSetFieldByNumber(plhs[0], 0, 2, mxCreateDoubleScalar(codeCacheEvictions));
+		mxSetFieldByNumber(plhs[0], 0, 3, mxCreateDoubleScalar((double) codeCache.size()));
+		mxSetFieldByNumber(plhs[0], 0, 4, mxCreateDoubleScalar((double) codeCacheCapacity));
+	}
+	else if (isOption(prhs[1], "size") && nrhs == 3)
+	{
+		if (!mxIsNumeric(prhs[2]) || mxGetNumberOfElements(prhs[2]) != 1 || mxGetScalar(prhs[2]) < 0)
+		{
+			matpyError("matpy:WrongOptionValue", "Cache size must be a non-negative scalar");
+		}
+		codeCacheCapacity = (size_t) mxGetScalar(prhs[2]);
+		trimCodeCache(codeCacheCapacity);
+	}
+	else
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+}
+
+// Seconds spent in each phase of starting the interpreter
+struct InitTimes
+{
+	double library, initialize, numpy;
+};
+
+static bool pythonStarted = false;
+
+// Starts the interpreter, loading library, or libpython2.7.so, with its
+// symbols global so that extension modules find them, and with home as
+// PYTHONHOME if given.
+static void startPython(const char *library, const char *home, InitTimes *times)
+{
+	if (debug) mexPrintf("Initializing...\n");
+	StatsClock::time_point start = StatsClock::now();
+	if (dlopen(library != NULL ? library : "libpython2.7.so", RTLD_LAZY | RTLD_GLOBAL) == NULL && library != NULL) {
+		matpyError("matpy:InitError", "Could not load %s: %s", library, dlerror());
+	}
+	StatsClock::time_point loaded = StatsClock::now();
+
+	// Python keeps the pointers
+	static std::string pythonHome;
+	if (home != NULL) {
+		pythonHome = home;
+		Py_SetPythonHome(&pythonHome[0]);
+	}
+	Py_SetProgramName((char*)PYPATH);
+	Py_Initialize();
+	PyEval_InitThreads();
+	matlabThread = std::this_thread::get_id();
+	initMatpyPrint();
+	initMatpyModule();
+	initMatlabModule();
+	module = PyImport_AddModule("__main__");
+	if (NULL == module) 
+	{
+		PyErr_Print();
+		matpyError("matpy:NumpyNotAccessible", "numpy not accessible");
+	}
+	globals = mainGlobals = PyModule_GetDict(module);
+	callableCache = PyDict_New();
+	StatsClock::time_point initialized = StatsClock::now();
+
+	PyObject *numpy = PyImport_ImportModule("numpy");
+	if (numpy == NULL) {
+		PyErr_Print();
+		matpyError("matpy:NumpyNotAccessible", "numpy not accessible");
+	}
+	PyObject *numpy_dict = PyModule_GetDict(numpy);
+	Py_DECREF(numpy);
+	if (debug) mexPrintf("numpy_dict = 0x%08X\n", numpy_dict);
+	ndarray_cls = PyDict_GetItemString(numpy_dict, "ndarray");
+	if (_import_array() < 0) {
+		PyErr_Print();
+		matpyError("matpy:NumpyNotAccessible", "numpy C API not accessible");
+	}
+	initTypeConversions();
+	// Exported arrays free their MATLAB data through this MEX file, so
+	// it must stay loaded for as long as the interpreter is alive.
+	mexLock();
+	pythonStarted = true;
+
+	if (times != NULL) {
+		times->library = seconds(start, loaded);
+		times->initialize = seconds(loaded, initialized);
+		times->numpy = seconds(initialized, StatsClock::now());
+	}
+}
+
+// Returns the strings held by a char row or a cell array of them.
+static std::vector<std::string> getStrings(const mxArray *a, const char *name)
+{
+	std::vector<std::string> strings;
+	size_t n = a == NULL ? 0 : mxIsCell(a) ? mxGetNumberOfElements(a) : 1;
+	for (size_t i = 0; i < n; i++) {
+		const mxArray *item = mxIsCell(a) ? mxGetCell(a, i) : a;
+		if (!isCharRow(item)) {
+			matpyError("matpy:WrongOptionValue", "Option '%s' must be a string or a cell array of strings", name);
+		}
+		char *str = mxArrayToString(item);
+		strings.push_back(str);
+		mxFree(str);
+	}
+	return strings;
+}
+
+static void do_init()
+{
+	const char *usage = "Usage: times = py('init', struct('library', file, 'home', dir, 'path', {dirs}, 'modules', {names}, 'native', false))";
+	static const char *const known[] = {"library", "home", "path", "modules", "native", NULL};
+	const mxArray *opts = nrhs == 2 ? prhs[1] : NULL;
+	if (nrhs > 2 || (opts != NULL && !(mxIsStruct(opts) && mxGetNumberOfElements(opts) == 1)))
+	{
+		matpyError("matpy:WrongInputVariableType", usage);
+	}
+	for (int i = 0; opts != NULL && i < mxGetNumberOfFields(opts); i++)
+	{
+		bool found = false;
+		for (int k = 0; known[k] != NULL && !found; k++)
+		{
+			found = !strcmp(mxGetFieldNameByNumber(opts, i), known[k]);
+		}
+		if (!found)
+		{
+			matpyError("matpy:UnrecognizedOption", usage);
+		}
+	}
+	std::vector<std::string> library = getStrings(opts == NULL ? NULL : mxGetField(opts, 0, "library"), "library");
+	std::vector<std::string> home = getStrings(opts == NULL ? NULL : mxGetField(opts, 0, "home"), "home");
+	std::vector<std::string> path = getStrings(opts == NULL ? NULL : mxGetField(opts, 0, "path"), "path");
+	std::vector<std::string> modules = getStrings(opts == NULL ? NULL : mxGetField(opts, 0, "modules"), "modules");
+	if (library.size() > 1 || home.size() > 1)
+	{
+		matpyError("matpy:WrongOptionValue", "Options 'library' and 'home' take a single string");
+	}
+	const mxArray *native = opts == NULL ? NULL : mxGetField(opts, 0, "native");
+	if (native != NULL && (!(mxIsLogical(native) || mxIsNumeric(native)) || mxGetNumberOfElements(native) != 1))
+	{
+		matpyError("matpy:WrongOptionValue", "Option 'native' must be a logical scalar");
+	}
+
+	StatsClock::time_point start = StatsClock::now();
+	InitTimes times = {0, 0, 0};
+	if (pythonStarted && (!library.empty() || !home.empty()))
+	{
+		matpyError("matpy:AlreadyInitialized", "Python is already running, 'library' and 'home' only apply before it starts");
+	}
+	if (!pythonStarted)
+	{
+		startPython(library.empty() ? NULL : library[0].c_str(), home.empty() ? NULL : home[0].c_str(), &times);
+	}
+
+	if (native != NULL)
+	{
+		nativeDefault = mxGetScalar(native) != 0;
+	}
+
+	// Entries go to the front of sys.path, in the order given
+	StatsClock::time_point pathStart = StatsClock::now();
+	PyObject *sysPath = PySys_GetObject((char*) "path");
+	for (size_t i = path.size(); i-- > 0; )
+	{
+		PyObject *dir = PyString_FromString(path[i].c_str());
+		if (sysPath == NULL || PyList_Insert(sysPath, 0, dir) < 0)
+		{
+			Py_DECREF(dir);
+			PyErr_Print();
+			matpyError("matpy:PythonError", "Could not add %s to sys.path", path[i].c_str());
+		}
+		Py_DECREF(dir);
+	}
+
+	// Each module is imported and bound to its top level name, as import
+	// would
+	StatsClock::time_point modulesStart = StatsClock::now();
+	for (size_t i = 0; i < modules.size(); i++)
+	{
+		PyObject *imported = PyImport_ImportModule(modules[i].c_str());
+		std::string top = modules[i].substr(0, modules[i].find('.'));
+		PyObject *topModule = imported == NULL ? NULL : PyImport_ImportModule(top.c_str());
+		Py_XDECREF(imported);
+		if (topModule == NULL || PyDict_SetItemString(globals, top.c_str(), topModule) < 0)
+		{
+			Py_XDECREF(topModule);
+			PyErr_Print();
+			matpyError("matpy:PythonError", "Could not import %s", modules[i].c_str());
+		}
+		Py_DECREF(topModule);
+	}
+	StatsClock::time_point end = StatsClock::now();
+
+	if (nlhs > 0)
+	{
+		const char *fields[] = {"library", "initialize", "numpy", "path", "modules", "total"};
+		plhs[0] = mxCreateStructMatrix(1, 1, 6, fields);
+		mxSetFieldByNumber(plhs[0], 0, 0, mxCreateDoubleScalar(times.library));
+		mxSetFieldByNumber(plhs[0], 0, 1, mxCreateDoubleScalar(times.initialize));
+		mxSetFieldByNumber(plhs[0], 0, 2, mxCreateDoubleScalar(times.numpy));
+		mxSetFieldByNumber(plhs[0], 0, 3, mxCreateDoubleScalar(seconds(pathStart, modulesStart)));
+		mxSetFieldByNumber(plhs[0], 0, 4, mxCreateDoubleScalar(seconds(modulesStart, end)));
+		mxSetFieldByNumber(plhs[0], 0, 5, mxCreateDoubleScalar(seconds(start, end)));
+	}
+}
+
+// Returns the globals dict of the namespace named by the string a, creating
+// it if asked to. __main__ is the namespace commands run in by default.
+static PyObject *getNamespace(const mxArray *a, bool create)
+{
+	if (!isCharRow(a) || mxIsEmpty(a))
+	{
+		matpyError("matpy:WrongOptionValue", "A namespace name must be a non-empty string");
+	}
+	char *str = mxArrayToString(a);
+	std::string name = str;
+	mxFree(str);
+	if (name == "__main__")
+	{
+		return mainGlobals;
+	}
+
+	std::map<std::string, PyObject*>::iterator it = namespaces.find(name);
+	if (it != namespaces.end())
+	{
+		return it->second;
+	}
+	if (!create)
+	{
+		matpyError("matpy:UnknownNamespace", "There is no namespace '%s'", name.c_str());
+	}
+	PyObject *dict = PyDict_New();
+	PyObject *dictName = PyString_FromString(name.c_str());
+	PyDict_SetItemString(dict, "__builtins__", PyEval_GetBuiltins());
+	PyDict_SetItemString(dict, "__name__", dictName);
+	Py_DECREF(dictName);
+	namespaces[name] = dict;
+	return dict;
+}
+
+// Names like __builtins__ belong to the namespace rather than to the user.
+static bool isSpecialName(PyObject *key)
+{
+	return PyString_Check(key) && !strncmp(PyString_AS_STRING(key), "__", 2);
+}
+
+// py('clear', ns) drops every variable of a namespace, and a named namespace
+// itself; py('clear', ns, names) only the variables in names. Either way
+// Python then collects what was only reachable through them. Clearing
+// __main__ keeps its imported modules, which are code rather than data, so
+// statements that use them keep working.
+static void do_clear()
+{
+	const char *usage = "Usage: py('clear', ns) or py('clear', ns, names)";
+	if (nrhs != 2 && nrhs != 3)
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+	PyObject *dict = getNamespace(prhs[1], false);
+
+	if (nrhs == 3)
+	{
+		std::vector<std::string> names = getStrings(prhs[2], "names");
+		for (size_t i = 0; i < names.size(); i++)
+		{
+			if (PyDict_DelItemString(dict, names[i].c_str()) < 0)
+			{
+				PyErr_Clear();
+			}
+		}
+	}
+	else if (dict == mainGlobals)
+	{
+		PyObject *keys = PyDict_Keys(dict);
+		for (Py_ssize_t i = 0; i < PyList_GET_SIZE(keys); i++)
+		{
+			PyObject *key = PyList_GET_ITEM(keys, i);
+			PyObject *value = PyDict_GetItem(dict, key);
+			if (!isSpecialName(key) && (value == NULL || !PyModule_Check(value)))
+			{
+				PyDict_DelItem(dict, key);
+			}
+		}
+		Py_DECREF(keys);
+	}
+	else
+	{
+		char *name = mxArrayToString(prhs[1]);
+		namespaces.erase(name);
+		mxFree(name);
+		// Clearing first breaks the cycles through functions defined in it
+		PyDict_Clear(dict);
+		Py_DECREF(dict);
+	}
+	PyGC_Collect();
+}
+
+// Returns an estimate of the bytes held by o and whatever it references that
+// was not counted yet: ndarray data by nbytes, once per buffer, containers
+// and instance dicts with their items and anything else by sys.getsizeof.
+// Modules, classes and functions are shared code, not data, and count as 0.
+static double objectBytes(PyObject *o, PyObject *getsizeof, std::set<PyObject*> &seen, int depth)
+{
+	if (depth > 100 || !seen.insert(o).second || PyModule_Check(o) || PyType_Check(o) || PyClass_Check(o)
+		|| PyFunction_Check(o) || PyCFunction_Check(o) || PyMethod_Check(o))
+	{
+		return 0;
+	}
+	if (PyArray_Check(o))
+	{
+		// Views count the array they look into instead
+		PyObject *base = PyArray_BASE((PyArrayObject*) o);
+		if (base != NULL && PyArray_Check(base))
+		{
+			return objectBytes(base, getsizeof, seen, depth + 1);
+		}
+		return (double) PyArray_NBYTES((PyArrayObject*) o);
+	}
+
+	double bytes = 0;
+	PyObject *size = PyObject_CallFunctionObjArgs(getsizeof, o, NULL);
+	if (size != NULL)
+	{
+		bytes = PyFloat_AsDouble(size);
+		Py_DECREF(size);
+	}
+	PyErr_Clear();
+
+	if (PyList_Check(o) || PyTuple_Check(o))
+	{
+		for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(o); i++)
+		{
+			bytes += objectBytes(PySequence_Fast_GET_ITEM(o, i), getsizeof, seen, depth + 1);
+		}
+	}
+	else if (PyDict_Check(o))
+	{
+		PyObject *key, *value;
+		Py_ssize_t pos = 0;
+		while (PyDict_Next(o, &pos, &key, &value))
+		{
+			bytes += objectBytes(key, getsizeof, seen, depth + 1) + objectBytes(value, getsizeof, seen, depth + 1);
+		}
+	}
+	else
+	{
+		PyObject **dict = _PyObject_GetDictPtr(o);
+		if (dict != NULL && *dict != NULL)
+		{
+			bytes += objectBytes(*dict, getsizeof, seen, depth + 1);
+		}
+	}
+	return bytes;
+}
+
+struct VariableBytes
+{
+	std::string name;
+	std::string type;
+	double bytes;
+};
+
+// Adds the namespace with its total bytes and the variables of at least
+// minBytes, largest first, to the py('memory') report s.
+static void reportNamespace(mxArray *s, size_t index, const std::string &name, PyObject *dict, double minBytes, PyObject *getsizeof)
+{
+	std::set<PyObject*> seen;
+	std::vector<VariableBytes> variables;
+	double total = 0;
+	// Arrays that own their data go first, so that a view of one is not
+	// charged with the memory instead
+	for (int pass = 0; pass < 2; pass++)
+	{
+		PyObject *key, *value;
+		Py_ssize_t pos = 0;
+		while (PyDict_Next(dict, &pos, &key, &value))
+		{
+			bool owner = PyArray_Check(value) && (PyArray_BASE((PyArrayObject*) value) == NULL
+				|| !PyArray_Check(PyArray_BASE((PyArrayObject*) value)));
+			if (isSpecialName(key) || owner != (pass == 0))
+			{
+				continue;
+			}
+			double bytes = objectBytes(value, getsizeof, seen, 0);
+			total += bytes;
+			if (bytes >= minBytes && PyString_Check(key))
+			{
+				VariableBytes variable = {PyString_AS_STRING(key), Py_TYPE(value)->tp_name, bytes};
+				variables.push_back(variable);
+			}
+		}
+	}
+	std::sort(variables.begin(), variables.end(), [](const VariableBytes &a, const VariableBytes &b) { return a.bytes > b.bytes; });
+
+	const char *fields[] = {"name", "type", "bytes"};
+	mxArray *vars = mxCreateStructMatrix(variables.size(), 1, 3, fields);
+	for (size_t i = 0; i < variables.size(); i++)
+	{
+		mxSetFieldByNumber(vars, i, 0, mxCreateString(variables[i].name.c_str()));
+		mxSetFieldByNumber(vars, i, 1, mxCreateString(variables[i].type.c_str()));
+		mxSetFieldByNumber(vars, i, 2, mxCreateDoubleScalar(variables[i].bytes));
+	}
+	mxSetFieldByNumber(s, index, 0, mxCreateString(name.c_str()));
+	mxSetFieldByNumber(s, index, 1, mxCreateDoubleScalar(total));
+	mxSetFieldByNumber(s, index, 2, vars);
+}
+
+// report = py('memory', minBytes) returns a struct per namespace with the
+// bytes its variables hold, and the variables holding at least minBytes
+// (default 1 MiB).
+static void do_memory()
+{
+	const char *usage = "Usage: report = py('memory') or py('memory', minBytes)";
+	if (nrhs > 2 || (nrhs == 2 && (!mxIsNumeric(prhs[1]) || mxGetNumberOfElements(prhs[1]) != 1)))
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+	double minBytes = nrhs == 2 ? mxGetScalar(prhs[1]) : 1 << 20;
+	PyObject *getsizeof = PySys_GetObject((char*) "getsizeof");
+
+	const char *fields[] = {"namespace", "bytes", "variables"};
+	plhs[0] = mxCreateStructMatrix(namespaces.size() + 1, 1, 3, fields);
+	reportNamespace(plhs[0], 0, "__main__", mainGlobals, minBytes, getsizeof);
+	size_t index = 1;
+	for (std::map<std::string, PyObject*>::iterator it = namespaces.begin(); it != namespaces.end(); ++it)
+	{
+		reportNamespace(plhs[0], index++, it->first, it->second, minBytes, getsizeof);
+	}
+}
+
+// Compiles src with mode through the code cache and runs it in the global
+// namespace. Returns a new reference to the result.
+static PyObject *runPython(const char *src, int mode)
+{
+	if (debug) mexPrintf("Evaluating: %s\n", src);
+	PyCodeObject *code = compileCached(src, mode);
+	if (code == NULL) 
+	{
+		PyErr_Print();
+		matpyError("matpy:PythonError", mode == Py_eval_input ? "Error compiling expression" : "Error while evaluating Python statement");
+	}
+
+	PyObject *o;
+	{
+		PhaseTimer timer(PHASE_EXECUTE);
+		o = PyEval_EvalCode(code, globals, globals);
+	}
+	Py_DECREF(code);
+	if (o == NULL) 
+	{
+		PyErr_Print();
+		matpyError("matpy:PythonError", mode == Py_eval_input ? "Error evaluating Python expression" : "Error while evaluating Python statement");
+	}
+	return o;
+}
+
+static mxArray *getExpression(const char *expr)
+{
+	mxArray *a = py2mat(runPython(expr, Py_eval_input));
+	if (a == NULL) {
+		matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+	}
+	return a;
+}
+
+static void setVariable(const char *name, const mxArray *value)
+{
+	PyObject *var = mat2py(value);
+	if (NULL == var)
+	{
+		matpyError("matpy:ExportError", "Error while export to Python");
+	}
+	addVariableToPython(name, var);
+}
+
+static void do_get() 
+{
+    static const char *const options[] = {"cell", NULL};
+    static const char *const cellModes[] = {"lists", "packed", NULL};
+
+    if(nrhs < 2) 
+    {
+        matpyError("matpy:WrongNumberOfInputs", "Usage: var = py('get', expr, 'cell', 'lists' | 'packed')");
+    }
+    if(!mxIsChar(prhs[1])) 
+    {
+        matpyError("matpy:WrongInputVariableType", "Usage: var = py('get', expr, 'cell', 'lists' | 'packed')");
+    }
+    if(nlhs != 1) 
+    {
+        matpyError("matpy:NoOutputsVariable", "Usage: var = py('get', expr, 'cell', 'lists' | 'packed')");
+    }
+    checkOptions(2, options, "Usage: var = py('get', expr, 'cell', 'lists' | 'packed')");
+    importOptions.packLists = getChoiceOption(2, "cell", cellModes, 0) == 1;
+
+	char *expr = mxArrayToString(prhs[1]);
+	plhs[0] = getExpression(expr);
+	mxFree(expr);
+}
+
+static void do_set() 
+{
+    static const char *const options[] = {"copy", "lossy", "struct", "cell", "native", NULL};
+    static const char *const structModes[] = {"lists", "columns", "records", NULL};
+    static const char *const cellModes[] = {"lists", "packed", NULL};
+    
+    if(nrhs < 3) 
+    {
+        matpyError("matpy:WrongNumberOfInputs", "Usage: py('set', var_name, var, 'copy', false, 'lossy', false, 'struct', 'lists' | 'columns' | 'records', 'cell', 'lists' | 'packed', 'native', false)");
+    }
+    if(!mxIsChar(prhs[1])) 
+    {
+        matpyError("matpy:WrongInputVariableType", "Usage: py('set', var_name, var, 'copy', false, 'lossy', false, 'struct', 'lists' | 'columns' | 'records', 'cell', 'lists' | 'packed', 'native', false)");
+    }
+    checkOptions(3, options, "Usage: py('set', var_name, var, 'copy', false, 'lossy', false, 'struct', 'lists' | 'columns' | 'records', 'cell', 'lists' | 'packed', 'native', false)");
+    exportOptions.copy = getBoolOption(3, "copy", false);
+    exportOptions.lossy = getBoolOption(3, "lossy", false);
+    exportOptions.structMode = (ExportOptions::StructMode) getChoiceOption(3, "struct", structModes, ExportOptions::STRUCT_LISTS);
+    exportOptions.cellMode = (ExportOptions::CellMode) getChoiceOption(3, "cell", cellModes, ExportOptions::CELL_LISTS);
+    exportOptions.native = getBoolOption(3, "native", nativeDefault);
+
+	char *var_name = mxArrayToString(prhs[1]);
+	setVariable(var_name, prhs[2]);
+	mxFree(var_name);
+}
+
+static void do_eval() 
+{
+    
+    if(nrhs != 2) 
+    {
+        matpyError("matpy:WrongNumberOfInputs", "Usage: py('eval', stmt)");
+    }
+    if(!mxIsChar(prhs[1])) 
+    {
+        matpyError("matpy:WrongInputVariableType", "Usage: py('eval', stmt)");
+    }
+
+	char *stmt = mxArrayToString(prhs[1]);
+	PyObject *o = runPython(stmt, Py_file_input);
+	mxFree(stmt);
+
+	if (nlhs > 0 && o == Py_None)
+	{
+		// Statements evaluate to None
 		Py_DECREF(o);
-		return a;
-	} else if (PyString_Check(o)) {
-		mxArray *a = mxCreateString(PyString_AsString(o));
+		plhs[0] = mxCreateDoubleMatrix(0, 0, mxREAL);
+	}
+	else if (nlhs > 0)
+	{
+		plhs[0] = py2mat(o);
+		if (plhs[0] == NULL) {
+			matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+		}
+	}
+	else
+	{
 		Py_DECREF(o);
-		return a;
-	} else if (PyObject_IsInstance(o, ndarray_cls)) {
-		PyObject *shape = PyObject_GetAttrString(o, "shape");
-		PyObject *dtype = PyObject_GetAttrString(o, "dtype");
-		PyObject *dtype_as_str = PyObject_Str(dtype);
-		Py_DECREF(dtype);
-		char *dtype_str = PyString_AsString(dtype_as_str);
-		mwSize ndims = PySequence_Size(shape);
-		mwSize *dims = new mwSize[ndims];
-		mwSize nelem = 1;
-		for (int i = 0; i < ndims; i++) {
-			PyObject *item = PySequence_GetItem(shape, i);
-			dims[i] = PyInt_AsLong(item);
-			Py_DECREF(item);
-			nelem *= dims[i];
-		}
-		Py_DECREF(shape);
-		if (debug) mexPrintf("ndims = %d, dims[0] = %d, dims[1] = %d, dtype = %s\n", ndims, dims[0], ndims > 1 ? dims[1] : 1, dtype_str);
-
-		PyObject *lin_shape = PyList_New(1);
-		PyList_SetItem(lin_shape, 0, PyInt_FromLong(nelem));
-		PyObject *reshape_meth = PyObject_GetAttrString(o, "reshape");
-		PyObject *args = PyTuple_New(1);
-		PyObject *kwargs = PyDict_New();
-		PyTuple_SetItem(args, 0, lin_shape);
-		PyDict_SetItemString(kwargs, "order", PyString_FromString("F"));
-		PyObject *reshaped = PyObject_Call(reshape_meth, args, kwargs);
-		Py_DECREF(args);
-		Py_DECREF(kwargs);
-		Py_DECREF(reshape_meth);
-		// PyObject *reshaped = PyObject_CallMethod(o, "reshape", "O", lin_shape);
+	}
+}
+
+// Resolves a dotted name such as 'numpy.linalg.svd' to a new reference to
+// the object it names. The first component is looked up in the global
+// namespace, then among the builtins and finally imported as a module.
+// Names that do not start with a global are cached, so redefining a global
+// function is always picked up.
+static PyObject *resolveCallable(const char *name)
+{
+	std::string path(name);
+	std::string first = path.substr(0, path.find('.'));
+
+	PyObject *obj = PyDict_GetItemString(globals, first.c_str());
+	bool cache = obj == NULL;
+	if (obj != NULL) {
+		Py_INCREF(obj);
+	} else {
+		obj = PyDict_GetItemString(callableCache, name);
+		if (obj != NULL) {
+			Py_INCREF(obj);
+			return obj;
+		}
+		obj = PyDict_GetItemString(PyEval_GetBuiltins(), first.c_str());
+		if (obj != NULL) {
+			Py_INCREF(obj);
+		} else {
+			obj = PyImport_ImportModule(first.c_str());
+		}
+	}
+
+	size_t start = first.size();
+	while (obj != NULL && start < path.size()) {
+		size_t end = path.find('.', start + 1);
+		std::string attr = path.substr(start + 1, end == std::string::npos ? std::string::npos : end - start - 1);
+		PyObject *next = PyObject_GetAttrString(obj, attr.c_str());
+		if (next == NULL && PyModule_Check(obj)) {
+			// Submodules are only attributes once they have been imported
+			PyErr_Clear();
+			next = PyImport_ImportModule(path.substr(0, end).c_str());
+		}
+		Py_DECREF(obj);
+		obj = next;
+		start = end == std::string::npos ? path.size() : end;
+	}
+
+	if (obj == NULL) {
+		PyErr_Print();
+		matpyError("matpy:PythonError", "Could not resolve '%s'", name);
+	}
+	if (cache) {
+		PyDict_SetItemString(callableCache, name, obj);
+	}
+	return obj;
+}
+
+// Calls a Python callable with MATLAB arguments. A trailing 'kw', struct pair
+// is passed as keyword arguments. With several outputs the returned sequence
+// is spread over them.
+static void do_call()
+{
+	const char *usage = "Usage: [out1, ...] = py('call', 'module.func', arg1, ..., 'kw', struct(...))";
+	if (nrhs < 2)
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+	if (!mxIsChar(prhs[1]))
+	{
+		matpyError("matpy:WrongInputVariableType", usage);
+	}
+
+	int nargs = nrhs - 2;
+	const mxArray *kw = NULL;
+	if (nargs >= 2 && isOption(prhs[nrhs - 2], "kw") && mxIsStruct(prhs[nrhs - 1]))
+	{
+		kw = prhs[nrhs - 1];
+		nargs -= 2;
+		if (mxGetNumberOfElements(kw) != 1)
+		{
+			matpyError("matpy:WrongInputVariableType", "Keyword arguments must be a scalar struct");
+		}
+	}
+
+	char *name = mxArrayToString(prhs[1]);
+	PyOwned callable(resolveCallable(name));
+	mxFree(name);
+
+	PyOwned args(PyTuple_New(nargs));
+	for (int i = 0; i < nargs; i++)
+	{
+		PyTuple_SET_ITEM(args.get(), i, mat2py(prhs[i + 2]));
+	}
+	PyOwned kwargs;
+	if (kw != NULL)
+	{
+		kwargs.reset(PyDict_New());
+		for (int i = 0; i < mxGetNumberOfFields(kw); i++)
+		{
+			PyOwned value(mat2py(mxGetFieldByNumber(kw, 0, i)));
+			PyDict_SetItemString(kwargs, mxGetFieldNameByNumber(kw, i), value);
+		}
+	}
+
+	PyObject *result;
+	{
+		PhaseTimer timer(PHASE_EXECUTE);
+		result = PyObject_Call(callable, args, kwargs);
+	}
+	if (result == NULL)
+	{
+		PyErr_Print();
+		matpyError("matpy:PythonError", "Error calling Python function");
+	}
+
+	if (nlhs <= 1)
+	{
+		if (nlhs == 1 || result != Py_None)
+		{
+			plhs[0] = py2mat(result);
+		}
+		else
+		{
+			Py_DECREF(result);
+		}
+		return;
+	}
+
+	PyOwned results(result);
+	if (!PySequence_Check(result) || PySequence_Size(result) < nlhs)
+	{
+		PyErr_Clear();
+		matpyError("matpy:NoOutputsVariable", "Python function returned fewer than %d values", nlhs);
+	}
+	for (int i = 0; i < nlhs; i++)
+	{
+		plhs[i] = py2mat(PySequence_GetItem(result, i));
+	}
+}
+
+// h = py('ref', expr) evaluates expr and keeps the result in Python,
+// returning a PyRef handle to it.
+static void do_ref()
+{
+	const char *usage = "Usage: h = py('ref', expr)";
+	if (nrhs != 2)
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+	if (!mxIsChar(prhs[1]))
+	{
+		matpyError("matpy:WrongInputVariableType", usage);
+	}
+
+	char *expr = mxArrayToString(prhs[1]);
+	PyObject *o = runPython(expr, Py_eval_input);
+	mxFree(expr);
+
+	uint64_t id = nextHandleId++;
+	handles[id] = o;
+
+	mxArray *idArray = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
+	*(uint64_t*) mxGetData(idArray) = id;
+	mxArray *exception;
+	{
+		// PyRef.delete of a handle MATLAB clears meanwhile is queued rather
+		// than re-entering this command
+		CallbackScope scope;
+		exception = mexCallMATLABWithTrap(1, plhs, 1, &idArray, "PyRef");
+	}
+	mxDestroyArray(idArray);
+	if (callbackDepth == 0)
+	{
+		releasePendingHandles();
+	}
+	if (exception != NULL)
+	{
+		handles.erase(id);
 		Py_DECREF(o);
-		PyObject *list = PyObject_CallMethod(reshaped, (char *)"tolist", NULL);
-		Py_DECREF(reshaped);
+		matpyError("matpy:InvalidHandle", "Could not create a PyRef, is PyRef.m on the path?");
+	}
+}
 
-		mxArray *a = NULL;
-#undef CASE
-#define CASE(str,c_type,cls,ctor) \
-	if (!strcmp(dtype_str,str)) { \
-		a = mxCreateNumericArray(ndims, dims, cls, mxREAL); \
-		c_type *data = (c_type*) mxGetData(a); \
-		for (size_t i = 0; i < nelem; i++) { \
-			PyObject *item = PySequence_GetItem(list, i); \
-			*data++ = (c_type) ctor(item); \
-			Py_DECREF(item); \
-		} \
-	}
-		CASE("bool", bool, mxLOGICAL_CLASS, PyInt_AsLong) else
-		CASE("float32", float, mxSINGLE_CLASS, PyFloat_AsDouble) else
-		CASE("float64", double, mxDOUBLE_CLASS, PyFloat_AsDouble)
-		CASE("int8", char, mxINT8_CLASS, PyInt_AsLong) else
-		CASE("uint8", unsigned char, mxUINT8_CLASS, PyInt_AsLong) else
-		CASE("int16", short, mxINT16_CLASS, PyInt_AsLong) else
-		CASE("uint16", unsigned short, mxUINT16_CLASS, PyInt_AsLong) else
-		CASE("int32", int, mxINT32_CLASS, PyInt_AsLong) else
-		CASE("uint32", unsigned int, mxUINT32_CLASS, PyInt_AsUnsignedLongMask) else
-		CASE("int64", long long, mxINT64_CLASS, PyLong_AsLongLong) else
-		CASE("uint64", unsigned long long, mxUINT64_CLASS, PyLong_AsUnsignedLongLong) else
+static void do_deref()
+{
+	if (nrhs != 2)
+	{
+		matpyError("matpy:WrongNumberOfInputs", "Usage: var = py('deref', h)");
+	}
+	plhs[0] = py2mat(derefHandle(prhs[1]));
+	if (plhs[0] == NULL)
+	{
+		matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+	}
+}
 
-#undef CASE
-#define CASE(str,c_type,cls) \
-	if (!strcmp(dtype_str,str)) { \
-		a = mxCreateNumericArray(ndims, dims, cls, mxCOMPLEX); \
-		c_type *data = (c_type*) mxGetData(a); \
-		c_type *imagData = (c_type*) mxGetImagData(a); \
-		for (int i = 0; i < nelem; i++) { \
-			PyObject *item = PySequence_GetItem(list, i); \
-			*data++ = (c_type) PyComplex_RealAsDouble(item); \
-			*imagData++ = (c_type) PyComplex_ImagAsDouble(item); \
-			Py_DECREF(item); \
-		} \
+// Releases the Python object of a handle. Releasing a handle twice is
+// harmless, PyRef's destructor relies on that.
+static void do_release()
+{
+	if (nrhs != 2)
+	{
+		matpyError("matpy:WrongNumberOfInputs", "Usage: py('release', h)");
 	}
-		CASE("complex64", float, mxSINGLE_CLASS) else
-		CASE("complex128", double, mxDOUBLE_CLASS);
+	releaseHandle(getHandleId(prhs[1]));
+}
 
-		Py_DECREF(list);
-		Py_DECREF(dtype_as_str);
+// Converts a MATLAB index argument for an axis of length n into byte
+// offsets along that axis. ':' selects the whole axis. Indices are 1-based
+// like in MATLAB, so 0 is out of range rather than the last element.
+template <typename T>
+static void readIndices(const mxArray *idx, npy_intp n, npy_intp stride, std::vector<npy_intp> &offsets)
+{
+	const T *values = (const T*) mxGetData(idx);
+	size_t count = mxGetNumberOfElements(idx);
+	offsets.resize(count);
+	for (size_t i = 0; i < count; i++) {
+		double v = (double) values[i];
+		npy_intp k = (npy_intp) v;
+		if (k != v) {
+			matpyError("matpy:IndexOutOfRange", "Indices must be integers");
+		}
+		if (k < 1 || k > n) {
+			matpyError("matpy:IndexOutOfRange", "Index %g is out of range for an axis of length %lld", v, (long long) n);
+		}
+		offsets[i] = (k - 1) * stride;
+	}
+}
 
-		if (a == NULL) {
-			mexErrMsgIdAndTxt("matpy:UnsupportedVariableType", "Unsupported variable type");
+static void parseIndex(const mxArray *idx, npy_intp n, npy_intp stride, std::vector<npy_intp> &offsets)
+{
+	if (mxIsChar(idx)) {
+		if (!isOption(idx, ":")) {
+			matpyError("matpy:WrongInputVariableType", "Indices must be numeric or ':'");
+		}
+		offsets.resize(n);
+		for (npy_intp i = 0; i < n; i++) {
+			offsets[i] = i * stride;
 		}
+		return;
+	}
 
-		return a;
-	} else if (PySequence_Check(o)) {
-		mwSize nelem = PySequence_Size(o);
-		mwSize dims[] = {1, nelem};
-		mxArray *a = mxCreateCellArray(2, dims);
-		if (debug) mexPrintf("a = 0x%08X nelem = %d\n", a, nelem);
-		for (int i = 0; i < nelem; i++) {
-			PyObject *item = PySequence_GetItem(o, i);
-			mxArray *mat_item = py2mat(item);
-			if(mat_item == NULL)
-			{
-				Py_DECREF(o);
-				mexErrMsgIdAndTxt("matpy:ConversionError", "Error converting to MATLAB variable");
+	switch (mxGetClassID(idx)) {
+	case mxDOUBLE_CLASS: readIndices<double>(idx, n, stride, offsets); break;
+	case mxSINGLE_CLASS: readIndices<float>(idx, n, stride, offsets); break;
+	case mxINT8_CLASS: readIndices<signed char>(idx, n, stride, offsets); break;
+	case mxUINT8_CLASS: readIndices<unsigned char>(idx, n, stride, offsets); break;
+	case mxINT16_CLASS: readIndices<short>(idx, n, stride, offsets); break;
+	case mxUINT16_CLASS: readIndices<unsigned short>(idx, n, stride, offsets); break;
+	case mxINT32_CLASS: readIndices<int>(idx, n, stride, offsets); break;
+	case mxUINT32_CLASS: readIndices<unsigned int>(idx, n, stride, offsets); break;
+	case mxINT64_CLASS: readIndices<long long>(idx, n, stride, offsets); break;
+	case mxUINT64_CLASS: readIndices<unsigned long long>(idx, n, stride, offsets); break;
+	default:
+		matpyError("matpy:WrongInputVariableType", "Indices must be numeric or ':'");
+	}
+}
+
+// Visits the selected elements of a strided array in MATLAB's column-major
+// order, calling op(i, p) with the linear MATLAB index and the element's
+// address.
+template <typename Op>
+static void walkSlice(char *base, const std::vector<std::vector<npy_intp> > &offsets, Op op)
+{
+	size_t nd = offsets.size();
+	for (size_t a = 0; a < nd; a++) {
+		if (offsets[a].empty()) return;
+	}
+
+	const std::vector<npy_intp> &inner = offsets[0];
+	std::vector<size_t> pos(nd, 0);
+	size_t i = 0;
+	for (;;) {
+		char *p = base;
+		for (size_t a = 1; a < nd; a++) {
+			p += offsets[a][pos[a]];
+		}
+		for (size_t j = 0; j < inner.size(); j++) {
+			op(i++, p + inner[j]);
+		}
+
+		size_t a = 1;
+		for (; a < nd && ++pos[a] == offsets[a].size(); a++) {
+			pos[a] = 0;
+		}
+		if (a >= nd) break;
+	}
+}
+
+template <typename T>
+struct SliceCopyOut {
+	T *dst;
+	void operator()(size_t i, const char *p) const { dst[i] = *(const T*) p; }
+};
+
+template <typename T>
+struct SliceSplitOut {
+	T *re, *im;
+	void operator()(size_t i, const char *p) const { re[i] = ((const T*) p)[0]; im[i] = ((const T*) p)[1]; }
+};
+
+// step is 0 when a single value is written to every selected element
+template <typename T>
+struct SliceCopyIn {
+	const T *src;
+	size_t step;
+	void operator()(size_t i, char *p) const { *(T*) p = src[i * step]; }
+};
+
+template <typename T>
+struct SliceMergeIn {
+	const T *re, *im;
+	size_t step;
+	void operator()(size_t i, char *p) const { ((T*) p)[0] = re[i * step]; ((T*) p)[1] = im[i * step]; }
+};
+
+// Evaluates the array argument of getslice/setslice, which is an expression
+// or a PyRef, and checks that it is an ndarray with an element type MATLAB
+// has. Returns a new reference.
+static PyArrayObject *getSliceTarget(const mxArray *arg, mxClassID *cls, bool *isComplex)
+{
+	PyOwned o;
+	if (mxIsChar(arg)) {
+		char *expr = mxArrayToString(arg);
+		o.reset(runPython(expr, Py_eval_input));
+		mxFree(expr);
+	} else {
+		o.reset(derefHandle(arg));
+	}
+
+	if (!PyArray_Check(o)) {
+		matpyError("matpy:WrongInputVariableType", "Slices can only be taken from an ndarray");
+	}
+	PyArrayObject *ary = (PyArrayObject*) o.get();
+	if (!classFromDescr(PyArray_DESCR(ary), cls, isComplex) || !PyArray_ISNOTSWAPPED(ary) || !PyArray_ISALIGNED(ary)) {
+		matpyError("matpy:UnsupportedVariableType", "Unsupported variable type");
+	}
+	return (PyArrayObject*) o.release();
+}
+
+static void parseSliceIndices(PyArrayObject *ary, const mxArray **idx, int nidx, std::vector<std::vector<npy_intp> > &offsets)
+{
+	int nd = PyArray_NDIM(ary);
+	if (nidx != nd) {
+		matpyError("matpy:WrongNumberOfInputs", "Expected one index per dimension of the array (%d)", nd);
+	}
+	offsets.resize(nd);
+	for (int i = 0; i < nd; i++) {
+		parseIndex(idx[i], PyArray_DIMS(ary)[i], PyArray_STRIDES(ary)[i], offsets[i]);
+	}
+}
+
+// var = py('getslice', expr, idx1, idx2, ...) copies only the selected
+// elements of an ndarray straight from its strided memory into a new mxArray.
+static void do_getslice()
+{
+	const char *usage = "Usage: var = py('getslice', expr, idx1, idx2, ...)";
+	if (nrhs < 3)
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+
+	mxClassID cls;
+	bool isComplex;
+	// Released however the command ends, as a bad index throws
+	PyOwned owner((PyObject*) getSliceTarget(prhs[1], &cls, &isComplex));
+	PyArrayObject *ary = (PyArrayObject*) owner.get();
+	std::vector<std::vector<npy_intp> > offsets;
+	parseSliceIndices(ary, prhs + 2, nrhs - 2, offsets);
+
+	std::vector<mwSize> dims(std::max<size_t>(offsets.size(), 2), 1);
+	for (size_t i = 0; i < offsets.size(); i++) {
+		dims[i] = offsets[i].size();
+	}
+	mxArray *a = mxCreateUninitNumericArray(dims.size(), &dims[0], cls, isComplex ? mxCOMPLEX : mxREAL);
+
+	char *base = PyArray_BYTES(ary);
+	void *dst = mxGetData(a);
+	Py_BEGIN_ALLOW_THREADS
+#if !MX_HAS_INTERLEAVED_COMPLEX
+	if (isComplex && cls == mxSINGLE_CLASS) {
+		SliceSplitOut<float> op = {(float*) dst, (float*) mxGetImagData(a)};
+		walkSlice(base, offsets, op);
+	} else if (isComplex) {
+		SliceSplitOut<double> op = {(double*) dst, (double*) mxGetImagData(a)};
+		walkSlice(base, offsets, op);
+	} else
+#endif
+	switch (PyArray_ITEMSIZE(ary)) {
+	case 1: { SliceCopyOut<uint8_t> op = {(uint8_t*) dst}; walkSlice(base, offsets, op); break; }
+	case 2: { SliceCopyOut<uint16_t> op = {(uint16_t*) dst}; walkSlice(base, offsets, op); break; }
+	case 4: { SliceCopyOut<uint32_t> op = {(uint32_t*) dst}; walkSlice(base, offsets, op); break; }
+	case 8: { SliceCopyOut<uint64_t> op = {(uint64_t*) dst}; walkSlice(base, offsets, op); break; }
+	case 16: { SliceCopyOut<Complex128Bits> op = {(Complex128Bits*) dst}; walkSlice(base, offsets, op); break; }
+	}
+	Py_END_ALLOW_THREADS
+
+	plhs[0] = a;
+}
+
+// py('setslice', expr, idx1, idx2, ..., values) writes values into the
+// selected elements of an existing ndarray in place. values must have the
+// array's class and either one element per selected element or just one.
+static void do_setslice()
+{
+	const char *usage = "Usage: py('setslice', expr, idx1, idx2, ..., values)";
+	if (nrhs < 4)
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+
+	mxClassID cls;
+	bool isComplex;
+	PyOwned owner((PyObject*) getSliceTarget(prhs[1], &cls, &isComplex));
+	PyArrayObject *ary = (PyArrayObject*) owner.get();
+	std::vector<std::vector<npy_intp> > offsets;
+	parseSliceIndices(ary, prhs + 2, nrhs - 3, offsets);
+
+	const mxArray *values = prhs[nrhs - 1];
+	size_t count = 1;
+	for (size_t i = 0; i < offsets.size(); i++) {
+		count *= offsets[i].size();
+	}
+	if (!PyArray_ISWRITEABLE(ary)) {
+		matpyError("matpy:ReadOnlyArray", "The array is not writeable");
+	}
+	if (mxGetClassID(values) != cls || mxIsComplex(values) != isComplex || mxIsSparse(values)) {
+		matpyError("matpy:TypeMismatch", "Values must have the same class and complexity as the array");
+	}
+	if (mxGetNumberOfElements(values) != count && mxGetNumberOfElements(values) != 1) {
+		matpyError("matpy:SizeMismatch", "Expected %d values or a single value", (int) count);
+	}
+
+	char *base = PyArray_BYTES(ary);
+	const void *src = mxGetData(values);
+	size_t step = mxGetNumberOfElements(values) == 1 ? 0 : 1;
+	Py_BEGIN_ALLOW_THREADS
+#if !MX_HAS_INTERLEAVED_COMPLEX
+	if (isComplex && cls == mxSINGLE_CLASS) {
+		SliceMergeIn<float> op = {(const float*) src, (const float*) mxGetImagData(values), step};
+		walkSlice(base, offsets, op);
+	} else if (isComplex) {
+		SliceMergeIn<double> op = {(const double*) src, (const double*) mxGetImagData(values), step};
+		walkSlice(base, offsets, op);
+	} else
+#endif
+	switch (PyArray_ITEMSIZE(ary)) {
+	case 1: { SliceCopyIn<uint8_t> op = {(const uint8_t*) src, step}; walkSlice(base, offsets, op); break; }
+	case 2: { SliceCopyIn<uint16_t> op = {(const uint16_t*) src, step}; walkSlice(base, offsets, op); break; }
+	case 4: { SliceCopyIn<uint32_t> op = {(const uint32_t*) src, step}; walkSlice(base, offsets, op); break; }
+	case 8: { SliceCopyIn<uint64_t> op = {(const uint64_t*) src, step}; walkSlice(base, offsets, op); break; }
+	case 16: { SliceCopyIn<Complex128Bits> op = {(const Complex128Bits*) src, step}; walkSlice(base, offsets, op); break; }
+	}
+	Py_END_ALLOW_THREADS
+}
+
+// Reads the operation, its argument and, for 'set', its value from element i
+// of a cell array of cells or a struct array with fields op, arg and value.
+static void getBatchOp(const mxArray *ops, size_t i, const mxArray **op, const mxArray **arg, const mxArray **value)
+{
+	*op = *arg = *value = NULL;
+	if (mxIsCell(ops))
+	{
+		const mxArray *item = mxGetCell(ops, i);
+		if (item == NULL || !mxIsCell(item) || mxGetNumberOfElements(item) < 2 || mxGetNumberOfElements(item) > 3)
+		{
+			matpyError("matpy:WrongBatchOperation", "Each operation must be a cell {op, arg} or {'set', name, value}");
+		}
+		*op = mxGetCell(item, 0);
+		*arg = mxGetCell(item, 1);
+		*value = mxGetNumberOfElements(item) > 2 ? mxGetCell(item, 2) : NULL;
+	}
+	else
+	{
+		*op = mxGetField(ops, i, "op");
+		*arg = mxGetField(ops, i, "arg");
+		*value = mxGetFieldNumber(ops, "value") >= 0 ? mxGetField(ops, i, "value") : NULL;
+	}
+
+	if (*op == NULL || !mxIsChar(*op) || *arg == NULL || !mxIsChar(*arg))
+	{
+		matpyError("matpy:WrongBatchOperation", "Operation and argument must be strings");
+	}
+}
+
+// Jobs queued by py('eval_async', ...) and py('get_async', ...). They run one
+// after the other on a single worker thread, which takes the GIL through
+// PyGILState whenever the MATLAB thread is not running a command. Results
+// stay Python objects until py('wait', ...) converts them on the MATLAB
+// thread. The jobs and the queue are guarded by asyncMutex, which is always
+// taken after the GIL.
+struct AsyncJob
+{
+	enum State { QUEUED, RUNNING, DONE, FAILED };
+	State state;
+	std::string src;
+	int mode;
+	// New reference to the value of an expression once done
+	PyObject *result;
+	std::string error;
+	long threadId;
+	// New reference to the namespace the job runs in, until it has run
+	PyObject *globals;
+	// Cancelled while running; the worker forgets the job once it stops
+	bool discarded;
+};
+static std::mutex asyncMutex;
+static std::condition_variable asyncChanged;
+static std::map<uint64_t, AsyncJob> asyncJobs;
+static std::list<uint64_t> asyncQueue;
+static uint64_t nextAsyncId = 1;
+
+// Returns "Type: message" for the current Python exception and clears it.
+static std::string fetchErrorText()
+{
+	PyObject *type, *value, *traceback;
+	PyErr_Fetch(&type, &value, &traceback);
+	PyErr_NormalizeException(&type, &value, &traceback);
+	std::string text = type != NULL && PyType_Check(type) ? ((PyTypeObject*) type)->tp_name : "Error";
+	PyObject *str = value == NULL ? NULL : PyObject_Str(value);
+	if (str != NULL && PyString_Check(str) && PyString_GET_SIZE(str) > 0) {
+		text += std::string(": ") + PyString_AS_STRING(str);
+	}
+	Py_XDECREF(str);
+	Py_XDECREF(type);
+	Py_XDECREF(value);
+	Py_XDECREF(traceback);
+	PyErr_Clear();
+	return text;
+}
+
+static void asyncWorker()
+{
+	for (;;) {
+		{
+			std::unique_lock<std::mutex> lock(asyncMutex);
+			asyncChanged.wait(lock, [] { return !asyncQueue.empty(); });
+		}
+
+		PyGILState_STATE gil = PyGILState_Ensure();
+		AsyncJob *job = NULL;
+		uint64_t id = 0;
+		{
+			std::lock_guard<std::mutex> lock(asyncMutex);
+			// The job may have been cancelled while we waited for the GIL
+			if (!asyncQueue.empty()) {
+				id = asyncQueue.front();
+				job = &asyncJobs[id];
+				asyncQueue.pop_front();
+				job->state = AsyncJob::RUNNING;
+				job->threadId = PyThreadState_Get()->thread_id;
 			}
-			if (debug) mexPrintf("mat_item = 0x%08X\n", mat_item);
-			mxSetCell(a, i, mat_item);
 		}
-		Py_DECREF(o);
-		return a;
-	} else if(PyDict_Check(o)){
-		PyObject *keys = PyDict_Keys(o);
-		PyObject *items = PyDict_Values(o);
-		mwSize nfields = PyDict_Size(o);
-		mwSize nelem;
-		char **fieldNames = (char **)mxMalloc(nfields * sizeof(char *));
-		int i, j;
+		if (job == NULL) {
+			PyGILState_Release(gil);
+			continue;
+		}
+
+		StatsClock::time_point start = StatsClock::now();
+		PyCodeObject *code = compileCached(job->src.c_str(), job->mode);
+		PyObject *result = code == NULL ? NULL : PyEval_EvalCode(code, job->globals, job->globals);
+		Py_XDECREF(code);
+		Py_CLEAR(job->globals);
+		traceEvent(job->mode == Py_eval_input ? "get_async job" : "eval_async job", "async", start, StatsClock::now(), 2);
+		std::string error = result == NULL ? fetchErrorText() : std::string();
+		if (result != NULL && job->mode != Py_eval_input) {
+			Py_CLEAR(result);
+		}
+		{
+			std::lock_guard<std::mutex> lock(asyncMutex);
+			// A cancel that came too late must not interrupt the next job
+			Py_CLEAR(PyThreadState_Get()->async_exc);
+			if (job->discarded) {
+				Py_XDECREF(result);
+				asyncJobs.erase(id);
+			} else {
+				job->result = result;
+				job->error = error;
+				job->state = error.empty() ? AsyncJob::DONE : AsyncJob::FAILED;
+			}
+		}
+		asyncChanged.notify_all();
+		PyGILState_Release(gil);
+	}
+}
+
+static const char *asyncStateName(AsyncJob::State state)
+{
+	static const char *const names[] = {"queued", "running", "done", "failed"};
+	return names[state];
+}
+
+// Returns the id of the job named by prhs[1].
+static uint64_t getAsyncId(const char *usage)
+{
+	if (nrhs < 2 || !mxIsNumeric(prhs[1]) || mxGetNumberOfElements(prhs[1]) != 1)
+	{
+		matpyError("matpy:WrongInputVariableType", usage);
+	}
+	uint64_t id = mxIsUint64(prhs[1]) ? *(uint64_t*) mxGetData(prhs[1]) : (uint64_t) mxGetScalar(prhs[1]);
+	std::map<uint64_t, AsyncJob>::iterator job = asyncJobs.find(id);
+	if (job == asyncJobs.end() || job->second.discarded)
+	{
+		matpyError("matpy:InvalidFuture", "No Python job with id %llu, it may have been collected already", (unsigned long long) id);
+	}
+	return id;
+}
+
+// f = py('eval_async', stmt) and f = py('get_async', expr)
+static void do_async(int mode)
+{
+	const char *usage = mode == Py_eval_input ? "Usage: f = py('get_async', expr)" : "Usage: f = py('eval_async', stmt)";
+	if (nrhs != 2 || !mxIsChar(prhs[1]))
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+
+	if (!asyncWorkerStarted)
+	{
+		std::thread(asyncWorker).detach();
+		asyncWorkerStarted = true;
+	}
+
+	char *src = mxArrayToString(prhs[1]);
+	uint64_t id;
+	{
+		std::lock_guard<std::mutex> lock(asyncMutex);
+		id = nextAsyncId++;
+		AsyncJob job = {AsyncJob::QUEUED, src, mode, NULL, std::string(), 0, globals, false};
+		Py_INCREF(globals);
+		asyncJobs[id] = job;
+		asyncQueue.push_back(id);
+	}
+	mxFree(src);
+	asyncChanged.notify_all();
+
+	plhs[0] = mxCreateNumericMatrix(1, 1, mxUINT64_CLASS, mxREAL);
+	*(uint64_t*) mxGetData(plhs[0]) = id;
+}
 
-		for(i = 0; i < nfields; i++) {
-            if(!PyList_Check(PyList_GetItem(items, 0))) {
-                Py_DECREF(o);
-                Py_DECREF(keys);
-                Py_DECREF(items);
-                mexErrMsgIdAndTxt("matpy:IncorrectStructForm" ,"Dictionary must have a list of values for each field");
-            }
+// state = py('poll', f)
+static void do_poll()
+{
+	const char *usage = "Usage: state = py('poll', f)";
+	if (nrhs != 2)
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+	uint64_t id = getAsyncId(usage);
+	std::lock_guard<std::mutex> lock(asyncMutex);
+	plhs[0] = mxCreateString(asyncStateName(asyncJobs[id].state));
+}
 
-            if(i == 0)
-                nelem = PyList_Size(PyList_GetItem(items, 0));
+// var = py('wait', f, timeout) waits up to timeout seconds, forever without
+// one, for a job to finish and collects its result.
+static void do_wait()
+{
+	const char *usage = "Usage: var = py('wait', f, timeout)";
+	if (nrhs != 2 && nrhs != 3)
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+	uint64_t id = getAsyncId(usage);
+	double timeout = -1;
+	if (nrhs == 3)
+	{
+		if (!mxIsNumeric(prhs[2]) || mxGetNumberOfElements(prhs[2]) != 1 || mxGetScalar(prhs[2]) < 0)
+		{
+			matpyError("matpy:WrongOptionValue", "Timeout must be a non-negative number of seconds");
+		}
+		timeout = mxIsInf(mxGetScalar(prhs[2])) ? -1 : mxGetScalar(prhs[2]);
+	}
 
-			if(nelem != PyList_Size(PyList_GetItem(items, i))) {
-				Py_DECREF(o);
-				Py_DECREF(keys);
-				Py_DECREF(items);
-				mexErrMsgIdAndTxt("matpy:IncorrectStructForm" ,"Inconsistent number of elements");
-			}
+	AsyncJob job;
+	bool finished;
+	Py_BEGIN_ALLOW_THREADS
+	{
+		std::unique_lock<std::mutex> lock(asyncMutex);
+		AsyncJob &waited = asyncJobs[id];
+		std::function<bool()> done = [&] { return waited.state > AsyncJob::RUNNING; };
+		if (timeout < 0) {
+			asyncChanged.wait(lock, done);
+			finished = true;
+		} else {
+			finished = asyncChanged.wait_for(lock, std::chrono::duration<double>(timeout), done);
+		}
+		if (finished) {
+			job = waited;
+			asyncJobs.erase(id);
 		}
+	}
+	Py_END_ALLOW_THREADS
+	runDeferredWork();
 
-		if (debug) mexPrintf("nfields = %d, nelem = %d\n", nfields, nelem);
+	if (!finished)
+	{
+		matpyError("matpy:Timeout", "Python job %llu did not finish within %g seconds", (unsigned long long) id, timeout);
+	}
+	if (job.state == AsyncJob::FAILED)
+	{
+		matpyError("matpy:PythonError", "%s", job.error.c_str());
+	}
+	if (job.result == NULL)
+	{
+		if (nlhs > 0)
+		{
+			plhs[0] = mxCreateDoubleMatrix(0, 0, mxREAL);
+		}
+		return;
+	}
+	mxArray *a = py2mat(job.result);
+	if (a == NULL)
+	{
+		matpyError("matpy:ConversionError", "Error converting to MATLAB variable");
+	}
+	plhs[0] = a;
+}
 
-		for(i = 0; i < nfields; i++) {
-			PyObject *field = PyList_GetItem(keys, i);
-			fieldNames[i] = PyString_AsString(field);
+// py('cancel', f) forgets a job and releases its result, whatever its state,
+// so a job that is polled rather than waited for can be let go. A running job
+// is interrupted with a KeyboardInterrupt at its next Python bytecode, so a
+// long call into C code such as a NumPy routine finishes first, and the
+// worker forgets it when it stops.
+static void do_cancel()
+{
+	const char *usage = "Usage: py('cancel', f)";
+	if (nrhs != 2)
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
+	uint64_t id = getAsyncId(usage);
+	{
+		std::lock_guard<std::mutex> lock(asyncMutex);
+		AsyncJob &job = asyncJobs[id];
+		if (job.state == AsyncJob::RUNNING) {
+			job.discarded = true;
+			PyThreadState_SetAsyncExc(job.threadId, PyExc_KeyboardInterrupt);
+		} else {
+			if (job.state == AsyncJob::QUEUED) {
+				asyncQueue.remove(id);
+			}
+			Py_XDECREF(job.globals);
+			Py_XDECREF(job.result);
+			asyncJobs.erase(id);
 		}
+	}
+	asyncChanged.notify_all();
+}
 
-		mwSize dims[] = {1, nelem};
-		mxArray *a = mxCreateStructArray(2, dims, nfields, (const char**)fieldNames);
+// The pool of out-of-process workers is run by matpy_pool.py, which lives
+// next to this MEX file and is imported on first use.
+static PyObject *poolModule = NULL;
 
-		for(i = 0; i < nfields; i++) {
-			PyObject *item = PySequence_GetItem(items, i);
-			for(j = 0; j < nelem; j++) {
-				mxArray *mat_item = py2mat(PySequence_GetItem(item, j));
-				if(mat_item == NULL)
-				{
-					Py_DECREF(o);
-					mexErrMsgIdAndTxt("matpy:ConversionError", "Error converting to MATLAB variable");
-				}
-				if (debug) mexPrintf("mat_item = 0x%08X\n", mat_item);
-				mxSetFieldByNumber(a, j, i, mat_item);
+static PyObject *getPoolModule()
+{
+	if (poolModule == NULL)
+	{
+		Dl_info info;
+		if (dladdr((void*) &getPoolModule, &info) != 0 && info.dli_fname != NULL)
+		{
+			std::string path(info.dli_fname);
+			size_t slash = path.find_last_of('/');
+			PyObject *dir = PyString_FromString(slash == std::string::npos ? "." : path.substr(0, slash).c_str());
+			PyObject *sysPath = PySys_GetObject((char*) "path");
+			if (sysPath != NULL && PySequence_Contains(sysPath, dir) == 0)
+			{
+				PyList_Insert(sysPath, 0, dir);
 			}
+			Py_DECREF(dir);
+		}
+		poolModule = PyImport_ImportModule("matpy_pool");
+		if (poolModule == NULL)
+		{
+			std::string error = fetchErrorText();
+			matpyError("matpy:PoolError", "Could not import matpy_pool: %s", error.c_str());
 		}
-
-		Py_DECREF(o);
-		Py_DECREF(keys);
-		Py_DECREF(items);
-		return a;
-	} else{
-		Py_DECREF(o);
-		mexErrMsgIdAndTxt("matpy:UnsupportedVariableType", "Unsupported variable type");
 	}
-	return NULL;
+	return poolModule;
 }
 
-static void do_get() 
+// Calls matpy_pool.method(*args), stealing args. Returns a new reference to
+// the result.
+static PyObject *callPool(const char *method, PyObject *args)
 {
-    if(nrhs != 2) 
-    {
-        mexErrMsgIdAndTxt("matpy:WrongNumberOfInputs", "Usage: var = py('get', expr)");
-    }
-    if(!mxIsChar(prhs[1])) 
-    {
-        mexErrMsgIdAndTxt("matpy:WrongInputVariableType", "Usage: var = py('get', expr)");
-    }
-    if(nlhs != 1) 
-    {
-        mexErrMsgIdAndTxt("matpy:NoOutputsVariable", "Usage: var = py('get', expr)");
-    }
-
-	char *expr = mxArrayToString(prhs[1]);
-	if (debug) mexPrintf("Evaluating: %s\n", expr);
-	PyCodeObject *code = (PyCodeObject*) Py_CompileString(expr, "no_source", Py_eval_input);
-	mxFree(expr);
-	if (code == NULL) 
+	PyObject *func = PyObject_GetAttrString(getPoolModule(), method);
+	PyObject *result = NULL;
+	if (func != NULL && args != NULL)
 	{
-		PyErr_Print();
-		mexErrMsgIdAndTxt("matpy:PythonError", "Error compiling expression");
+		PhaseTimer timer(PHASE_EXECUTE);
+		result = PyObject_CallObject(func, args);
 	}
-
-	PyObject *o = PyEval_EvalCode(code, globals, globals);
-	if (o == NULL) 
+	Py_XDECREF(func);
+	Py_XDECREF(args);
+	if (result == NULL)
 	{
-		PyErr_Print();
-		mexErrMsgIdAndTxt("matpy:PythonError", "Error evaluating Python expression");
+		std::string error = fetchErrorText();
+		matpyError("matpy:PoolError", "%s", error.c_str());
 	}
-	Py_DECREF(code);
+	return result;
+}
 
-	plhs[0] = py2mat(o);
-	if (plhs[0] == NULL) {
-		mexErrMsgIdAndTxt("matpy:ConversionError", "Error converting to MATLAB variable");
+// Sends a request tuple, which is stolen, to the worker numbered by prhs[2]
+// and returns a new reference to its reply.
+static PyObject *runOnWorker(PyObject *request, const char *usage)
+{
+	if (!mxIsNumeric(prhs[2]) || mxGetNumberOfElements(prhs[2]) != 1)
+	{
+		Py_DECREF(request);
+		matpyError("matpy:WrongInputVariableType", usage);
 	}
+	return callPool("run", Py_BuildValue("(lN)", (long) mxGetScalar(prhs[2]) - 1, request));
 }
 
-static void do_set() 
+// py('pool', ...) runs Python in separate worker processes, so CPU bound
+// work can use every core and a crashing extension only takes a worker down.
+static void do_pool()
 {
-    
-    if(nrhs != 3) 
-    {
-        mexErrMsgIdAndTxt("matpy:WrongNumberOfInputs", "Usage: py('set', var_name, var)");
-    }
-    if(!mxIsChar(prhs[1])) 
-    {
-        mexErrMsgIdAndTxt("matpy:WrongInputVariableType", "Usage: py('set', var_name, var)");
-    }
-
-	char *var_name = mxArrayToString(prhs[1]);
-	PyObject *var = mat2py(prhs[2]);
-
-	if(NULL != var)
+	const char *usage = "Usage: py('pool', 'start', n), py('pool', 'stop'), n = py('pool', 'size'), "
+		"out = py('pool', 'map', func, inputs), py('pool', 'eval', worker, stmt), "
+		"var = py('pool', 'get', worker, expr) or py('pool', 'set', worker, name, value)";
+	if (nrhs < 2 || !mxIsChar(prhs[1]))
 	{
-		addVariableToPython(var_name, var);
-		mxFree(var_name);
+		matpyError("matpy:WrongNumberOfInputs", usage);
 	}
-	else 
+
+	if (isOption(prhs[1], "start") && nrhs <= 3)
 	{
-		if(NULL != var_name)
+		long n = (long) std::max(1u, std::thread::hardware_concurrency());
+		if (nrhs == 3)
 		{
-			mxFree(var_name);
+			if (!mxIsNumeric(prhs[2]) || mxGetNumberOfElements(prhs[2]) != 1 || mxGetScalar(prhs[2]) < 1)
+			{
+				matpyError("matpy:WrongOptionValue", "Pool size must be a positive scalar");
+			}
+			n = (long) mxGetScalar(prhs[2]);
 		}
-		mexErrMsgIdAndTxt("matpy:ExportError", "Error while export to Python");
+		Py_DECREF(callPool("start", Py_BuildValue("(sl)", PYPATH, n)));
 	}
+	else if (isOption(prhs[1], "stop") && nrhs == 2)
+	{
+		Py_DECREF(callPool("stop", PyTuple_New(0)));
+	}
+	else if (isOption(prhs[1], "size") && nrhs == 2)
+	{
+		PyObject *size = callPool("size", PyTuple_New(0));
+		plhs[0] = mxCreateDoubleScalar((double) PyInt_AsLong(size));
+		Py_DECREF(size);
+	}
+	else if (isOption(prhs[1], "map") && nrhs == 4 && mxIsChar(prhs[2]) && mxIsCell(prhs[3]))
+	{
+		size_t n = mxGetNumberOfElements(prhs[3]);
+		PyOwned inputs(PyList_New(n));
+		for (size_t i = 0; i < n; i++)
+		{
+			const mxArray *cell = mxGetCell(prhs[3], i);
+			if (cell == NULL)
+			{
+				matpyError("matpy:NullFieldValue", "Null cell in cell array");
+			}
+			PyObject *item = mat2py(cell);
+			if (item == NULL)
+			{
+				matpyError("matpy:UnsupportedVariableType", "Unsupported variable type in a cell");
+			}
+			PyList_SET_ITEM(inputs.get(), i, item);
+		}
+		char *func = mxArrayToString(prhs[2]);
+		PyObject *args = Py_BuildValue("(sN)", func, inputs.release());
+		mxFree(func);
 
+		PyOwned results(callPool("map_call", args));
+		plhs[0] = mxCreateCellArray(mxGetNumberOfDimensions(prhs[3]), mxGetDimensions(prhs[3]));
+		for (size_t i = 0; i < n; i++)
+		{
+			PyObject *item = PyList_GetItem(results, i);
+			Py_XINCREF(item);
+			mxSetCell(plhs[0], i, py2mat(item));
+		}
+	}
+	else if ((isOption(prhs[1], "eval") || isOption(prhs[1], "get")) && nrhs == 4 && mxIsChar(prhs[3]))
+	{
+		char *src = mxArrayToString(prhs[3]);
+		PyObject *request = Py_BuildValue("(ss)", isOption(prhs[1], "eval") ? "eval" : "get", src);
+		mxFree(src);
+		PyObject *reply = runOnWorker(request, usage);
+		if (isOption(prhs[1], "get"))
+		{
+			plhs[0] = py2mat(reply);
+		}
+		else
+		{
+			Py_DECREF(reply);
+		}
+	}
+	else if (isOption(prhs[1], "set") && nrhs == 5 && mxIsChar(prhs[3]))
+	{
+		char *name = mxArrayToString(prhs[3]);
+		PyObject *request = Py_BuildValue("(ssN)", "set", name, mat2py(prhs[4]));
+		mxFree(name);
+		Py_DECREF(runOnWorker(request, usage));
+	}
+	else
+	{
+		matpyError("matpy:WrongNumberOfInputs", usage);
+	}
 }
 
-static void do_eval() 
+// Runs a sequence of set, eval and get operations in one call. The results
+// of the gets are returned in order in a cell array.
+static void do_batch()
 {
-    
-    if(nrhs != 2) 
-    {
-        mexErrMsgIdAndTxt("matpy:WrongNumberOfInputs", "Usage: py('eval', stmt)");
-    }
-    if(!mxIsChar(prhs[1])) 
-    {
-        mexErrMsgIdAndTxt("matpy:WrongInputVariableType", "Usage: py('eval', stmt)");
-    }
-
-	char *stmt = mxArrayToString(prhs[1]);
-
-	if (debug) mexPrintf("Evaluating: %s\n", stmt);
-	// PyObject *locals = PyDict_New();
-	PyObject *o = PyRun_String(stmt, Py_file_input, globals, globals);
-	// Py_DECREF(locals);
-	mxFree(stmt);
-	if (o == NULL) 
+	const char *usage = "Usage: results = py('batch', {{'set', name, value}, {'eval', stmt}, {'get', expr}, ...})";
+	if (nrhs != 2)
 	{
-		PyErr_Print();
-		mexErrMsgIdAndTxt("matpy:PythonError", "Error while evaluating Python statement");
+		matpyError("matpy:WrongNumberOfInputs", usage);
 	}
-
-	if (nlhs > 0)
+	const mxArray *ops = prhs[1];
+	if (!mxIsCell(ops) && !(mxIsStruct(ops) && mxGetFieldNumber(ops, "op") >= 0 && mxGetFieldNumber(ops, "arg") >= 0))
 	{
-		plhs[0] = py2mat(o);
-		if (plhs[0] == NULL) {
-			mexErrMsgIdAndTxt("matpy:ConversionError", "Error converting to MATLAB variable");
-		}
+		matpyError("matpy:WrongInputVariableType", usage);
 	}
-}
 
-void mexFunction(int nlhs_, mxArray *plhs_[], int nrhs_, const mxArray *prhs_[]) {
-	nlhs = nlhs_;
-	plhs = plhs_;
-	nrhs = nrhs_;
-	prhs = prhs_;
-	static bool been_here = false;
-
-	if (!been_here) {
-		if (debug) mexPrintf("Initializing...\n");
-		dlopen("libpython2.7.so", RTLD_LAZY |RTLD_GLOBAL);
-		Py_SetProgramName((char*)PYPATH);
-		Py_Initialize();
-		initMatpyPrint();
-        module = PyImport_AddModule("__main__");
-        if (NULL == module) 
-        {
-            PyErr_Print();
-            mexErrMsgIdAndTxt("matpy:NumpyNotAccessible", "numpy not accessible");
-        }
-		globals = PyModule_GetDict(module);
-		PyObject *numpy = PyImport_ImportModule("numpy");
-		if (numpy == NULL) {
-			PyErr_Print();
-			mexErrMsgIdAndTxt("matpy:NumpyNotAccessible", "numpy not accessible");
+	size_t nops = mxGetNumberOfElements(ops);
+	std::vector<mxArray*> results;
+	bool native = exportOptions.native;
+	for (size_t i = 0; i < nops; i++)
+	{
+		batchOp = (int) i + 1;
+		exportOptions = ExportOptions();
+		exportOptions.native = native;
+		importOptions = ImportOptions();
+
+		const mxArray *op, *arg, *value;
+		getBatchOp(ops, i, &op, &arg, &value);
+		char cmd[8];
+		mxGetString(op, cmd, sizeof(cmd));
+		char *str = mxArrayToString(arg);
+
+		if (!strcmp(cmd, "set") && value != NULL)
+		{
+			setVariable(str, value);
 		}
-		PyObject *numpy_dict = PyModule_GetDict(numpy);
-		Py_DECREF(numpy);
-		if (debug) mexPrintf("numpy_dict = 0x%08X\n", numpy_dict);
-		np_array_fun = PyDict_GetItemString(numpy_dict, "array");
-		if (np_array_fun == 0) {
-			PyErr_Print();
-			mexErrMsgIdAndTxt("matpy:NumpyArrayNotAccessible", "numpy.array not accessible");
+		else if (!strcmp(cmd, "eval") && (value == NULL || mxIsEmpty(value)))
+		{
+			Py_DECREF(runPython(str, Py_file_input));
 		}
-		if (debug) mexPrintf("np_array_fun = 0x%08X\n", np_array_fun);
-		ndarray_cls = PyDict_GetItemString(numpy_dict, "ndarray");
-		been_here = true;
+		else if (!strcmp(cmd, "get") && (value == NULL || mxIsEmpty(value)))
+		{
+			results.push_back(getExpression(str));
+		}
+		else
+		{
+			matpyError("matpy:WrongBatchOperation", "Operation must be 'set' with a value, 'eval' or 'get'");
+		}
+		mxFree(str);
 	}
+	batchOp = 0;
 
-    if(nrhs == 0) 
-    {
-        mexErrMsgIdAndTxt("matpy:WrongNumberOfInputs", "Usage: py(cmd, varargin)");
-    }
-
-    if(!mxIsChar(prhs[0])) 
-    {
-        mexErrMsgIdAndTxt("matpy:WrongInputVariableType", "Usage: py(cmd, varargin)");
-    }
+	plhs[0] = mxCreateCellMatrix(1, results.size());
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		mxSetCell(plhs[0], i, results[i]);
+	}
+}
 
-	char *cmd = mxArrayToString(prhs[0]);
+// Runs the command cmd, and frees it.
+static void runCommand(char *cmd)
+{
 	if (!strcmp(cmd, "eval")) {
 		mxFree(cmd);
 		do_eval();
 		return;
+	} else if (!strcmp(cmd, "init")) {
+		mxFree(cmd);
+		do_init();
+		return;
+	} else if (!strcmp(cmd, "clear")) {
+		mxFree(cmd);
+		do_clear();
+		return;
+	} else if (!strcmp(cmd, "memory")) {
+		mxFree(cmd);
+		do_memory();
+		return;
 	} else if (!strcmp(cmd, "set")) {
 		mxFree(cmd);
 		do_set();
@@ -614,36 +4567,276 @@ void mexFunction(int nlhs_, mxArray *plhs_[], int nrhs_, const mxArray *prhs_[])
 		mxFree(cmd);
 		do_get();
 		return;
+	} else if (!strcmp(cmd, "ref")) {
+		mxFree(cmd);
+		do_ref();
+		return;
+	} else if (!strcmp(cmd, "deref")) {
+		mxFree(cmd);
+		do_deref();
+		return;
+	} else if (!strcmp(cmd, "release")) {
+		mxFree(cmd);
+		do_release();
+		return;
+	} else if (!strcmp(cmd, "getslice")) {
+		mxFree(cmd);
+		do_getslice();
+		return;
+	} else if (!strcmp(cmd, "setslice")) {
+		mxFree(cmd);
+		do_setslice();
+		return;
+	} else if (!strcmp(cmd, "call")) {
+		mxFree(cmd);
+		do_call();
+		return;
+	} else if (!strcmp(cmd, "batch")) {
+		mxFree(cmd);
+		do_batch();
+		return;
+	} else if (!strcmp(cmd, "eval_async")) {
+		mxFree(cmd);
+		do_async(Py_file_input);
+		return;
+	} else if (!strcmp(cmd, "get_async")) {
+		mxFree(cmd);
+		do_async(Py_eval_input);
+		return;
+	} else if (!strcmp(cmd, "poll")) {
+		mxFree(cmd);
+		do_poll();
+		return;
+	} else if (!strcmp(cmd, "wait")) {
+		mxFree(cmd);
+		do_wait();
+		return;
+	} else if (!strcmp(cmd, "cancel")) {
+		mxFree(cmd);
+		do_cancel();
+		return;
+	} else if (!strcmp(cmd, "pool")) {
+		mxFree(cmd);
+		do_pool();
+		return;
+	} else if (!strcmp(cmd, "stats")) {
+		mxFree(cmd);
+		do_stats();
+		return;
+	} else if (!strcmp(cmd, "cache")) {
+		mxFree(cmd);
+		do_cache();
+		return;
 	} else if (!strcmp(cmd, "debugon")) {
 		debug = true;
 	} else if (!strcmp(cmd, "debugoff")) {
 		debug = false;
 	} else {
 		mxFree(cmd);
-		mexErrMsgIdAndTxt("matpy:UnrecognizedCommand", "Unrecognized cmd");
+		statsCommand.clear();
+		matpyError("matpy:UnrecognizedCommand", "Unrecognized cmd");
 	}
 	mxFree(cmd);
 }
 
+// The options py handles for several commands rather than each command
+// itself: 'capture' on eval, get, call and batch, 'native' on call and batch
+// (set takes it among its own) and 'ns' on the commands that look up names.
+struct CommandOptions
+{
+	bool capture;
+	CommandOptions() : capture(false) {}
+};
+
+// Applies the command option name to options, exportOptions and globals.
+// Returns false if cmd does not take it.
+static bool applyCommandOption(const char *cmd, const char *name, const mxArray *value, CommandOptions *options)
+{
+	bool takesCapture = !strcmp(cmd, "eval") || !strcmp(cmd, "get") || !strcmp(cmd, "call") || !strcmp(cmd, "batch");
+	bool takesNative = !strcmp(cmd, "call") || !strcmp(cmd, "batch");
+	bool takesNamespace = takesCapture || !strcmp(cmd, "set") || !strcmp(cmd, "ref") || !strcmp(cmd, "getslice")
+		|| !strcmp(cmd, "setslice") || !strcmp(cmd, "eval_async") || !strcmp(cmd, "get_async");
+	if (takesCapture && !strcmp(name, "capture"))
+	{
+		// The printed text is returned as an extra, last output
+		options->capture = boolOptionValue(value, name);
+	}
+	else if (takesNamespace && !strcmp(name, "ns"))
+	{
+		globals = getNamespace(value, true);
+	}
+	else if (takesNative && !strcmp(name, "native"))
+	{
+		exportOptions.native = boolOptionValue(value, name);
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+// Takes the command options out of the arguments of cmd, leaving the rest in
+// args, which prhs and nrhs then refer to. Commands with a fixed number of
+// arguments take them as 'name', value pairs anywhere among their own
+// options. call, getslice and setslice take any number of arguments, so
+// there they must come in a trailing 'options', struct pair, which for call
+// follows any 'kw' pair.
+static void takeCommandOptions(const char *cmd, std::vector<const mxArray*> &args, CommandOptions *options)
+{
+	args.assign(prhs, prhs + nrhs);
+	int first = !strcmp(cmd, "set") ? 3 : !strcmp(cmd, "eval") || !strcmp(cmd, "get") || !strcmp(cmd, "ref")
+		|| !strcmp(cmd, "batch") || !strcmp(cmd, "eval_async") || !strcmp(cmd, "get_async") ? 2 : 0;
+	bool variadic = !strcmp(cmd, "call") || !strcmp(cmd, "getslice") || !strcmp(cmd, "setslice");
+
+	if (first > 0 && nrhs > first)
+	{
+		args.resize(first);
+		for (int i = first; i < nrhs; i += 2)
+		{
+			char name[64];
+			bool taken = i + 1 < nrhs && mxIsChar(prhs[i]) && mxGetString(prhs[i], name, sizeof(name)) == 0
+				&& applyCommandOption(cmd, name, prhs[i + 1], options);
+			if (!taken)
+			{
+				args.push_back(prhs[i]);
+				if (i + 1 < nrhs)
+				{
+					args.push_back(prhs[i + 1]);
+				}
+			}
+		}
+	}
+	else if (variadic && nrhs >= 4 && isOption(prhs[nrhs - 2], "options") && mxIsStruct(prhs[nrhs - 1]))
+	{
+		const mxArray *s = prhs[nrhs - 1];
+		if (mxGetNumberOfElements(s) != 1)
+		{
+			matpyError("matpy:WrongOptionValue", "Options must be a scalar struct");
+		}
+		for (int k = 0; k < mxGetNumberOfFields(s); k++)
+		{
+			const char *name = mxGetFieldNameByNumber(s, k);
+			if (!applyCommandOption(cmd, name, mxGetFieldByNumber(s, 0, k), options))
+			{
+				matpyError("matpy:UnrecognizedOption", "'%s' does not take the option '%s'", cmd, name);
+			}
+		}
+		args.resize(nrhs - 2);
+	}
+	prhs = args.empty() ? NULL : &args[0];
+	nrhs = (int) args.size();
+}
+
+static void runMexFunction(int nlhs_, mxArray *plhs_[], int nrhs_, const mxArray *prhs_[]) {
+	nlhs = nlhs_;
+	plhs = plhs_;
+	nrhs = nrhs_;
+	prhs = prhs_;
+	exportOptions = ExportOptions();
+	exportOptions.native = nativeDefault;
+	importOptions = ImportOptions();
+	batchOp = 0;
+	GilGuard gil;
+
+	// py('init', ...) starts the interpreter itself
+	if (!pythonStarted && !(nrhs > 0 && isOption(prhs[0], "init"))) {
+		startPython(NULL, NULL, NULL);
+	}
+
+    if(nrhs == 0) 
+    {
+        matpyError("matpy:WrongNumberOfInputs", "Usage: py(cmd, varargin)");
+    }
+
+    if(!mxIsChar(prhs[0])) 
+    {
+        matpyError("matpy:WrongInputVariableType", "Usage: py(cmd, varargin)");
+    }
+
+	char *cmd = mxArrayToString(prhs[0]);
+	startCommandStats(cmd);
+	CommandStatsGuard stats;
+	int outputs = nlhs;
+	CommandOptions options;
+	globals = mainGlobals;
+	// Stays alive while the command runs on it
+	std::vector<const mxArray*> args;
+	takeCommandOptions(cmd, args, &options);
+	// With no output to return it in, printed text is printed as usual
+	bool capture = options.capture && nlhs > 0;
+	if (capture)
+	{
+		nlhs--;
+	}
+	captureOutput = capture;
+	capturedOutput.clear();
+	runCommand(cmd);
+	if (capture)
+	{
+		captureOutput = false;
+		plhs[outputs - 1] = utf8ToCharRow(capturedOutput);
+		capturedOutput.clear();
+	}
+}
+
+void mexFunction(int nlhs_, mxArray *plhs_[], int nrhs_, const mxArray *prhs_[]) {
+	// A MATLAB function called from Python must not replace the state of
+	// the command that is running it
+	if (callbackDepth > 0) {
+		// PyRef's destructor still has to get through; its handle is
+		// released once the callback returns
+		if (nrhs_ == 2 && isOption(prhs_[0], "release") && mxIsUint64(prhs_[1]) && mxGetNumberOfElements(prhs_[1]) == 1) {
+			pendingReleases.push_back(*(uint64_t*) mxGetData(prhs_[1]));
+			return;
+		}
+		mexErrMsgIdAndTxt("matpy:Reentrant", "py cannot be called from a MATLAB function that Python is calling");
+	}
+
+	// Static, as mexErrMsgIdAndTxt does not return
+	static MatpyError error;
+	try {
+		runMexFunction(nlhs_, plhs_, nrhs_, prhs_);
+		return;
+	} catch (const MatpyError &e) {
+		error = e;
+	} catch (const std::bad_alloc &) {
+		error.id = "matpy:OutOfMemory";
+		error.message = "Out of memory";
+	}
+	// The stack has unwound: references are released, the counters of the
+	// command are folded in and the GIL is free for async jobs
+	captureOutput = false;
+	capturedOutput.clear();
+	mexErrMsgIdAndTxt(error.id.c_str(), "%s", error.message.c_str());
+}
+
 // Note: This function steals the reference to value.
 static void addVariableToPython(const char* name, PyObject *value)
 {
-	int success = PyModule_AddObject(module, name, value);
+	PyOwned owner(value);
+	int success = PyDict_SetItemString(globals, name, value);
 
 	if(-1 == success)
 	{
+		PyErr_Clear();
 		const size_t MAX_SIZE = 100;
 		char message[MAX_SIZE];
-		snprintf(message, MAX_SIZE, "Failed to add '%s' to the module\nValue is: %s", name, pyObjectToString(value));
-		mexErrMsgIdAndTxt("matpy:FailedToAddVariableToPython", message);
+		snprintf(message, MAX_SIZE, "Failed to add '%s' to the module\nValue is: %s", name, pyObjectToString(value).c_str());
+		matpyError("matpy:FailedToAddVariableToPython", "%s", message);
 	}
 }
 
-static const char *pyObjectToString(PyObject *pyObject)
+static std::string pyObjectToString(PyObject *pyObject)
 {
-	PyObject* temp = PyObject_Repr(pyObject);
-	const char *result = PyString_AsString(temp);
-	return result;
+	PyOwned repr(PyObject_Repr(pyObject));
+	const char *text = repr == NULL ? NULL : PyString_AsString(repr);
+	if (text == NULL)
+	{
+		PyErr_Clear();
+		return "<unprintable object>";
+	}
+	return text;
 }
 
 
@@ -4,12 +4,87 @@
 % 	1) the type of command, which can be any of the following:
 % 		a. 'eval' this will run the second parameter as python
 % 		b. 'set'  this will export the third value by name of second parameter to python
-% 		c. 'get'  this will import the second parameter from python by name
-% 		d. 'debugon'  used for debugging
-% 		c. 'debugoff' used for debugging (default is this)
+% 		c. 'get'  this will import the second parameter from python by name,
+% 		   py('get', expr, 'cell', 'packed') imports lists of scalars of one
+% 		   Python type as numeric arrays instead of cell arrays
+% 		d. 'cache' manages the cache of compiled expressions and statements:
+% 		   py('cache', 'clear'), stats = py('cache', 'stats'), py('cache', 'size', n)
+% 		e. 'call' calls a Python function with the remaining arguments, a
+% 		   trailing 'kw', struct(...) pair gives keyword arguments:
+% 		   [a, b] = py('call', 'module.func', x, y, 'kw', struct('k', 1))
+% 		f. 'ref' keeps the value of an expression in Python and returns a
+% 		   PyRef handle to it, which 'set', 'call' and 'batch' accept as a
+% 		   value; 'deref' converts it and 'release' frees it:
+% 		   h = py('ref', expr), v = py('deref', h), py('release', h)
+% 		g. 'getslice' copies part of a Python array, 'setslice' writes part of
+% 		   one in place; indices are 1-based vectors or ':':
+% 		   v = py('getslice', expr, idx1, idx2, ...)
+% 		   py('setslice', expr, idx1, idx2, ..., values)
+% 		h. 'batch' runs a cell array of {'set', name, value}, {'eval', stmt}
+% 		   and {'get', expr} operations, or a struct array with fields op,
+% 		   arg and value, in one call and returns the gets in a cell array
+% 		i. 'eval_async' and 'get_async' queue a statement or expression for
+% 		   a Python worker thread and return a job id; 'poll' returns its
+% 		   state, 'wait' collects its result and 'cancel' stops it and
+% 		   forgets it, releasing a result that was never collected:
+% 		   f = py('get_async', expr), state = py('poll', f),
+% 		   v = py('wait', f, timeout), py('cancel', f)
+% 		j. 'pool' runs Python in separate worker processes:
+% 		   py('pool', 'start', n), py('pool', 'stop'), n = py('pool', 'size'),
+% 		   out = py('pool', 'map', 'module.func', inputs) with a cell of inputs,
+% 		   py('pool', 'eval', w, stmt), v = py('pool', 'get', w, expr) and
+% 		   py('pool', 'set', w, name, value) for worker number w
+% 		k. 'stats' returns per command call counts, times, phase times and
+% 		   bytes and objects converted; py('stats', 'reset') clears them and
+% 		   py('stats', 'trace', file) ... py('stats', 'trace', '') records a
+% 		   Chrome trace_event timeline into file
+% 		l. 'init' starts Python before the first command needs it, with a
+% 		   struct of options: 'library' the libpython to load, 'home' the
+% 		   PYTHONHOME, 'path' directories to put first on sys.path and
+% 		   'modules' modules to import; returns the seconds spent in each
+% 		   phase. 'path' and 'modules' also work once Python is running:
+% 		   times = py('init', struct('modules', {{'scipy.sparse'}}))
+% 		m. 'clear' drops the variables of a namespace, and a namespace
+% 		   other than '__main__' itself, or only the named variables;
+% 		   '__main__' keeps its imported modules:
+% 		   py('clear', ns), py('clear', ns, {'x', 'y'})
+% 		n. 'memory' reports the bytes the variables of each namespace hold
+% 		   and lists those holding at least minBytes (default 1 MiB):
+% 		   report = py('memory', minBytes)
+% 		o. 'debugon'  used for debugging
+% 		p. 'debugoff' used for debugging (default is this)
 % 	2) this parameter will interact with python depending on what is passed in
 % 		the first parameter, see above for what that would be
 %	3) only for 'set' command, see above
+%	4) optional 'name', value pairs for 'set':
+%		'copy'  when true the exported array gets its own NumPy buffer
+%		        instead of a private duplicate of the MATLAB data
+%		'lossy' when true allows exports that lose precision, such as
+%		        complex int64 to complex128
+%		'struct' how struct arrays are exported: 'lists' (default) gives
+%		        a dict of lists, 'columns' a dict of ndarrays with the
+%		        struct's dimensions and 'records' a NumPy record array
+%		'cell'  how cell arrays are exported: 'lists' (default) gives a
+%		        list, 'packed' an ndarray for cells of same class scalars
+%		        and a unicode ndarray for cellstrs
+%		'native' when true real 1x1 values are exported as Python
+%		        scalars and vectors as 1-d ndarrays; also an option of
+%		        'call' and 'batch', and an 'init' option that sets the
+%		        default
+%	5) 'eval', 'get', 'call' and 'batch' accept a 'capture', true option,
+%	   which returns what Python printed to stdout and stderr as an extra
+%	   last output instead of printing it:
+%	   [~, txt] = py('eval', stmt, 'capture', true)
+%	6) 'eval', 'set', 'get', 'call', 'ref', 'batch', 'getslice', 'setslice',
+%	   'eval_async' and 'get_async' accept an 'ns', name option, which
+%	   runs them in the namespace name instead of '__main__', creating it
+%	   on first use:
+%	   py('set', 'x', 1, 'ns', 'model'), py('get', 'x', 'ns', 'model')
+%	7) Options 5 and 6 and 'native' follow the arguments of commands that
+%	   take a fixed number of them as 'name', value pairs in any order.
+%	   'call', 'getslice' and 'setslice' take them in a trailing
+%	   'options', struct(...) pair instead, after any 'kw' pair:
+%	   v = py('call', f, x, 'options', struct('ns', 'model', 'capture', true))
 %
 % Output:
 % 	only for 'get' command, will return the value stored in python
@@ -18,41 +93,189 @@
 % 	py('eval', 'print "hello, world"')
 %	py('eval', 'print 2+2')
 %	py('set', 'name_of_var', var)
+%	py('set', 'name_of_var', var, 'copy', true)
 %	var = py('get' 'name_of_var')
+%	out = py('batch', {{'set', 'x', 1}, {'eval', 'y = x + 1'}, {'get', 'y'}})
 
 function varargout = py(varargin)
 	lastWorkingDir = pwd;
 	cd(mfiledir);
 
-	[pyExecutablePath, pyIncludePath, pyLibPath, pyVersion] = getPythonPaths();
-	pythonVersionNoBuildNumber = pyVersion(1:3);
+	try
+		buildMex();
+	catch e
+		cd(lastWorkingDir);
+		rethrow(e);
+	end
+
+	cd(lastWorkingDir);
+
+	[varargout{1:nargout}] = py(varargin{:});
+end
+
+% Builds py.cpp, unless a build for the same Python install, NumPy, source
+% and MATLAB platform is in the cache, in which case it is copied instead.
+% The source is keyed on its content, since checkouts and copies change its
+% modification time without changing it.
+function buildMex()
+	pyExecutablePath = getPyExecutablePath();
+	cacheDir = fullfile(homeDir(), '.matpy', 'cache');
+	paths = getPythonPaths(pyExecutablePath, cacheDir);
+	key = sha256(sprintf('%s|%s|%s|%s|%s|%s', pyExecutablePath, paths.stamp, paths.numpyVersion, ...
+		paths.numpyInclude, mexext, sourceDigest('py.cpp', cacheDir)));
+	cachedMex = fullfile(cacheDir, ['py_', key, '.', mexext]);
+	if exist(cachedMex, 'file')
+		copyfile(cachedMex, ['py.', mexext]);
+		return;
+	end
+
+	pythonVersionNoBuildNumber = paths.version(1:3);
 
 	if ispc
 		pythonVersionNoBuildNumber = strrep( pythonVersionNoBuildNumber, '.', '' );
 	end
 
-	PYINCLUDEDIR = ['-I', pyIncludePath];
-	PYLIBPATH = ['-L', fullfile( pyLibPath, '..' )];
+	PYINCLUDEDIR = ['-I', paths.include];
+	NPINCLUDEDIR = ['-I', paths.numpyInclude];
+	PYLIBPATH = ['-L', fullfile( paths.lib, '..' )];
 	PYPATH = ['''-DPYPATH=\"', pyExecutablePath, '\"'''];
 	CFLAGS = ['CFLAGS="\$CFLAGS ', ' -lpython', pythonVersionNoBuildNumber, ' -ldl ', PYPATH, '"'];
 
+	mex('py.cpp', CFLAGS, '-Dchar16_t=uint16_T', PYINCLUDEDIR, NPINCLUDEDIR, PYLIBPATH);
+
+	% Without the cache only the next build is slower
 	try
-		mex('py.cpp', CFLAGS, '-Dchar16_t=uint16_T', PYINCLUDEDIR, PYLIBPATH);
-	catch e
-		cd(lastWorkingDir);
-		rethrow(e);
+		if ~exist(cacheDir, 'dir')
+			mkdir(cacheDir);
+		end
+		copyfile(['py.', mexext], cachedMex);
+	catch
 	end
+end
 
-	cd(lastWorkingDir);
+% Returns the version, include, lib and numpy include paths and the numpy
+% version of a Python install. Only a quick run of the interpreter is needed
+% when they are cached for the interpreter it runs and the numpy headers as
+% they are now.
+function paths = getPythonPaths(pyExecutablePath, cacheDir)
+	SUCCESS = 0;
+	cacheFile = fullfile(cacheDir, 'paths.mat');
+	stamp = pythonStamp(pyExecutablePath);
 
-	[varargout{1:nargout}] = py(varargin{:});
+	entries = struct('executable', {}, 'stamp', {}, 'version', {}, 'include', {}, 'lib', {}, ...
+		'numpyInclude', {}, 'numpyVersion', {}, 'numpyStamp', {});
+	if exist(cacheFile, 'file')
+		loaded = load(cacheFile);
+		% Entries written before numpy was tracked are dropped
+		if isfield(loaded.entries, 'numpyStamp')
+			entries = loaded.entries;
+		end
+	end
+	for i = 1:numel(entries)
+		if strcmp(entries(i).executable, pyExecutablePath) && strcmp(entries(i).stamp, stamp) ...
+				&& strcmp(entries(i).numpyStamp, numpyStamp(entries(i).numpyInclude))
+			paths = entries(i);
+			return;
+		end
+	end
+
+	% One run of the interpreter finds everything
+	script = ['import sys, platform, numpy; from distutils import sysconfig; ', ...
+		'print(platform.python_version()); print(sysconfig.get_python_inc()); ', ...
+		'print(sysconfig.PREFIX if sys.platform == ''win32'' else sysconfig.get_python_lib(False, True)); ', ...
+		'print(numpy.get_include()); print(numpy.__version__)'];
+	[success, output] = system([pyExecutablePath, ' -c "', script, '"']);
+	lines = strtrim(regexp(strtrim(output), '\n', 'split'));
+	if success ~= SUCCESS || numel(lines) < 5
+		error('Python, its include and lib directories or numpy could not be found: %s', output);
+	end
+	lines = lines(end-4:end);
+
+	paths = struct('executable', pyExecutablePath, 'stamp', stamp, 'version', lines{1}, ...
+		'include', lines{2}, 'lib', lines{3}, 'numpyInclude', lines{4}, 'numpyVersion', lines{5}, ...
+		'numpyStamp', numpyStamp(lines{4}));
+	if ispc
+		paths.lib = fullfile( paths.lib, 'libs' );
+	end
+
+	entries = [entries(~strcmp({entries.executable}, pyExecutablePath)), paths];
+	try
+		if ~exist(cacheDir, 'dir')
+			mkdir(cacheDir);
+		end
+		save(cacheFile, 'entries');
+	catch
+	end
 end
 
-function [pyExecutablePath, pyIncludePath, pyLibPath, pyVersion] = getPythonPaths()
-	pyExecutablePath = getPyExecutablePath();
-	pyIncludePath = getPyIncludePath(pyExecutablePath);
-	pyLibPath = getPyLibPath(pyExecutablePath);
-	pyVersion = getPyVersion(pyExecutablePath);
+% Identifies the interpreter an executable runs by its version, prefix and
+% resolved path. The executable itself may be a shim or symlink that stays
+% the same when the interpreter behind it is upgraded or switched.
+function stamp = pythonStamp(pyExecutablePath)
+	SUCCESS = 0;
+	script = ['import sys, os; print(''|''.join([sys.version.replace(chr(10), '' ''), ', ...
+		'sys.prefix, os.path.realpath(sys.executable)]))'];
+	[success, output] = system([pyExecutablePath, ' -c "', script, '"']);
+	lines = strtrim(regexp(strtrim(output), '\n', 'split'));
+	if success ~= SUCCESS || isempty(lines{end})
+		error('Python could not be run: %s', output);
+	end
+	stamp = lines{end};
+end
+
+% Changes whenever a file is replaced or rewritten.
+function stamp = fileStamp(path)
+	info = dir(path);
+	if numel(info) ~= 1
+		stamp = '';
+	else
+		stamp = sprintf('%.6f|%d', info.datenum, info.bytes);
+	end
+end
+
+% Changes whenever numpy is upgraded or reinstalled, which rewrites its
+% configuration header.
+function stamp = numpyStamp(numpyInclude)
+	stamp = fileStamp(fullfile(numpyInclude, 'numpy', '_numpyconfig.h'));
+end
+
+% Returns the SHA-256 of the content of a source file. It is only hashed
+% again when its stamp changed since the digest was cached.
+function digest = sourceDigest(path, cacheDir)
+	cacheFile = fullfile(cacheDir, 'source.mat');
+	stamp = fileStamp(path);
+	if exist(cacheFile, 'file')
+		loaded = load(cacheFile);
+		if isfield(loaded, 'stamp') && strcmp(loaded.stamp, stamp)
+			digest = loaded.digest;
+			return;
+		end
+	end
+
+	fid = fopen(path, 'r');
+	if fid < 0
+		error('Could not read %s', path);
+	end
+	bytes = fread(fid, Inf, '*uint8');
+	fclose(fid);
+	digest = sha256(bytes);
+	try
+		if ~exist(cacheDir, 'dir')
+			mkdir(cacheDir);
+		end
+		save(cacheFile, 'stamp', 'digest');
+	catch
+	end
+end
+
+% Returns the SHA-256 of a char array, as UTF-8, or of uint8 bytes as hex.
+function digest = sha256(data)
+	if ischar(data)
+		data = unicode2native(data, 'UTF-8');
+	end
+	md = java.security.MessageDigest.getInstance('SHA-256');
+	md.update(typecast(uint8(data(:)), 'int8'));
+	digest = sprintf('%02x', typecast(md.digest(), 'uint8'));
 end
 
 function executable = getPyExecutablePath()
@@ -79,45 +302,6 @@ function executable = getPyExecutablePath()
 	executable = strtrim(executable);
 end
 
-function pyVersion = getPyVersion(pyExecutablePath)
-	SUCCESS = 0;
-	[success pyVersion] = system([pyExecutablePath, ' -c "import platform; print(platform.python_version())"']);
-	if success ~= SUCCESS
-		error('Could not get version number of python');
-	end
-	pyVersion = strtrim(pyVersion);
-end
-
-function pyIncludePath = getPyIncludePath(pyExecutablePath)
-	SUCCESS = 0;
-	[success, pyIncludePath] = system([pyExecutablePath, ' -c "from distutils.sysconfig import get_python_inc; print(get_python_inc())"']);
-	if success ~= SUCCESS
-		error('Python include could not be found');
-	end
-	pyIncludePath = strtrim(pyIncludePath);
-end
-
-function pyLibPath = getPyLibPath(pyExecutablePath)
-	SUCCESS = 0;
-
-	if ispc
-		command = [pyExecutablePath, ' -c "from distutils.sysconfig import PREFIX; print(PREFIX)"'];
-	else
-		command = [pyExecutablePath, ' -c "from distutils.sysconfig import get_python_lib; print(get_python_lib(False, True))"'];
-	end
-
-	[success, pyLibPath] = system(command);
-	if success ~= SUCCESS
-		error('Python lib could not be found');
-	end
-
-	pyLibPath = strtrim(pyLibPath);
-
-	if ispc
-		pyLibPath = fullfile( pyLibPath, 'libs' );
-	end
-end
-
 function path = homeDir
 	path = getenv('HOME');
 	if isempty( path )